@@ -16,6 +16,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <unistd.h>
+#include <sys/select.h>
 #include <libpq-fe.h>
 
 #define TEST_SKIPPED 0
@@ -39,6 +41,12 @@ static int load_schema(PGconn*);
 static int test_simple_select(PGconn*);
 static int test_simple_insert(PGconn*);
 static int test_large_insert(PGconn*);
+static int test_flush(PGconn*);
+static int test_cancel(PGconn*);
+static int test_session_set(PGconn*);
+static int test_deallocate(PGconn*);
+static int test_transaction(PGconn*);
+static int test_reset(PGconn*);
 
 typedef int (*test_runner)(PGconn*);
 static struct {
@@ -49,6 +57,12 @@ static struct {
 	{ "Simple SELECT", test_simple_select, 0 },
 	{ "Simple INSERT", test_simple_insert, 0 },
 	{ "Large Payload INSERT", test_large_insert, 0 },
+	{ "Extended Query, Flush before Sync", test_flush, 0 },
+	{ "Query Cancel", test_cancel, 0 },
+	{ "Session SET, pinned to its connection", test_session_set, 0 },
+	{ "DEALLOCATE and DISCARD ALL", test_deallocate, 0 },
+	{ "Transaction, held across statements", test_transaction, 0 },
+	{ "Pooled connections are reset", test_reset, 0 },
 };
 
 static FILE *ERROR;
@@ -234,3 +248,388 @@ static int test_large_insert(PGconn *conn)
 		}
 	}
 }
+
+/* Wait (a little while) for the next result,
+   without blocking forever if it never comes. */
+static PGresult* AWAIT(PGconn *conn, int secs)
+{
+	struct timeval tv;
+	fd_set fds;
+
+	while (PQisBusy(conn)) {
+		FD_ZERO(&fds);
+		FD_SET(PQsocket(conn), &fds);
+		tv.tv_sec  = secs;
+		tv.tv_usec = 0;
+		if (select(PQsocket(conn) + 1, &fds, NULL, NULL, &tv) <= 0) {
+			fprintf(ERROR, "timed out waiting for a result\n");
+			return NULL;
+		}
+		if (!PQconsumeInput(conn)) {
+			fprintf(ERROR, "failed to read from pgrouter: %s\n", PQerrorMessage(conn));
+			return NULL;
+		}
+	}
+	return PQgetResult(conn);
+}
+
+static int test_flush(PGconn *conn)
+{
+#ifdef LIBPQ_HAS_PIPELINING
+	/* Parse / Bind / Describe / Execute / Flush; the replies
+	   have to come back before the client sends the Sync */
+	const char *params[] = { "1" };
+	PGresult *r;
+	int rc, i;
+
+	fprintf(ERROR, "Running data query in pipeline mode, with a Flush\n"
+	               "  `SELECT note FROM notes WHERE id = $1`\n");
+	if (!PQenterPipelineMode(conn)
+	 || !PQsendQueryParams(conn, "SELECT note FROM notes WHERE id = $1",
+	                       1, NULL, params, NULL, NULL, 0)
+	 || !PQsendFlushRequest(conn)
+	 || PQflush(conn) != 0) {
+		fprintf(ERROR, "failed to send the query: %s\n", PQerrorMessage(conn));
+		return TEST_ERROR;
+	}
+
+	rc = TEST_OK;
+	r = AWAIT(conn, 5);
+	if (!r || PQresultStatus(r) != PGRES_TUPLES_OK || PQntuples(r) != 1) {
+		fprintf(ERROR, "no result before the Sync: %s\n",
+				r ? PQresultErrorMessage(r) : "(none)");
+		rc = TEST_FAIL;
+	}
+	PQclear(r);
+
+	if (!PQpipelineSync(conn)) {
+		fprintf(ERROR, "failed to send the Sync: %s\n", PQerrorMessage(conn));
+		return TEST_ERROR;
+	}
+	/* (a NULL ends the query's results, then comes the Sync's) */
+	for (i = 0; i < 3; i++) {
+		r = AWAIT(conn, 5);
+		if (r && PQresultStatus(r) == PGRES_PIPELINE_SYNC) {
+			break;
+		}
+		PQclear(r);
+	}
+	if (i == 3) {
+		fprintf(ERROR, "no ReadyForQuery after the Sync\n");
+		rc = TEST_FAIL;
+	}
+	PQclear(r);
+	PQexitPipelineMode(conn);
+	return rc;
+#else
+	return TEST_SKIPPED;
+#endif
+}
+
+static int test_cancel(PGconn *conn)
+{
+	PGcancel *cancel;
+	PGresult *r;
+	const char *state;
+	char err[256];
+	int rc;
+
+	fprintf(ERROR, "Running a long query, and cancelling it\n"
+	               "  `SELECT pg_sleep(30)`\n");
+	if (!PQsendQuery(conn, "SELECT pg_sleep(30)")) {
+		fprintf(ERROR, "failed to send the query: %s\n", PQerrorMessage(conn));
+		return TEST_ERROR;
+	}
+	usleep(500 * 1000);
+
+	/* (the key data is pgrouter's, not any one backend's) */
+	cancel = PQgetCancel(conn);
+	if (!cancel) {
+		fprintf(ERROR, "out of memory!\n");
+		return TEST_ERROR;
+	}
+	if (!PQcancel(cancel, err, sizeof(err))) {
+		fprintf(ERROR, "failed to send the cancel: %s\n", err);
+		PQfreeCancel(cancel);
+		return TEST_ERROR;
+	}
+	PQfreeCancel(cancel);
+
+	rc = TEST_OK;
+	r = AWAIT(conn, 10);
+	state = r ? PQresultErrorField(r, PG_DIAG_SQLSTATE) : NULL;
+	if (!r || PQresultStatus(r) != PGRES_FATAL_ERROR || !state || strcmp(state, "57014") != 0) {
+		fprintf(ERROR, "the query wasn't cancelled: %s\n",
+				r ? PQresStatus(PQresultStatus(r)) : "(no result)");
+		rc = TEST_FAIL;
+	}
+	for (; r; r = PQgetResult(conn)) {
+		PQclear(r);
+	}
+	return rc;
+}
+
+/* Connect another client, just like the one given. */
+static PGconn* CONNECT(PGconn *conn)
+{
+	PGconn *other;
+
+	other = PQsetdbLogin(PQhost(conn), PQport(conn), NULL, NULL,
+	                     PQdb(conn), PQuser(conn), PQpass(conn));
+	if (!other || PQstatus(other) != CONNECTION_OK) {
+		fprintf(ERROR, "failed to connect another client: %s\n",
+				other ? PQerrorMessage(other) : "out of memory");
+		PQfinish(other);
+		return NULL;
+	}
+	return other;
+}
+
+static int test_session_set(PGconn *conn)
+{
+	/* a session-level SET pins the session to its backend
+	   connection, even when pooling by transaction, so that
+	   it neither leaks into other clients' sessions, nor
+	   goes missing from its own */
+	PGconn *other;
+	PGresult *r;
+	int i, rc;
+
+	other = CONNECT(conn);
+	if (!other) {
+		return TEST_ERROR;
+	}
+
+	rc = TEST_OK;
+	if (!COMMAND_QUERY(conn, "SET application_name = 'pgrouter-driver'")) {
+		rc = TEST_FAIL;
+	}
+	for (i = 0; rc == TEST_OK && i < 5; i++) {
+		/* (a read-write transaction, to land on the master) */
+		if (!COMMAND_QUERY(other, "BEGIN")
+		 || !DATA_QUERY(other, &r, "SHOW application_name")) {
+			rc = TEST_FAIL;
+			break;
+		}
+		if (PQntuples(r) == 1 && strcmp(PQgetvalue(r, 0, 0), "pgrouter-driver") == 0) {
+			fprintf(ERROR, "another client's SET leaked into this session\n");
+			rc = TEST_FAIL;
+		}
+		PQclear(r);
+		COMMAND_QUERY(other, "COMMIT");
+
+		if (!DATA_QUERY(conn, &r, "SHOW application_name")) {
+			rc = TEST_FAIL;
+			break;
+		}
+		if (PQntuples(r) != 1 || strcmp(PQgetvalue(r, 0, 0), "pgrouter-driver") != 0) {
+			fprintf(ERROR, "application_name is '%s', expected 'pgrouter-driver'\n",
+					PQntuples(r) == 1 ? PQgetvalue(r, 0, 0) : "(no rows)");
+			rc = TEST_FAIL;
+		}
+		PQclear(r);
+	}
+
+	PQfinish(other);
+	return rc;
+}
+
+static int PREPARE(PGconn *conn, const char *name, const char *sql)
+{
+	PGresult *r;
+	int ok;
+
+	fprintf(ERROR, "Preparing statement `%s`\n  `%s`\n", name, sql);
+	r = PQprepare(conn, name, sql, 0, NULL);
+	if (!r) {
+		fprintf(ERROR, "out of memory!\n");
+		return 0;
+	}
+	ok = PQresultStatus(r) == PGRES_COMMAND_OK;
+	if (!ok) {
+		fprintf(ERROR, "prepare failed: %s\n", PQresultErrorMessage(r));
+	}
+	PQclear(r);
+	return ok;
+}
+
+static int PREPARED_QUERY(PGconn *conn, const char *name)
+{
+	PGresult *r;
+	int ok;
+
+	fprintf(ERROR, "Running prepared statement `%s`\n", name);
+	r = PQexecPrepared(conn, name, 0, NULL, NULL, NULL, 0);
+	if (!r) {
+		fprintf(ERROR, "out of memory!\n");
+		return 0;
+	}
+	ok = PQresultStatus(r) == PGRES_TUPLES_OK;
+	if (!ok) {
+		fprintf(ERROR, "query failed: %s\n", PQresultErrorMessage(r));
+	}
+	PQclear(r);
+	return ok;
+}
+
+static int test_deallocate(PGconn *conn)
+{
+	/* pgrouter keeps track of the statements each client has
+	   prepared, to prepare them again on whichever backend
+	   connection a query lands; what the client deallocates
+	   has to be forgotten (but only for that client) */
+	static const char *how[] = {
+		"/* just the one */ DEALLOCATE note",
+		"-- all of them\nDEALLOCATE ALL",
+		"DISCARD ALL",
+	};
+	PGconn *x, *y;
+	PGresult *r;
+	int i, j, rc;
+
+	/* (which backend connections the two clients end up on
+	    varies, so go around a few times, with new clients) */
+	rc = TEST_OK;
+	for (i = 0; rc == TEST_OK && i < 10 * sizeof(how) / sizeof(how[0]); i++) {
+		if (!(x = CONNECT(conn))) {
+			return TEST_ERROR;
+		}
+		if (!(y = CONNECT(conn))) {
+			PQfinish(x);
+			return TEST_ERROR;
+		}
+
+		if (!PREPARE(y, "note", "SELECT note FROM notes WHERE id = 1")
+		 || !PREPARE(x, "note", "SELECT note FROM notes WHERE id = 1")) {
+			rc = TEST_FAIL;
+		}
+
+		fprintf(ERROR, "Running simple command query\n  `%s`\n", how[i % 3]);
+		r = PQexec(x, how[i % 3]);
+		if (!r || PQresultStatus(r) != PGRES_COMMAND_OK) {
+			fprintf(ERROR, "query failed: %s\n", r ? PQresultErrorMessage(r) : "out of memory");
+			rc = TEST_FAIL;
+		}
+		PQclear(r);
+
+		/* the other client still has its statement, and this
+		   one can prepare a new one by the same name */
+		for (j = 0; rc == TEST_OK && j < 3; j++) {
+			if (!PREPARED_QUERY(y, "note")) {
+				rc = TEST_FAIL;
+			}
+		}
+		if (rc == TEST_OK
+		 && !PREPARE(x, "note", "SELECT note FROM notes WHERE id = 2")) {
+			rc = TEST_FAIL;
+		}
+		for (j = 0; rc == TEST_OK && j < 3; j++) {
+			if (!PREPARED_QUERY(x, "note")) {
+				rc = TEST_FAIL;
+			}
+		}
+
+		PQfinish(x);
+		PQfinish(y);
+	}
+
+	return rc;
+}
+
+static int test_transaction(PGconn *conn)
+{
+	/* when pooling by transaction, the backend connection of
+	   an open transaction belongs to its client until it
+	   ends; nobody else gets to see it, in the meantime.
+	   (new clients, since this one may well be pinned) */
+	PGconn *x, *y;
+	PGresult *r;
+	int i, rc;
+
+	if (!(x = CONNECT(conn))) {
+		return TEST_ERROR;
+	}
+	if (!(y = CONNECT(conn))) {
+		PQfinish(x);
+		return TEST_ERROR;
+	}
+
+	rc = TEST_OK;
+	if (!COMMAND_QUERY(x, "BEGIN")
+	 || !COMMAND_QUERY(x, "INSERT INTO notes (id, note) VALUES (5, 'in a transaction')")) {
+		rc = TEST_FAIL;
+	}
+	for (i = 0; rc == TEST_OK && i < 5; i++) {
+		if (!COMMAND_QUERY(y, "BEGIN")
+		 || !COMMAND_QUERY(y, "COMMIT")
+		 || !DATA_QUERY(y, &r, "SELECT note FROM notes WHERE id = 1")) {
+			rc = TEST_FAIL;
+			break;
+		}
+		PQclear(r);
+		if (PQtransactionStatus(y) != PQTRANS_IDLE) {
+			fprintf(ERROR, "another client ended up in this client's transaction\n");
+			rc = TEST_FAIL;
+		}
+
+		if (!DATA_QUERY(x, &r, "SELECT note FROM notes WHERE id = 5")) {
+			rc = TEST_FAIL;
+			break;
+		}
+		PQclear(r);
+		if (PQtransactionStatus(x) != PQTRANS_INTRANS) {
+			fprintf(ERROR, "the transaction went missing\n");
+			rc = TEST_FAIL;
+		}
+	}
+	COMMAND_QUERY(x, "ROLLBACK");
+	if (rc == TEST_OK && PQtransactionStatus(x) != PQTRANS_IDLE) {
+		fprintf(ERROR, "the transaction didn't end with the ROLLBACK\n");
+		rc = TEST_FAIL;
+	}
+
+	PQfinish(x);
+	PQfinish(y);
+	return rc;
+}
+
+static int test_reset(PGconn *conn)
+{
+	/* a backend connection goes back into the pool when its
+	   client is done with it, but whatever the client left
+	   behind (here, a SET) mustn't go to the next one */
+	PGconn *x;
+	PGresult *r;
+	int i, rc;
+
+	rc = TEST_OK;
+	for (i = 0; rc == TEST_OK && i < 5; i++) {
+		if (!(x = CONNECT(conn))) {
+			return TEST_ERROR;
+		}
+		if (!COMMAND_QUERY(x, "BEGIN")
+		 || !COMMAND_QUERY(x, "SET application_name = 'pgrouter-leftover'")
+		 || !COMMAND_QUERY(x, "COMMIT")) {
+			rc = TEST_FAIL;
+		}
+		PQfinish(x);
+
+		if (!(x = CONNECT(conn))) {
+			return TEST_ERROR;
+		}
+		if (!COMMAND_QUERY(x, "BEGIN")
+		 || !DATA_QUERY(x, &r, "SHOW application_name")) {
+			PQfinish(x);
+			return TEST_FAIL;
+		}
+		if (PQntuples(r) == 1 && strcmp(PQgetvalue(r, 0, 0), "pgrouter-leftover") == 0) {
+			fprintf(ERROR, "a pooled connection kept the last client's SET\n");
+			rc = TEST_FAIL;
+		}
+		PQclear(r);
+		COMMAND_QUERY(x, "COMMIT");
+		PQfinish(x);
+	}
+
+	return rc;
+}
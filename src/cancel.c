@@ -0,0 +1,350 @@
+/*
+  Copyright (c) 2016 James Hunt
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+ */
+
+#include "pgrouter.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#define SUBSYS "cancel"
+#include "locks.inc.c"
+
+/*
+   Clients can't be given the BackendKeyData of a backend
+   connection: a session may talk to more than one backend,
+   and (when pooling) to different connections over time,
+   some of which will go on to serve other clients.
+
+   Instead, each session gets key data of our own making,
+   and we keep a map (hashed on the process ID we made up)
+   from that to the real process ID and secret key of the
+   backend connection running the session's current query,
+   if any.  A CancelRequest that comes in (on a connection
+   of its own, to whichever worker) is checked against the
+   map and, if the secret matches, sent on to that backend.
+ */
+
+static CANCELKEY** bucket(CONTEXT *c, uint32_t pid)
+{
+	return &c->cancel.keys[pid % CANCEL_BUCKETS];
+}
+
+/* Must be called with the cancel map locked. */
+static CANCELKEY* lookup(CONTEXT *c, uint32_t pid)
+{
+	CANCELKEY *k;
+
+	for (k = *bucket(c, pid); k; k = k->next) {
+		if (k->pid == pid) {
+			return k;
+		}
+	}
+	return NULL;
+}
+
+/* Issue new key data, for a new client session. */
+void pgr_cancel_register(CONTEXT *c, uint32_t *pid, uint32_t *key)
+{
+	CANCELKEY *k;
+
+	k = calloc(1, sizeof(CANCELKEY));
+	if (!k) {
+		pgr_abort(ABORT_MEMFAIL);
+	}
+	/* (the pid goes out in the clear, and only has to be
+	    unique; the key is all that keeps other people from
+	    cancelling this session's queries) */
+	pgr_rand_bytes(&k->key, sizeof(k->key));
+	k->index = -1;
+
+	wrlock(&c->cancel.lock, "cancel", 0);
+	do {
+		k->pid = (uint32_t)pgr_rand(1, 0x7fffffff);
+	} while (lookup(c, k->pid));
+
+	k->next = *bucket(c, k->pid);
+	*bucket(c, k->pid) = k;
+	unlock(&c->cancel.lock, "cancel", 0);
+
+	*pid = k->pid;
+	*key = k->key;
+}
+
+/* Point cancels for the session with the given key data
+   at a backend connection (or, if `be` is NULL, at none). */
+void pgr_cancel_target(CONTEXT *c, uint32_t pid, CONNECTION *be)
+{
+	CANCELKEY *k;
+
+	wrlock(&c->cancel.lock, "cancel", 0);
+	k = lookup(c, pid);
+	if (k) {
+		if (be && be->greeting.pid != 0) {
+			k->index  = be->index;
+			k->be_pid = be->greeting.pid;
+			k->be_key = be->greeting.key;
+		} else {
+			k->index  = -1;
+		}
+	}
+	unlock(&c->cancel.lock, "cancel", 0);
+}
+
+/* Forget the key data of a session that's over. */
+void pgr_cancel_forget(CONTEXT *c, uint32_t pid)
+{
+	CANCELKEY *k, **kk;
+
+	wrlock(&c->cancel.lock, "cancel", 0);
+	for (kk = bucket(c, pid); (k = *kk) != NULL; kk = &k->next) {
+		if (k->pid == pid) {
+			*kk = k->next;
+			free(k);
+			break;
+		}
+	}
+	unlock(&c->cancel.lock, "cancel", 0);
+}
+
+/* Handle a CancelRequest from a client, by sending one of
+   our own to the backend running that client's query (if
+   the key data checks out, and there is such a backend).
+   Like postgres, we never tell the client how it went.
+
+   This only starts the (non-blocking) connection to the
+   backend, leaving its descriptor in `fe->cancel.fd`; the
+   worker watches it with the rest of the session, and calls
+   pgr_cancel_send() once it's writable.  Returns 0 if a
+   cancel is underway, and non-zero if there won't be one. */
+int pgr_cancel(CONNECTION *fe, uint32_t pid, uint32_t key)
+{
+	CONTEXT *c = fe->context;
+	CANCELKEY *k;
+	char *host;
+	int i, port;
+
+	rdlock(&c->cancel.lock, "cancel", 0);
+	k = lookup(c, pid);
+	if (!k || k->key != key || k->index < 0) {
+		pgr_debugf("ignoring CancelRequest for pid %u: %s", pid,
+				!k ? "no such session" : k->key != key ? "wrong key" : "nothing running");
+		unlock(&c->cancel.lock, "cancel", 0);
+		return 1;
+	}
+	fe->cancel.msg[0] = htonl(16);
+	fe->cancel.msg[1] = htonl(80877102);
+	fe->cancel.msg[2] = htonl(k->be_pid);
+	fe->cancel.msg[3] = htonl(k->be_key);
+	i = k->index;
+	unlock(&c->cancel.lock, "cancel", 0);
+
+	rdlock(&c->lock, "context", 0);
+	rdlock(&c->backends[i].lock, "backend", i);
+	host = strdup(c->backends[i].hostname);
+	port = c->backends[i].port;
+	unlock(&c->backends[i].lock, "backend", i);
+	unlock(&c->lock, "context", 0);
+	if (!host) {
+		pgr_abort(ABORT_MEMFAIL);
+	}
+
+	pgr_debugf("forwarding CancelRequest for pid %u to backend pid %u on %s:%d",
+			pid, ntohl(fe->cancel.msg[2]), host, port);
+	fe->cancel.fd = pgr_connect_async(host, port);
+	if (fe->cancel.fd < 0) {
+		pgr_logf(stderr, LOG_ERR, "[cancel] failed to connect to %s:%d to cancel a query",
+				host, port);
+		fe->cancel.fd = -1;
+		free(host);
+		return -1;
+	}
+	free(host);
+	return 0;
+}
+
+/* Send the CancelRequest that pgr_cancel() set up, if the
+   connection to the backend has come up.  Returns 1 if it
+   hasn't yet (try again when it's writable), and 0 or -1
+   once the cancel has gone out, or failed to. */
+int pgr_cancel_send(CONNECTION *fe)
+{
+	ssize_t n;
+
+	n = send(fe->cancel.fd, fe->cancel.msg, sizeof(fe->cancel.msg),
+	         MSG_DONTWAIT | MSG_NOSIGNAL);
+	if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+		return 1; /* still connecting */
+	}
+	if (n != sizeof(fe->cancel.msg)) {
+		pgr_logf(stderr, LOG_ERR, "[cancel] failed to send CancelRequest to backend pid %u: %s (errno %d)",
+				ntohl(fe->cancel.msg[2]), n < 0 ? strerror(errno) : "short write", n < 0 ? errno : 0);
+		return -1;
+	}
+	return 0;
+}
+
+#ifdef PTEST
+#include <stdio.h>
+#include <poll.h>
+#include <netinet/in.h>
+
+#define so(s,x) do {\
+	if (x) { \
+		fprintf(stderr, "%s ... OK\n", s); \
+	} else { \
+		fprintf(stderr, "%s:%d: FAIL: %s [!(%s)]\n", __FILE__, __LINE__, s, #x); \
+		exit(1); \
+	} \
+} while (0)
+
+#define is(x,n) so(#x " should equal " #n, (x) == (n))
+
+#define SESSIONS 2000
+
+static CONTEXT C;
+static BACKEND B;
+
+/* Listen on an ephemeral port of the loopback interface,
+   to play the part of the backend. */
+static int listener(int *port)
+{
+	struct sockaddr_in sa;
+	socklen_t len = sizeof(sa);
+	int fd;
+
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (fd < 0 || bind(fd, (struct sockaddr *)&sa, sizeof(sa)) != 0 || listen(fd, 8) != 0
+	 || getsockname(fd, (struct sockaddr *)&sa, &len) != 0) {
+		fprintf(stderr, "unable to listen on the loopback interface: %s\n", strerror(errno));
+		exit(2);
+	}
+	*port = ntohs(sa.sin_port);
+	return fd;
+}
+
+int main(int argc, char **argv)
+{
+	CONTEXT *c = &C;
+	CONNECTION fe, be;
+	struct pollfd pfd;
+	uint32_t pids[SESSIONS], keys[SESSIONS], pid, key, msg[4];
+	int i, j, lfd, fd, rc, unique, found;
+
+	pthread_rwlock_init(&c->lock, NULL);
+	pthread_rwlock_init(&c->cancel.lock, NULL);
+	pthread_rwlock_init(&B.lock, NULL);
+	B.hostname = "127.0.0.1";
+	lfd = listener(&B.port);
+	c->backends = &B;
+	c->num_backends = 1;
+
+	memset(&fe, 0, sizeof(fe));
+	fe.context = c;
+	fe.cancel.fd = -1;
+	memset(&be, 0, sizeof(be));
+	be.context = c;
+	be.index = 0;
+
+	/* every session gets key data of its own */
+	for (i = 0; i < SESSIONS; i++) {
+		pgr_cancel_register(c, &pids[i], &keys[i]);
+	}
+	unique = found = 1;
+	for (i = 0; i < SESSIONS; i++) {
+		for (j = 0; j < i; j++) {
+			if (pids[j] == pids[i]) {
+				unique = 0;
+			}
+		}
+		if (pids[i] == 0 || !lookup(c, pids[i]) || lookup(c, pids[i])->key != keys[i]) {
+			found = 0;
+		}
+	}
+	so("issued process IDs should be unique", unique);
+	so("issued key data should be in the map", found);
+	for (i = 0; i < SESSIONS && !(keys[i] & 0x80000000); i++)
+		;
+	so("secret keys should use all 32 bits", i < SESSIONS);
+
+	/* forgotten sessions leave the map; the rest stay */
+	for (i = 0; i < SESSIONS; i += 2) {
+		pgr_cancel_forget(c, pids[i]);
+	}
+	found = 0;
+	for (i = 0; i < SESSIONS; i++) {
+		if (!lookup(c, pids[i]) != !(i % 2)) {
+			found++;
+		}
+	}
+	is(found, 0);
+	pgr_cancel_forget(c, pids[0]); /* (twice is harmless) */
+
+	pid = pids[1];
+	key = keys[1];
+
+	/* nothing running, or bad key data: no cancel */
+	is(pgr_cancel(&fe, pid, key), 1);
+	is(pgr_cancel(&fe, pids[0], keys[0]), 1);
+	be.greeting.pid = 4242;
+	be.greeting.key = 0xdecafbad;
+	pgr_cancel_target(c, pid, &be);
+	is(lookup(c, pid)->index, 0);
+	is(pgr_cancel(&fe, pid, key + 1), 1);
+	is(pgr_cancel(&fe, pid + 1, key), 1);
+	is(fe.cancel.fd, -1);
+
+	/* a good one goes to the backend running the query,
+	   with that backend's key data */
+	is(pgr_cancel(&fe, pid, key), 0);
+	so("a cancel should be connecting", fe.cancel.fd >= 0);
+	for (rc = 1, i = 0; rc == 1 && i < 100; i++) {
+		pfd.fd = fe.cancel.fd;
+		pfd.events = POLLOUT;
+		poll(&pfd, 1, 100);
+		rc = pgr_cancel_send(&fe);
+	}
+	is(rc, 0);
+	close(fe.cancel.fd);
+	fe.cancel.fd = -1;
+
+	fd = accept(lfd, NULL, NULL);
+	so("the backend should get a connection", fd >= 0);
+	is(recv(fd, msg, sizeof(msg), MSG_WAITALL), sizeof(msg));
+	is(ntohl(msg[0]), 16);
+	is(ntohl(msg[1]), 80877102);
+	is(ntohl(msg[2]), 4242);
+	is(ntohl(msg[3]), 0xdecafbad);
+	close(fd);
+
+	/* once the query is over, there's nothing to cancel */
+	pgr_cancel_target(c, pid, NULL);
+	is(pgr_cancel(&fe, pid, key), 1);
+	be.greeting.pid = 0;
+	pgr_cancel_target(c, pid, &be);
+	is(pgr_cancel(&fe, pid, key), 1);
+
+	pgr_cancel_forget(c, pid);
+	is(lookup(c, pid), NULL);
+
+	close(lfd);
+	fprintf(stderr, "ALL TESTS PASSED\n");
+	return 0;
+}
+#endif
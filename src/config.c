@@ -64,6 +64,10 @@ struct _backend {
 	intval_t weight;
 	intval_t lag;
 
+	intval_t connections;
+	intval_t quota;
+	intval_t rate;
+
 	struct _backend *next;
 };
 
@@ -104,6 +108,14 @@ struct __p {
 
 	intval_t workers;
 	intval_t loglevel;
+	intval_t reuseport;
+
+	intval_t pool_mode;
+	intval_t pool_size;
+	intval_t pool_min;
+	intval_t pool_rate;
+	intval_t pool_lifetime;
+	intval_t pool_idle;
 
 	intval_t health_interval;
 	intval_t health_timeout;
@@ -383,7 +395,8 @@ static TOKEN lex_bareword(LEXER *l)
 	/* is this bareword actually a keyword? */
 	int i;
 	for (i = 0; KEYWORDS[i].value >= 0 && KEYWORDS[i].match != NULL; i++) {
-		if (strncasecmp(value, KEYWORDS[i].match, length) == 0) {
+		if (strlen(KEYWORDS[i].match) == length
+		 && strncasecmp(value, KEYWORDS[i].match, length) == 0) {
 			ignore(l);
 			return token(KEYWORDS[i].value, NULL);
 		}
@@ -720,6 +733,7 @@ static struct _backend* backend(PARSER *p, const char *id)
 
 static int parse_backend(PARSER *p);
 static int parse_health(PARSER *p);
+static int parse_pool(PARSER *p);
 static int parse_tls(PARSER *p);
 
 static int parse_top(PARSER *p)
@@ -765,6 +779,18 @@ static int parse_top(PARSER *p)
 		}
 		return 0;
 
+	case T_KEYWORD_REUSEPORT:
+		t2 = emit(p->l);
+		switch (t2.type) {
+		case T_KEYWORD_OFF:      set_int(&p->reuseport, REUSEPORT_OFF);      break;
+		case T_KEYWORD_ON:       set_int(&p->reuseport, REUSEPORT_ON);       break;
+		case T_KEYWORD_BALANCED: set_int(&p->reuseport, REUSEPORT_BALANCED); break;
+		default:
+			printf("bad reuseport mode\n");
+			return 1;
+		}
+		return 0;
+
 	case T_KEYWORD_WORKERS:
 		t2 = emit(p->l);
 		switch (t2.type) {
@@ -804,6 +830,15 @@ static int parse_top(PARSER *p)
 		p->f = parse_health;
 		return 0;
 
+	case T_KEYWORD_POOL:
+		t2 = emit(p->l);
+		if (t2.type != T_OPEN) {
+			printf("bad follow-on to pool\n");
+			return -1;
+		}
+		p->f = parse_pool;
+		return 0;
+
 	case T_KEYWORD_BACKEND:
 		t2 = emit(p->l);
 		if (t2.type == T_KEYWORD_DEFAULT) {
@@ -901,6 +936,31 @@ static int parse_backend(PARSER *p)
 		set_int(&p->current->weight, i);
 		return 0;
 
+	case T_KEYWORD_CONNECTIONS:
+	case T_KEYWORD_QUOTA:
+	case T_KEYWORD_RATE:
+		t2 = emit(p->l);
+		switch (t2.type) {
+		case T_TYPE_INTEGER:
+			i = t2.semval.i;
+			break;
+
+		default:
+			fprintf(stderr, "unexpected token!\n");
+			return 1;
+		}
+
+		if (i < 0) {
+			fprintf(stderr, "invalid backend limit: %d\n", i);
+			return 1;
+		}
+		switch (t1.type) {
+		case T_KEYWORD_CONNECTIONS: set_int(&p->current->connections, i); break;
+		case T_KEYWORD_QUOTA:       set_int(&p->current->quota, i);       break;
+		case T_KEYWORD_RATE:        set_int(&p->current->rate, i);        break;
+		}
+		return 0;
+
 	case T_CLOSE:
 		p->f = parse_top;
 		return 0;
@@ -972,6 +1032,105 @@ static int parse_health(PARSER *p)
 	}
 }
 
+static int parse_pool(PARSER *p)
+{
+	TOKEN t1, t2;
+	int i;
+
+	t1 = emit(p->l);
+	switch (t1.type) {
+	case T_KEYWORD_MODE:
+		t2 = emit(p->l);
+		switch (t2.type) {
+		case T_KEYWORD_OFF:         set_int(&p->pool_mode, POOL_OFF);         break;
+		case T_KEYWORD_SESSION:     set_int(&p->pool_mode, POOL_SESSION);     break;
+		case T_KEYWORD_TRANSACTION: set_int(&p->pool_mode, POOL_TRANSACTION); break;
+		case T_KEYWORD_STATEMENT:   set_int(&p->pool_mode, POOL_STATEMENT);   break;
+
+		default:
+			fprintf(stderr, "unexpected token!\n");
+			return 1;
+		}
+		return 0;
+
+	case T_KEYWORD_SIZE:
+	case T_KEYWORD_MIN:
+	case T_KEYWORD_RATE:
+		t2 = emit(p->l);
+		switch (t2.type) {
+		case T_TYPE_INTEGER:
+			i = t2.semval.i;
+			break;
+
+		default:
+			fprintf(stderr, "unexpected token!\n");
+			return 1;
+		}
+
+		switch (t1.type) {
+		case T_KEYWORD_SIZE:
+			if (i < 0) {
+				fprintf(stderr, "invalid pool size: %d\n", i);
+				return 1;
+			}
+			set_int(&p->pool_size, i);
+			break;
+
+		case T_KEYWORD_MIN:
+			if (i < 0) {
+				fprintf(stderr, "invalid pool minimum: %d\n", i);
+				return 1;
+			}
+			set_int(&p->pool_min, i);
+			break;
+
+		case T_KEYWORD_RATE:
+			if (i < 1) {
+				fprintf(stderr, "invalid pool connect rate: %d\n", i);
+				return 1;
+			}
+			set_int(&p->pool_rate, i);
+			break;
+		}
+		return 0;
+
+	case T_KEYWORD_LIFETIME:
+	case T_KEYWORD_IDLE:
+		t2 = emit(p->l);
+		switch (t2.type) {
+		case T_TYPE_INTEGER:
+		case T_TYPE_TIME:
+			i = t2.semval.i;
+			break;
+
+		default:
+			fprintf(stderr, "unexpected token!\n");
+			return 1;
+		}
+
+		if (i < 0) {
+			fprintf(stderr, "invalid value: %d\n", i);
+			return 1;
+		}
+		switch (t1.type) {
+		case T_KEYWORD_LIFETIME: set_int(&p->pool_lifetime, i); break;
+		case T_KEYWORD_IDLE:     set_int(&p->pool_idle, i);     break;
+		}
+		return 0;
+
+	case T_CLOSE:
+		p->f = parse_top;
+		return 0;
+
+	case T_TERMX:
+		return 0;
+
+	default:
+		printf("unexpected token in pool stanza\n");
+		return 1;
+	}
+}
+
 static int parse_tls(PARSER *p)
 {
 	TOKEN t1, t2;
@@ -1089,6 +1248,13 @@ int pgr_configure(CONTEXT *c, const char *file, int reload)
 		return rc;
 	}
 
+	if (!reload) {
+		c->pool.size = DEFAULT_POOL_SIZE;
+		c->pool.rate = DEFAULT_POOL_RATE;
+		c->pool.lifetime = DEFAULT_POOL_LIFETIME;
+		c->pool.idle = DEFAULT_POOL_IDLE;
+	}
+
 	/* update what can be updated */
 	if (p->workers.set) {
 		c->workers = p->workers.value;
@@ -1097,6 +1263,25 @@ int pgr_configure(CONTEXT *c, const char *file, int reload)
 		c->loglevel = p->loglevel.value;
 	}
 
+	if (p->pool_mode.set) {
+		c->pool.mode = p->pool_mode.value;
+	}
+	if (p->pool_size.set) {
+		c->pool.size = p->pool_size.value;
+	}
+	if (p->pool_min.set) {
+		c->pool.min = p->pool_min.value;
+	}
+	if (p->pool_rate.set) {
+		c->pool.rate = p->pool_rate.value;
+	}
+	if (p->pool_lifetime.set) {
+		c->pool.lifetime = p->pool_lifetime.value;
+	}
+	if (p->pool_idle.set) {
+		c->pool.idle = p->pool_idle.value;
+	}
+
 	if (p->health_interval.set) {
 		c->health.interval = p->health_interval.value;
 	}
@@ -1136,6 +1321,13 @@ int pgr_configure(CONTEXT *c, const char *file, int reload)
 			p->monitor.value = c->startup.monitor;
 		}
 	}
+	if (p->reuseport.set) {
+		if (!reload) {
+			c->startup.reuseport = p->reuseport.value;
+		} else if (p->reuseport.value != c->startup.reuseport) {
+			fprintf(stderr, "ignoring new value for `reuseport`; retaining old value\n");
+		}
+	}
 	if (p->hbafile.set) {
 		if (!reload) {
 			c->startup.hbafile = p->hbafile.value;
@@ -1243,6 +1435,10 @@ int pgr_configure(CONTEXT *c, const char *file, int reload)
 			c->backends[i].tls              = get_int(BACKEND_TLS_OFF, &def->tls, &b->tls);
 			c->backends[i].health.threshold = get_int(BACKEND_TLS_OFF, &def->lag, &b->lag);
 			c->backends[i].weight           = get_int(BACKEND_TLS_OFF, &def->weight, &b->weight);
+			c->backends[i].limits.max       = get_int(0, &def->connections, &b->connections);
+			c->backends[i].limits.quota     = get_int(0, &def->quota, &b->quota);
+			c->backends[i].limits.rate      = get_int(0, &def->rate, &b->rate);
+			c->backends[i].limits.tokens    = c->backends[i].limits.rate;
 			c->backends[i].health.database  = get_str("postgres", &p->health_database, NULL);
 			c->backends[i].health.username  = get_str("postgres", &p->health_username, NULL);
 			c->backends[i].health.password  = get_str("",         &p->health_password, NULL);
@@ -1313,6 +1509,8 @@ int main(int argc, char **argv)
 	printf("group %s\n", c.startup.group);
 	printf("\n");
 	printf("workers %d\n", c.workers);
+	printf("reuseport %s\n", c.startup.reuseport == REUSEPORT_BALANCED ? "balanced"
+	                        : c.startup.reuseport == REUSEPORT_ON       ? "on" : "off");
 	printf("log %s\n", c.loglevel == LOG_DEBUG ? "DEBUG"
 	                 : c.loglevel == LOG_INFO  ? "INFO"  : "ERROR");
 	printf("\n");
@@ -1322,6 +1520,17 @@ int main(int argc, char **argv)
 	printf("  key     %s\n", c.startup.tls_keyfile);
 	printf("}\n");
 	printf("\n");
+	printf("pool {\n");
+	printf("  mode %s\n", c.pool.mode == POOL_STATEMENT   ? "statement"
+	                     : c.pool.mode == POOL_TRANSACTION ? "transaction"
+	                     : c.pool.mode == POOL_SESSION     ? "session" : "off");
+	printf("  size %d\n", c.pool.size);
+	printf("  min %d\n", c.pool.min);
+	printf("  rate %d\n", c.pool.rate);
+	printf("  lifetime %ds\n", c.pool.lifetime);
+	printf("  idle %ds\n", c.pool.idle);
+	printf("}\n");
+	printf("\n");
 	printf("health {\n");
 	printf("  check    %ds\n", c.health.interval);
 	printf("  timeout  %ds\n", c.health.timeout);
@@ -1338,6 +1547,9 @@ int main(int argc, char **argv)
 		                   : b.tls == BACKEND_TLS_NOVERIFY ? "skipverify" : "off");
 		printf("  weight %d\n", b.weight);
 		printf("  lag %llub\n", b.health.threshold);
+		printf("  connections %d\n", b.limits.max);
+		printf("  quota %d\n", b.limits.quota);
+		printf("  rate %d\n", b.limits.rate);
 		printf("}\n");
 		printf("\n");
 	}
@@ -20,40 +20,54 @@
 #define T_TERMX                  261
 #define T_KEYWORD_AUTHDB         262
 #define T_KEYWORD_BACKEND        263
-#define T_KEYWORD_CERT           264
-#define T_KEYWORD_CHECK          265
-#define T_KEYWORD_CIPHERS        266
-#define T_KEYWORD_DATABASE       267
-#define T_KEYWORD_DEBUG          268
-#define T_KEYWORD_DEFAULT        269
-#define T_KEYWORD_ERROR          270
-#define T_KEYWORD_GROUP          271
-#define T_KEYWORD_HBA            272
-#define T_KEYWORD_HEALTH         273
-#define T_KEYWORD_INFO           274
-#define T_KEYWORD_KEY            275
-#define T_KEYWORD_LAG            276
-#define T_KEYWORD_LISTEN         277
-#define T_KEYWORD_LOG            278
-#define T_KEYWORD_MONITOR        279
-#define T_KEYWORD_OFF            280
-#define T_KEYWORD_ON             281
-#define T_KEYWORD_PASSWORD       282
-#define T_KEYWORD_PIDFILE        283
-#define T_KEYWORD_SKIPVERIFY     284
-#define T_KEYWORD_TIMEOUT        285
-#define T_KEYWORD_TLS            286
-#define T_KEYWORD_USER           287
-#define T_KEYWORD_USERNAME       288
-#define T_KEYWORD_WEIGHT         289
-#define T_KEYWORD_WORKERS        290
-#define T_TYPE_BAREWORD          291
-#define T_TYPE_DECIMAL           292
-#define T_TYPE_INTEGER           293
-#define T_TYPE_ADDRESS           294
-#define T_TYPE_TIME              295
-#define T_TYPE_SIZE              296
-#define T_TYPE_QSTRING           297
+#define T_KEYWORD_BALANCED       264
+#define T_KEYWORD_CERT           265
+#define T_KEYWORD_CHECK          266
+#define T_KEYWORD_CIPHERS        267
+#define T_KEYWORD_CONNECTIONS    268
+#define T_KEYWORD_DATABASE       269
+#define T_KEYWORD_DEBUG          270
+#define T_KEYWORD_DEFAULT        271
+#define T_KEYWORD_ERROR          272
+#define T_KEYWORD_GROUP          273
+#define T_KEYWORD_HBA            274
+#define T_KEYWORD_HEALTH         275
+#define T_KEYWORD_IDLE           276
+#define T_KEYWORD_INFO           277
+#define T_KEYWORD_KEY            278
+#define T_KEYWORD_LAG            279
+#define T_KEYWORD_LIFETIME       280
+#define T_KEYWORD_LISTEN         281
+#define T_KEYWORD_LOG            282
+#define T_KEYWORD_MIN            283
+#define T_KEYWORD_MODE           284
+#define T_KEYWORD_MONITOR        285
+#define T_KEYWORD_OFF            286
+#define T_KEYWORD_ON             287
+#define T_KEYWORD_PASSWORD       288
+#define T_KEYWORD_PIDFILE        289
+#define T_KEYWORD_POOL           290
+#define T_KEYWORD_QUOTA          291
+#define T_KEYWORD_RATE           292
+#define T_KEYWORD_REUSEPORT      293
+#define T_KEYWORD_SESSION        294
+#define T_KEYWORD_SIZE           295
+#define T_KEYWORD_SKIPVERIFY     296
+#define T_KEYWORD_STATEMENT      297
+#define T_KEYWORD_TIMEOUT        298
+#define T_KEYWORD_TLS            299
+#define T_KEYWORD_TRANSACTION    300
+#define T_KEYWORD_USER           301
+#define T_KEYWORD_USERNAME       302
+#define T_KEYWORD_WEIGHT         303
+#define T_KEYWORD_WORKERS        304
+#define T_TYPE_BAREWORD          305
+#define T_TYPE_DECIMAL           306
+#define T_TYPE_INTEGER           307
+#define T_TYPE_ADDRESS           308
+#define T_TYPE_TIME              309
+#define T_TYPE_SIZE              310
+#define T_TYPE_QSTRING           311
 
 /* keyword lookup table */
 static struct {
@@ -62,9 +76,11 @@ static struct {
 } KEYWORDS[] = {
 	{ T_KEYWORD_AUTHDB,        "authdb"        },
 	{ T_KEYWORD_BACKEND,       "backend"       },
+	{ T_KEYWORD_BALANCED,      "balanced"      },
 	{ T_KEYWORD_CERT,          "cert"          },
 	{ T_KEYWORD_CHECK,         "check"         },
 	{ T_KEYWORD_CIPHERS,       "ciphers"       },
+	{ T_KEYWORD_CONNECTIONS,   "connections"   },
 	{ T_KEYWORD_DATABASE,      "database"      },
 	{ T_KEYWORD_DEBUG,         "debug"         },
 	{ T_KEYWORD_DEFAULT,       "default"       },
@@ -72,19 +88,31 @@ static struct {
 	{ T_KEYWORD_GROUP,         "group"         },
 	{ T_KEYWORD_HBA,           "hba"           },
 	{ T_KEYWORD_HEALTH,        "health"        },
+	{ T_KEYWORD_IDLE,          "idle"          },
 	{ T_KEYWORD_INFO,          "info"          },
 	{ T_KEYWORD_KEY,           "key"           },
 	{ T_KEYWORD_LAG,           "lag"           },
+	{ T_KEYWORD_LIFETIME,      "lifetime"      },
 	{ T_KEYWORD_LISTEN,        "listen"        },
 	{ T_KEYWORD_LOG,           "log"           },
+	{ T_KEYWORD_MIN,           "min"           },
+	{ T_KEYWORD_MODE,          "mode"          },
 	{ T_KEYWORD_MONITOR,       "monitor"       },
 	{ T_KEYWORD_OFF,           "off"           },
 	{ T_KEYWORD_ON,            "on"            },
 	{ T_KEYWORD_PASSWORD,      "password"      },
 	{ T_KEYWORD_PIDFILE,       "pidfile"       },
+	{ T_KEYWORD_POOL,          "pool"          },
+	{ T_KEYWORD_QUOTA,         "quota"         },
+	{ T_KEYWORD_RATE,          "rate"          },
+	{ T_KEYWORD_REUSEPORT,     "reuseport"     },
+	{ T_KEYWORD_SESSION,       "session"       },
+	{ T_KEYWORD_SIZE,          "size"          },
 	{ T_KEYWORD_SKIPVERIFY,    "skipverify"    },
+	{ T_KEYWORD_STATEMENT,     "statement"     },
 	{ T_KEYWORD_TIMEOUT,       "timeout"       },
 	{ T_KEYWORD_TLS,           "tls"           },
+	{ T_KEYWORD_TRANSACTION,   "transaction"   },
 	{ T_KEYWORD_USER,          "user"          },
 	{ T_KEYWORD_USERNAME,      "username"      },
 	{ T_KEYWORD_WEIGHT,        "weight"        },
@@ -106,9 +134,11 @@ static struct {
 	{ T_TERMX,                 "T_TERMX",               NULL            },
 	{ T_KEYWORD_AUTHDB,        "T_KEYWORD_AUTHDB",      "authdb"        },
 	{ T_KEYWORD_BACKEND,       "T_KEYWORD_BACKEND",     "backend"       },
+	{ T_KEYWORD_BALANCED,      "T_KEYWORD_BALANCED",    "balanced"      },
 	{ T_KEYWORD_CERT,          "T_KEYWORD_CERT",        "cert"          },
 	{ T_KEYWORD_CHECK,         "T_KEYWORD_CHECK",       "check"         },
 	{ T_KEYWORD_CIPHERS,       "T_KEYWORD_CIPHERS",     "ciphers"       },
+	{ T_KEYWORD_CONNECTIONS,   "T_KEYWORD_CONNECTIONS", "connections"   },
 	{ T_KEYWORD_DATABASE,      "T_KEYWORD_DATABASE",    "database"      },
 	{ T_KEYWORD_DEBUG,         "T_KEYWORD_DEBUG",       "debug"         },
 	{ T_KEYWORD_DEFAULT,       "T_KEYWORD_DEFAULT",     "default"       },
@@ -116,19 +146,31 @@ static struct {
 	{ T_KEYWORD_GROUP,         "T_KEYWORD_GROUP",       "group"         },
 	{ T_KEYWORD_HBA,           "T_KEYWORD_HBA",         "hba"           },
 	{ T_KEYWORD_HEALTH,        "T_KEYWORD_HEALTH",      "health"        },
+	{ T_KEYWORD_IDLE,          "T_KEYWORD_IDLE",        "idle"          },
 	{ T_KEYWORD_INFO,          "T_KEYWORD_INFO",        "info"          },
 	{ T_KEYWORD_KEY,           "T_KEYWORD_KEY",         "key"           },
 	{ T_KEYWORD_LAG,           "T_KEYWORD_LAG",         "lag"           },
+	{ T_KEYWORD_LIFETIME,      "T_KEYWORD_LIFETIME",    "lifetime"      },
 	{ T_KEYWORD_LISTEN,        "T_KEYWORD_LISTEN",      "listen"        },
 	{ T_KEYWORD_LOG,           "T_KEYWORD_LOG",         "log"           },
+	{ T_KEYWORD_MIN,           "T_KEYWORD_MIN",         "min"           },
+	{ T_KEYWORD_MODE,          "T_KEYWORD_MODE",        "mode"          },
 	{ T_KEYWORD_MONITOR,       "T_KEYWORD_MONITOR",     "monitor"       },
 	{ T_KEYWORD_OFF,           "T_KEYWORD_OFF",         "off"           },
 	{ T_KEYWORD_ON,            "T_KEYWORD_ON",          "on"            },
 	{ T_KEYWORD_PASSWORD,      "T_KEYWORD_PASSWORD",    "password"      },
 	{ T_KEYWORD_PIDFILE,       "T_KEYWORD_PIDFILE",     "pidfile"       },
+	{ T_KEYWORD_POOL,          "T_KEYWORD_POOL",        "pool"          },
+	{ T_KEYWORD_QUOTA,         "T_KEYWORD_QUOTA",       "quota"         },
+	{ T_KEYWORD_RATE,          "T_KEYWORD_RATE",        "rate"          },
+	{ T_KEYWORD_REUSEPORT,     "T_KEYWORD_REUSEPORT",   "reuseport"     },
+	{ T_KEYWORD_SESSION,       "T_KEYWORD_SESSION",     "session"       },
+	{ T_KEYWORD_SIZE,          "T_KEYWORD_SIZE",        "size"          },
 	{ T_KEYWORD_SKIPVERIFY,    "T_KEYWORD_SKIPVERIFY",  "skipverify"    },
+	{ T_KEYWORD_STATEMENT,     "T_KEYWORD_STATEMENT",   "statement"     },
 	{ T_KEYWORD_TIMEOUT,       "T_KEYWORD_TIMEOUT",     "timeout"       },
 	{ T_KEYWORD_TLS,           "T_KEYWORD_TLS",         "tls"           },
+	{ T_KEYWORD_TRANSACTION,   "T_KEYWORD_TRANSACTION", "transaction"   },
 	{ T_KEYWORD_USER,          "T_KEYWORD_USER",        "user"          },
 	{ T_KEYWORD_USERNAME,      "T_KEYWORD_USERNAME",    "username"      },
 	{ T_KEYWORD_WEIGHT,        "T_KEYWORD_WEIGHT",      "weight"        },
@@ -82,7 +82,7 @@ static void error_response(MBUF *m, char *sev, char *code, char *msgf, ...)
 	vasprintf(&msg, msgf, ap);
 	va_end(ap);
 
-	len = 1+4                /* type + len            */
+	len = 4                  /* len (but not type)    */
 	    + 1+strlen(sev)+1    /* 'S' + severity + '\0' */
 	    + 1+strlen(code)+1   /* 'C' + code     + '\0' */
 	    + 1+strlen(msg)+1    /* 'M' + msg      + '\0' */
@@ -179,7 +179,7 @@ static int check_auth(CONNECTION *c, MBUF *m)
 	return memcmp(pgr_mbuf_data(m, 3, 32), hashed, 32);
 }
 
-static void free_params(PARAM *p)
+void pgr_params_free(PARAM *p)
 {
 	PARAM *tmp;
 	while (p) {
@@ -191,6 +191,88 @@ static void free_params(PARAM *p)
 	}
 }
 
+void pgr_prepared_free(PREPARED *p)
+{
+	PREPARED *tmp;
+	while (p) {
+		tmp = p->next;
+		free(p->name);
+		free(p);
+		p = tmp;
+	}
+}
+
+/* Look up a named prepared statement that the backend of a
+   connection has (or might have), by name. */
+PREPARED* pgr_conn_prepared(CONNECTION *c, const char *name)
+{
+	PREPARED *p;
+
+	for (p = c->prepared; p; p = p->next) {
+		if (strcmp(p->name, name) == 0) {
+			return p;
+		}
+	}
+	return NULL;
+}
+
+/* Note that the backend of a connection has parsed the
+   named statement (whose Parse hashes to `hash`), or if
+   `hash` is 0, that it might have. */
+void pgr_conn_prepare(CONNECTION *c, const char *name, uint64_t hash)
+{
+	PREPARED *p;
+
+	p = pgr_conn_prepared(c, name);
+	if (!p) {
+		p = calloc(1, sizeof(PREPARED));
+		if (!p) {
+			pgr_abort(ABORT_MEMFAIL);
+		}
+		p->name = strdup(name);
+		if (!p->name) {
+			pgr_abort(ABORT_MEMFAIL);
+		}
+		p->next = c->prepared;
+		c->prepared = p;
+	}
+	p->hash = hash;
+}
+
+/* Note that the backend of a connection no longer has the
+   named statement. */
+void pgr_conn_unprepare(CONNECTION *c, const char *name)
+{
+	PREPARED *p, **pp;
+
+	for (pp = &c->prepared; (p = *pp) != NULL; pp = &p->next) {
+		if (strcmp(p->name, name) == 0) {
+			*pp = p->next;
+			free(p->name);
+			free(p);
+			return;
+		}
+	}
+}
+
+/* Stop trusting what we know about the prepared statements
+   of a connection's backend (i.e. after a DEALLOCATE); they
+   may or may not still be there. */
+void pgr_conn_doubt(CONNECTION *c)
+{
+	PREPARED *p;
+
+	for (p = c->prepared; p; p = p->next) {
+		p->hash = 0;
+	}
+}
+
+static void free_greeting(GREETING *g)
+{
+	free(g->status);
+	memset(g, 0, sizeof(GREETING));
+}
+
 void pgr_conn_init(CONTEXT *c, CONNECTION *dst)
 {
 	memset(dst, 0, sizeof(CONNECTION));
@@ -199,17 +281,37 @@ void pgr_conn_init(CONTEXT *c, CONNECTION *dst)
 	dst->serial  = -1;
 	dst->index   = -1;
 	dst->fd      = -1;
+	dst->txn     = 'I';
+	dst->cancel.fd = -1;
 
 	int rnd = pgr_rand(0, 0xffffffff);
 	memcpy(dst->salt, &rnd, 4);
 }
 
-void pgr_conn_deinit(CONNECTION *c)
+/* Close a (backend) connection, giving up its slot under
+   the connection limits of its BACKEND, if it has one. */
+void pgr_conn_close(CONNECTION *c)
 {
 	if (c->fd >= 0) {
 		close(c->fd);
+		c->fd = -1;
+	}
+	if (c->cancel.fd >= 0) {
+		close(c->cancel.fd);
+		c->cancel.fd = -1;
 	}
-	free_params(c->params);
+	pgr_mbuf_free(c->startup.buf);
+	c->startup.buf = NULL;
+	pgr_prepared_free(c->prepared);
+	c->prepared = NULL;
+	pgr_pool_leave(c);
+}
+
+void pgr_conn_deinit(CONNECTION *c)
+{
+	pgr_conn_close(c);
+	free_greeting(&c->greeting);
+	pgr_params_free(c->params);
 }
 
 void pgr_conn_frontend(CONNECTION *dst, int fd)
@@ -226,58 +328,111 @@ void pgr_conn_backend(CONNECTION *dst, BACKEND *b, int i)
 	dst->port = b->port;
 }
 
-int pgr_conn_copy(CONNECTION *dst, CONNECTION *src)
+/* Make a deep copy of a list of startup parameters. */
+PARAM* pgr_params_dup(PARAM *src)
 {
-	PARAM *a, *b;
-
-	dst->pwhash = src->pwhash;
+	PARAM *head, *a, *b;
 
-	free_params(dst->params);
-	a = NULL;
-	for (b = src->params; b; b = b->next) {
+	head = a = NULL;
+	for (b = src; b; b = b->next) {
 		if (a) {
 			a->next = copy_params(b);
 			a = a->next;
 		} else {
-			dst->params = a = copy_params(b);
+			head = a = copy_params(b);
 		}
 	}
+	return head;
+}
+
+int pgr_conn_copy(CONNECTION *dst, CONNECTION *src)
+{
+	dst->pwhash = src->pwhash;
 
+	pgr_params_free(dst->params);
+	dst->params = pgr_params_dup(src->params);
 	return 0;
 }
 
-int pgr_conn_connect(CONNECTION *c)
+/* Append the ParameterStatus message at the front of `m`
+   to the greeting we'll replay to clients of this backend
+   connection, instead of asking the backend again. */
+static int save_status(CONNECTION *c, MBUF *m)
 {
-	int rc;
-	MBUF *m;
+	unsigned int n, len;
+	char *tmp;
+
+	n = pgr_mbuf_msglength(m);
+	if (!pgr_mbuf_data(m, 0, n)) {
+		return 1;
+	}
+
+	tmp = realloc(c->greeting.status, c->greeting.len + 5 + n);
+	if (!tmp) {
+		pgr_abort(ABORT_MEMFAIL);
+	}
+
+	len = htonl(n + 4);
+	tmp[c->greeting.len] = 'S';
+	memcpy(tmp + c->greeting.len + 1, &len, 4);
+	memcpy(tmp + c->greeting.len + 5, pgr_mbuf_data(m, 0, n), n);
 
-	m = pgr_mbuf_new(512);
+	c->greeting.status = tmp;
+	c->greeting.len += 5 + n;
+	return 0;
+}
 
-	c->fd = pgr_connect(c->hostname, c->port, c->timeout * 1000);
+/* Start connecting to a backend, without waiting for the
+   connection to be established.  The StartupMessage is
+   queued up, and the rest of the startup conversation
+   is left to pgr_conn_handshake(). */
+int pgr_conn_start(CONNECTION *c)
+{
+	c->fd = pgr_connect_async(c->hostname, c->port);
 	if (c->fd < 0) {
 		return c->fd;
 	}
 
-	pgr_mbuf_setfd(m, c->fd, c->fd);
+	free_greeting(&c->greeting);
+	c->startup.buf = pgr_mbuf_new(512);
+	pgr_mbuf_setfd(c->startup.buf, c->fd, c->fd);
 
-	/* send StartupMessage */
-	pgr_debugf("sending StartupMessage to backend (fd %d)", c->fd);
-	rc = startup_message(m, c);
-	if (rc != 0) {
-		return rc;
-	}
-	rc = pgr_mbuf_relay(m);
-	if (rc != 0) {
-		return rc;
-	}
+	pgr_debugf("queueing StartupMessage for backend (fd %d)", c->fd);
+	c->startup.pending = 1;
+	return startup_message(c->startup.buf, c);
+}
+
+/* Drive the backend side of the startup conversation, as
+   far as it will go: StartupMessage, md5 authentication,
+   and everything up to the first ReadyForQuery.
+
+   Returns MBUF_AGAIN if the backend (or the connection to
+   it) isn't ready yet; call it again once the socket is
+   readable or writable.  Returns 0 once the connection
+   is ready for queries, and non-zero if it failed. */
+int pgr_conn_handshake(CONNECTION *c)
+{
+	int rc;
+	MBUF *m = c->startup.buf;
 
-	/* process replies from remote */
 	for (;;) {
+		if (c->startup.pending) {
+			pgr_debugf("sending startup message to backend (fd %d)", c->fd);
+			rc = pgr_mbuf_flush(m);
+			if (rc != 0) {
+				return rc;
+			}
+			c->startup.pending = 0;
+		}
+
 		pgr_debugf("waiting for message from backend (fd %d)", c->fd);
 		rc = pgr_mbuf_recv(m);
-		if (rc < 0) {
+		if (rc == MBUF_AGAIN) {
 			return rc;
 		}
+		if (rc <= 0) {
+			return -1;
+		}
 
 		char type = pgr_mbuf_msgtype(m);
 		switch (type) {
@@ -287,6 +442,7 @@ int pgr_conn_connect(CONNECTION *c)
 
 		case 'N':
 			pgr_logf(stderr, LOG_ERR, "received a Notice from backend (fd %d)", c->fd);
+			pgr_mbuf_discard(m);
 			break;
 
 		case 'R': /* Authentication */
@@ -299,15 +455,12 @@ int pgr_conn_connect(CONNECTION *c)
 				memcpy(c->salt, pgr_mbuf_data(m, 4, 4), 4);
 				pgr_mbuf_discard(m);
 
-				pgr_debugf("sending PasswordMessage to backend (fd %d)", c->fd);
+				pgr_debugf("queueing PasswordMessage for backend (fd %d)", c->fd);
 				rc = password_message(m, c);
 				if (rc != 0) {
 					return rc;
 				}
-				rc = pgr_mbuf_relay(m);
-				if (rc != 0) {
-					return rc;
-				}
+				c->startup.pending = 1;
 				break;
 
 			default:                           /* all other auth types */
@@ -317,73 +470,98 @@ int pgr_conn_connect(CONNECTION *c)
 			break;
 
 		case 'K': /* BackendKeyData */
-			/* FIXME: BackendKeyData is currently ignored */
+			c->greeting.pid = pgr_mbuf_u32(m, 0);
+			c->greeting.key = pgr_mbuf_u32(m, 4);
 			pgr_mbuf_discard(m);
 			break;
 
 		case 'S': /* ParameterStatus */
-			/* FIXME: ParameterStatus is currently ignored */
+			/* keep it, verbatim, for replay to clients */
+			rc = save_status(c, m);
 			pgr_mbuf_discard(m);
+			if (rc != 0) {
+				return rc;
+			}
 			break;
 
 		case 'Z': /* ReadyForQuery */
 			pgr_mbuf_discard(m);
+			pgr_mbuf_free(m);
+			c->startup.buf = NULL;
+			c->txn = 'I';
+			c->born = time(NULL);
 			return 0;
 
 		default:
-			pgr_debugf("invalid '%c' message received from frontend; disconnecting");
+			pgr_debugf("invalid '%c' message received from backend; disconnecting", type);
 			return -1;
 		}
 	}
 }
 
-int pgr_conn_accept(CONNECTION *c)
+/* Drive the frontend side of the startup conversation:
+   SSL negotiation, StartupMessage and md5 authentication.
+   Messages are read from `in`, and our replies are queued
+   up in `out`, for the caller to flush to the client.
+
+   Returns MBUF_AGAIN if the client has yet to send us
+   what we need (call it again once it's readable), 0
+   once the client is authenticated, and non-zero if it
+   should be disconnected.  Once the StartupMessage has
+   been processed, c->username and c->database are set,
+   even if we're still waiting on the password. */
+int pgr_conn_accept(CONNECTION *c, MBUF *in, MBUF *out)
 {
 	int rc;
 	char type;
-	MBUF *m;
-
-	m = pgr_mbuf_new(512);
-	pgr_mbuf_setfd(m, c->fd, c->fd);
 
 	/* receive all messages from client */
 	for (;;) {
 		pgr_debugf("awaiting message from connection %p (fd %d)", c, c->fd);
-		rc = pgr_mbuf_recv(m);
-		if (rc < 0) {
+		rc = pgr_mbuf_recv(in);
+		if (rc == MBUF_AGAIN) {
+			return rc;
+		}
+		if (rc <= 0) {
 			return -1;
 		}
 
-		type = pgr_mbuf_msgtype(m);
+		type = pgr_mbuf_msgtype(in);
 		switch (type) {
 		case MSG_SSLREQ:
 			/* FIXME: SSL not supported in this iteration */
 			pgr_debugf("received SSLRequest; replying with 'N' (not supported)");
-			pgr_mbuf_discard(m);
-			if (write(c->fd, "N", 1) != 1) {
+			pgr_mbuf_discard(in);
+			if (pgr_mbuf_cat_raw(out, "N", 1) != 0) {
 				return -1;
 			}
+			/* (the client won't go on until it has its answer) */
+			rc = pgr_mbuf_flush(out);
+			if (rc != 0) {
+				return rc == MBUF_AGAIN ? rc : -1;
+			}
 			break;
 
 		case MSG_CANCEL:
-			pgr_debugf("ignoring CancelRequest (unimplemented)");
-			pgr_mbuf_discard(m);
-			break;
+			/* comes in on a connection of its own, which
+			   gets closed (without a reply) either way, once
+			   the cancel (if any) has gone out; see pgr_cancel. */
+			pgr_debugf("received CancelRequest");
+			pgr_cancel(c, (uint32_t)pgr_mbuf_u32(in, 4),
+			                       (uint32_t)pgr_mbuf_u32(in, 8));
+			pgr_mbuf_discard(in);
+			return 1;
 
 		case MSG_STARTUP:
 			pgr_debugf("extracting parameters from StartupMessage");
-			rc = extract_params(c, m);
+			rc = extract_params(c, in);
 			if (rc != 0) {
 				return rc;
 			}
-			pgr_mbuf_discard(m);
+			pgr_mbuf_discard(in);
 
 			pgr_debugf("sending AuthenticationMD5Password to frontend (fd %d)", c->fd);
-			rc = auth_md5_message(m, c);
-			if (rc != 0) {
-				return rc;
-			}
-			rc = pgr_mbuf_relay(m);
+			rc = auth_md5_message(out, c);
 			if (rc != 0) {
 				return rc;
 			}
@@ -391,39 +569,19 @@ int pgr_conn_accept(CONNECTION *c)
 
 		case 'p': /* PasswordMessage */
 			pgr_debugf("received PasswordMessage");
-			rc = check_auth(c, m);
-			pgr_mbuf_discard(m);
+			rc = check_auth(c, in);
+			pgr_mbuf_discard(in);
 			if (rc != 0) {
-				error_response(m, "ERROR", "28P01",
+				error_response(out, "ERROR", "28P01",
 						"password authentication failed for user \"%s\"", c->username);
-				rc = pgr_mbuf_relay(m);
-				if (rc != 0) {
-					pgr_logf(stderr, LOG_ERR, "failed to send ErrorResponse to frontend (in response to md5 authentication failure)");
-				}
 				return 1;
 			}
 
+			/* ReadyForQuery is left to the caller (see
+			   pgr_conn_ready), who may want to wait until
+			   the backends are ready before sending it. */
 			pgr_debugf("authentication succeeded; sending AuthenticationOk to frontend");
-			rc = auth_ok_message(m, c);
-			if (rc != 0) {
-				return rc;
-			}
-			rc = pgr_mbuf_relay(m);
-			if (rc != 0) {
-				return rc;
-			}
-
-			/* FIXME: should we defer ReadyForQuery until we connect to reader/writer? */
-			pgr_debugf("sending ReadyForQuery to frontend");
-			rc = ready_for_query(m, c);
-			if (rc != 0) {
-				return rc;
-			}
-			rc = pgr_mbuf_relay(m);
-			if (rc != 0) {
-				return rc;
-			}
-			return 0;
+			return auth_ok_message(out, c);
 
 		default:
 			pgr_debugf("invalid '%c' message received from frontend; disconnecting", type);
@@ -431,3 +589,44 @@ int pgr_conn_accept(CONNECTION *c)
 		}
 	}
 }
+
+/* Tell the (authenticated) client that we're ready for
+   its first query.  If we have a backend connection, its
+   ParameterStatus messages (saved from its own startup)
+   are replayed first, just as if the client had gone
+   through startup with the backend.  The BackendKeyData
+   is our own (see pgr_cancel_register), if we have any. */
+int pgr_conn_ready(CONNECTION *c, CONNECTION *be, MBUF *out)
+{
+	uint32_t u;
+	int rc;
+
+	if (be && be->greeting.len > 0) {
+		pgr_debugf("sending saved ParameterStatus messages to frontend (fd %d)", c->fd);
+		rc = pgr_mbuf_cat(out, be->greeting.status, be->greeting.len);
+		if (rc != 0) {
+			return rc;
+		}
+	}
+
+	if (c->greeting.pid != 0) {
+		pgr_debugf("sending BackendKeyData to frontend (fd %d)", c->fd);
+		pgr_mbuf_cat(out, "K\0\0\0\xc", 5);
+		u = htonl(c->greeting.pid); pgr_mbuf_cat(out, &u, 4);
+		u = htonl(c->greeting.key); rc = pgr_mbuf_cat(out, &u, 4);
+		if (rc != 0) {
+			return rc;
+		}
+	}
+
+	pgr_debugf("sending ReadyForQuery to frontend (fd %d)", c->fd);
+	return ready_for_query(out, c);
+}
+
+/* Tell the client, with a FATAL ErrorResponse, why we
+   are about to hang up on it. */
+int pgr_conn_fatal(MBUF *out, char *code, char *msg)
+{
+	error_response(out, "FATAL", code, "%s", msg);
+	return pgr_mbuf_flush(out);
+}
@@ -23,8 +23,24 @@ int pgr_context(CONTEXT *c)
 	if (rc != 0) {
 		return rc;
 	}
+	rc = pthread_rwlock_init(&c->cancel.lock, NULL);
+	if (rc != 0) {
+		return rc;
+	}
+
+	rc = pthread_rwlock_init(&c->functions.lock, NULL);
+	if (rc != 0) {
+		return rc;
+	}
 
 	int i;
+	for (i = 0; i < QCACHE_SHARDS; i++) {
+		rc = pthread_rwlock_init(&c->qcache[i].lock, NULL);
+		if (rc != 0) {
+			return rc;
+		}
+	}
+
 	for (i = 0; i < c->num_backends; i++) {
 		rc = pthread_rwlock_init(&c->backends[i].lock, NULL);
 		if (rc != 0) {
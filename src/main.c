@@ -33,6 +33,8 @@
 typedef struct {
 	pthread_t  watcher;  /* watcher thread id       */
 	pthread_t  monitor;  /* monitor thread id       */
+	pthread_t  warmer;   /* pool warmer thread id   */
+	pthread_t  keeper;   /* housekeeper thread id   */
 	pthread_t *workers;  /* worker thread ids       */
 	int        n;        /* how many worker threads */
 } THREADSET;
@@ -45,6 +47,8 @@ static void do_shutdown(THREADSET *threads)
 	/* first we cancel */
 	pthread_cancel(threads->watcher);
 	pthread_cancel(threads->monitor);
+	pthread_cancel(threads->warmer);
+	pthread_cancel(threads->keeper);
 	for (i = 0; i < threads->n; i++) {
 		pthread_cancel(threads->workers[i]);
 	}
@@ -52,12 +56,77 @@ static void do_shutdown(THREADSET *threads)
 	/* then we join */
 	pthread_join(threads->watcher, &ret);
 	pthread_join(threads->monitor, &ret);
+	pthread_join(threads->warmer, &ret);
+	pthread_join(threads->keeper, &ret);
 
 	for (i = 0; i < threads->n; i++) {
 		pthread_join(threads->workers[i], &ret);
 	}
 }
 
+/* Bind one SO_REUSEPORT frontend socket per WORKER thread,
+   for each address family, so that the kernel can hand each
+   inbound connection to exactly one worker.  In balanced
+   mode, also attach the BPF program that steers connections
+   to the least-loaded worker. */
+static void bind_frontends(CONTEXT *c)
+{
+	int i, n4, n6, ok;
+
+	c->frontend4 = c->frontend6 = -1;
+	c->frontends4 = calloc(c->workers, sizeof(int));
+	c->frontends6 = calloc(c->workers, sizeof(int));
+	if (!c->frontends4 || !c->frontends6) {
+		pgr_abort(ABORT_MEMFAIL);
+	}
+
+	n4 = n6 = 0;
+	for (i = 0; i < c->workers; i++) {
+		c->frontends4[i] = pgr_listen4(c->startup.frontend, FRONTEND_BACKLOG, 1);
+		c->frontends6[i] = pgr_listen6(c->startup.frontend, FRONTEND_BACKLOG, 1);
+		if (c->frontends4[i] >= 0) n4++;
+		if (c->frontends6[i] >= 0) n6++;
+	}
+
+	/* every worker needs a socket in each family we listen on */
+	if ((n4 == 0 && n6 == 0)
+	 || (n4 != 0 && n4 != c->workers)
+	 || (n6 != 0 && n6 != c->workers)) {
+		pgr_logf(stderr, LOG_ERR, "[super] unable to bind %d reuseport frontend sockets to %s",
+				c->workers, c->startup.frontend);
+		pgr_abort(ABORT_NET);
+	}
+
+	if (c->startup.reuseport != REUSEPORT_BALANCED) {
+		return;
+	}
+
+	c->steering.n = c->workers;
+	c->steering.load = calloc(c->workers, sizeof(int));
+	if (!c->steering.load) {
+		pgr_abort(ABORT_MEMFAIL);
+	}
+
+	/* a family we fail to attach to just keeps hashing */
+	ok = 0;
+	c->steering.map = pgr_steer_map();
+	if (c->steering.map >= 0) {
+		if (n4 && pgr_steer(c->steering.map, c->frontends4[0]) == 0) ok++;
+		if (n6 && pgr_steer(c->steering.map, c->frontends6[0]) == 0) ok++;
+	}
+
+	if (!ok) {
+		pgr_logf(stderr, LOG_ERR, "[super] BPF steering unavailable; "
+				"falling back to kernel reuseport hashing");
+		if (c->steering.map >= 0) {
+			close(c->steering.map);
+		}
+		c->steering.map = -1;
+		return;
+	}
+	pgr_logf(stderr, LOG_INFO, "[super] steering new connections to least-loaded workers");
+}
+
 static void inform_parent(int fd, const char *fmt, ...)
 {
 	ssize_t n;
@@ -294,6 +363,7 @@ int main(int argc, char **argv)
 
 	CONTEXT c;
 	memset(&c, 0, sizeof(c));
+	c.steering.map = -1;
 	if (pgr_configure(&c, config, 0) != 0) {
 		pgr_logf(stderr, LOG_ERR, "failed to load configuration from %s: %s (errno %d)",
 				config, strerror(errno), errno);
@@ -318,15 +388,19 @@ int main(int argc, char **argv)
 	}
 
 	pgr_logf(stderr, LOG_INFO, "[super] binding frontend to %s", c.startup.frontend);
-	c.frontend4 = pgr_listen4(c.startup.frontend, FRONTEND_BACKLOG);
-	c.frontend6 = pgr_listen6(c.startup.frontend, FRONTEND_BACKLOG);
-	if (c.frontend4 < 0 && c.frontend6 < 0) {
-		pgr_abort(ABORT_NET);
+	if (c.startup.reuseport == REUSEPORT_OFF) {
+		c.frontend4 = pgr_listen4(c.startup.frontend, FRONTEND_BACKLOG, 0);
+		c.frontend6 = pgr_listen6(c.startup.frontend, FRONTEND_BACKLOG, 0);
+		if (c.frontend4 < 0 && c.frontend6 < 0) {
+			pgr_abort(ABORT_NET);
+		}
+	} else {
+		bind_frontends(&c);
 	}
 
 	pgr_logf(stderr, LOG_INFO, "[super] binding monitor to %s", c.startup.monitor);
-	c.monitor4 = pgr_listen4(c.startup.monitor, MONITOR_BACKLOG);
-	c.monitor6 = pgr_listen6(c.startup.monitor, MONITOR_BACKLOG);
+	c.monitor4 = pgr_listen4(c.startup.monitor, MONITOR_BACKLOG, 0);
+	c.monitor6 = pgr_listen6(c.startup.monitor, MONITOR_BACKLOG, 0);
 	if (c.monitor4 < 0 && c.monitor6 < 0) {
 		pgr_abort(ABORT_NET);
 	}
@@ -352,16 +426,28 @@ int main(int argc, char **argv)
 		return 5;
 	}
 
+	pgr_logf(stderr, LOG_INFO, "[super] spinning up HOUSEKEEPER thread");
+	rc = pgr_housekeeper(&c, &threads.keeper);
+	if (rc != 0) {
+		return 9;
+	}
+
 	pgr_logf(stderr, LOG_INFO, "[super] spinning up MONITOR thread");
 	rc = pgr_monitor(&c, &threads.monitor);
 	if (rc != 0) {
 		return 6;
 	}
 
+	pgr_logf(stderr, LOG_INFO, "[super] spinning up WARMER thread");
+	rc = pgr_pool_warmer(&c, &threads.warmer);
+	if (rc != 0) {
+		return 8;
+	}
+
 	int i;
 	for (i = 0; i < threads.n; i++) {
 		pgr_logf(stderr, LOG_INFO, "[super] spinning up WORKER thread #%d", i+1);
-		rc = pgr_worker(&c, &threads.workers[i]);
+		rc = pgr_worker(&c, i, &threads.workers[i]);
 		if (rc != 0) {
 			return 7;
 		}
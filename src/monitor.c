@@ -19,6 +19,7 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <arpa/inet.h>
 #include <unistd.h>
 #include <pthread.h>
 
@@ -29,7 +30,8 @@
 
 static void handle_client(CONTEXT *c, int connfd)
 {
-	int rc, i;
+	int rc, i, n;
+	unsigned long hits, misses;
 
 	rdlock(&c->lock, "context", 0);
 
@@ -37,6 +39,9 @@ static void handle_client(CONTEXT *c, int connfd)
 	pgr_sendf(connfd, "workers %d\n", c->workers);
 	pgr_sendf(connfd, "clients %d\n", c->fe_conns);
 
+	pgr_qcache_stats(c, &hits, &misses, &n);
+	pgr_sendf(connfd, "querycache %d/%d %lu/%lu\n", n, QCACHE_SHARDS * QCACHE_ENTRIES, hits, misses);
+
 	for (i = 0; i < c->num_backends; i++) {
 		rdlock(&c->backends[i].lock, "backend", i);
 
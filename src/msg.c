@@ -23,7 +23,7 @@
 #define min(a,b) ((a) > (b) ? (b) : (a))
 #define available(m) ((m)->fill - (m)->start)
 #define u16(v) ((uint16_t)((*(v)&0xff)<<8)|*((v)+1)&0xff)
-#define u32(v) ((uint16_t)((*(v)&0xff)<<24)|((*((v)+1)&0xff)<<16)|((*((v)+2)&0xff)<<8)|(*((v)+3)&0xff))
+#define u32(v) (((uint32_t)(*(v)&0xff)<<24)|((*((v)+1)&0xff)<<16)|((*((v)+2)&0xff)<<8)|(*((v)+3)&0xff))
 
 static int tmpfd()
 {
@@ -49,16 +49,177 @@ static unsigned int size(MBUF *m)
 static ssize_t writen(int fd, const void *buf, size_t len)
 {
 	ssize_t n;
+	const uint8_t *p = buf;
 	while (len > 0) {
-		n = write(fd, buf, len);
+		n = write(fd, p, len);
 		if (n <= 0) {
 			return n;
 		}
 		len -= n;
+		p   += n;
 	}
 	return n;
 }
 
+/* Did the last read() / write() fail just because
+   a non-blocking descriptor wasn't ready for it? */
+static int wouldblock()
+{
+	return errno == EAGAIN || errno == EWOULDBLOCK;
+}
+
+/* Move all of the octets we have already sent (and
+   are retaining for pgr_mbuf_resend) out of the buffer
+   and into the overflow cache file, to make room. */
+static int spill(MBUF *m)
+{
+	ssize_t n;
+
+	if (m->start == 0) {
+		return 0;
+	}
+
+	if (m->cache < 0) {
+		/* time to warm up the cache */
+		m->cache = tmpfd();
+		if (m->cache < 0) { /* still! */
+			return 1;
+		}
+	}
+
+	n = writen(m->cache, m->buf, m->start);
+	if (n <= 0) {
+		return 1;
+	}
+	memmove(m->buf, m->buf + m->start, m->fill - m->start);
+	m->fill -= m->start;
+	m->start = 0;
+	return 0;
+}
+
+/* Read whatever we can from the input descriptor into
+   the free space at the end of the buffer.  Returns the
+   number of octets read, 0 on EOF, MBUF_AGAIN if the
+   (non-blocking) descriptor has nothing for us yet,
+   and -1 on failure. */
+static int more(MBUF *m)
+{
+	ssize_t n;
+
+	if (m->fill == m->len && spill(m) != 0) {
+		return -1;
+	}
+	if (m->fill == m->len) {
+		return -1; /* no room at the inn */
+	}
+
+	n = read(m->infd, m->buf + m->fill, m->len - m->fill);
+	if (n < 0 && wouldblock()) {
+		return MBUF_AGAIN;
+	}
+	if (n <= 0) {
+		return (int)n;
+	}
+	m->fill += n;
+	return (int)n;
+}
+
+/* Write out everything we've staged in the (corked)
+   output area, so far.  Returns 0 once it's all gone,
+   MBUF_AGAIN if the output descriptor would block, and
+   1 on failure. */
+static int push(MBUF *m)
+{
+	ssize_t n;
+
+	while (m->olen > 0) {
+		n = write(m->outfd, m->out, m->olen);
+		if (n < 0 && wouldblock()) {
+			return MBUF_AGAIN;
+		}
+		if (n <= 0) {
+			return 1;
+		}
+		memmove(m->out, m->out + n, m->olen - n);
+		m->olen -= n;
+	}
+	return 0;
+}
+
+#define PASS_SEND    0 /* write it out, and retain it for resend */
+#define PASS_RELAY   1 /* write it out, and forget about it      */
+#define PASS_DISCARD 2 /* don't write it out; just forget it     */
+#define PASS_KEEP    3 /* don't write it out; retain it         */
+
+/* Pass the first message in the buffer along, per `how`.
+   Progress is tracked in m->left, so that if either of
+   the descriptors would block, we can return MBUF_AGAIN
+   and pick up where we left off on the next call. */
+static int pass(MBUF *m, int how)
+{
+	ssize_t n;
+	int rc, stage;
+
+	if (m->left == 0) {
+		if (available(m) < 5) {
+			return 1;
+		}
+		m->left = size(m);
+	}
+
+	while (m->left > 0) {
+		if (available(m) == 0) {
+			rc = more(m);
+			if (rc == MBUF_AGAIN) {
+				return rc;
+			}
+			if (rc <= 0) {
+				return 1;
+			}
+			continue;
+		}
+
+		n = min(m->left, available(m));
+		if (how == PASS_SEND || how == PASS_RELAY) {
+			/* if the (rest of the) message is here, and we
+			   have room, stage it so it can be written out
+			   along with the messages that follow it. */
+			stage = m->out && n == m->left && m->olen + n <= m->omax;
+			if (!stage && m->olen > 0) {
+				rc = push(m);
+				if (rc != 0) {
+					return rc;
+				}
+				stage = m->out && n == m->left && n <= m->omax;
+			}
+
+			if (stage) {
+				memcpy(m->out + m->olen, m->buf + m->start, n);
+				m->olen += n;
+
+			} else {
+				n = write(m->outfd, m->buf + m->start, n);
+				if (n < 0 && wouldblock()) {
+					return MBUF_AGAIN;
+				}
+				if (n <= 0) {
+					return 1;
+				}
+			}
+		}
+
+		m->left -= n;
+		if (how == PASS_SEND || how == PASS_KEEP) {
+			m->start += n;
+		} else {
+			memmove(m->buf + m->start, m->buf + m->start + n, m->fill - m->start - n);
+			m->fill -= n;
+		}
+	}
+
+	return 0;
+}
+
 /* Generate a new MBUF structure of the given size,
    allocated on the heap. The `len` argument must be
    at least 16 (octets). */
@@ -76,6 +237,38 @@ MBUF* pgr_mbuf_new(size_t len)
 	return m;
 }
 
+/* Free an MBUF structure, and close its overflow
+   cache file (if any).  The input and output file
+   descriptors are left open. */
+void pgr_mbuf_free(MBUF *m)
+{
+	if (!m) {
+		return;
+	}
+	if (m->cache >= 0) {
+		close(m->cache);
+	}
+	free(m->out);
+	free(m);
+}
+
+/* Cork the output side of the MBUF, staging up to `len`
+   octets of complete messages (from send / relay) in
+   an output area, instead of writing each one out as
+   soon as it is passed along.  Staged messages go out,
+   all at once, via pgr_mbuf_push, or whenever the MBUF
+   is about to block waiting on the input descriptor. */
+void pgr_mbuf_cork(MBUF *m, size_t len)
+{
+	free(m->out);
+	m->out = malloc(len);
+	if (!m->out) {
+		pgr_abort(ABORT_MEMFAIL);
+	}
+	m->olen = 0;
+	m->omax = len;
+}
+
 /* Set the input and output file descriptors to the
    passed values.  To leave existing fd untouched,
    specify the constant `MBUF_SAME_FD`.  To unset a
@@ -98,6 +291,25 @@ void pgr_mbuf_setfd(MBUF *m, int in, int out)
 void pgr_mbuf_reset(MBUF *m)
 {
 	m->start = m->fill = 0;
+	m->left = m->redo = 0;
+	m->olen = 0;
+	if (m->cache >= 0) {
+		close(m->cache);
+		m->cache = -1;
+	}
+}
+
+/* Forget about all of the messages we have sent and
+   retained (via pgr_mbuf_send), without disturbing
+   any messages that we have yet to process. */
+void pgr_mbuf_forget(MBUF *m)
+{
+	if (m->start > 0) {
+		memmove(m->buf, m->buf + m->start, m->fill - m->start);
+		m->fill -= m->start;
+		m->start = 0;
+	}
+	m->redo = 0;
 	if (m->cache >= 0) {
 		close(m->cache);
 		m->cache = -1;
@@ -109,10 +321,10 @@ void pgr_mbuf_reset(MBUF *m)
 void pgr_mbuf_dump(MBUF *m)
 {
 	pgr_debugf("mbuf %p (buf %p) infd %d, outfd %d, cache %d, start %d (%p), "
-		"fill %d (%p), len %d",
+		"fill %d (%p), len %d, left %d, staged %d",
 		m, m->buf, m->infd, m->outfd, m->cache, m->start, m->buf + m->start,
-		m->fill,  m->buf + m->fill, m->len);
-	if (m->start != m->fill) {
+		m->fill,  m->buf + m->fill, m->len, m->left, m->olen);
+	if (m->start != m->fill && m->left == 0) {
 		pgr_hexdump(m->buf + m->start,
 			min(m->fill - m->start, size(m)));
 	}
@@ -132,19 +344,46 @@ int pgr_mbuf_cat(MBUF *m, const void *buf, size_t len)
 	return 0;
 }
 
-/* Fill as much of the buffer with octets read from
-   the input file descriptor.  If the buffer already
-   contains enough data to see the first 5 octets of
-   a message, this call does nothing and returns
-   immediately. */
+/* Append octets that aren't a message of their own
+   (like the lone 'N' that answers an SSLRequest) to an
+   otherwise empty buffer, to be written out as-is by the
+   next pgr_mbuf_flush, as if they were what's left of a
+   message already underway. */
+int pgr_mbuf_cat_raw(MBUF *m, const void *buf, size_t len)
+{
+	if (m->left != 0 || available(m) != 0) {
+		return 1;
+	}
+	if (pgr_mbuf_cat(m, buf, len) != 0) {
+		return 1;
+	}
+	m->left = len;
+	return 0;
+}
+
+/* Fill the buffer with octets read from the input
+   file descriptor, until the first message is in the
+   buffer in its entirety (or we run out of room).  If
+   the buffer already holds the whole message, this
+   call does nothing and returns immediately.
+
+   On a non-blocking descriptor, returns MBUF_AGAIN if
+   the message hasn't fully arrived yet; call it again
+   once the descriptor becomes readable.  Before we go
+   off to wait, any staged output is pushed out. */
 int pgr_mbuf_recv(MBUF *m)
 {
-	while (available(m) < 5) {
-		ssize_t n = read(m->infd, m->buf + m->fill, m->len - m->fill);
-		if (n <= 0) {
-			return (int)n;
+	int rc;
+
+	while (available(m) < 5
+	   || (available(m) < size(m) && m->fill < m->len)) {
+		rc = more(m);
+		if (rc == MBUF_AGAIN && push(m) == 1) {
+			return -1;
+		}
+		if (rc <= 0) {
+			return rc;
 		}
-		m->fill += n;
 	}
 	pgr_debugf("received message from infd %d", m->infd);
 	pgr_mbuf_dump(m);
@@ -155,167 +394,115 @@ int pgr_mbuf_recv(MBUF *m)
    file descriptor, buffering all data sent, so that
    it can be resent later.  For very large messages,
    i.e. INSERT statements with large blobs), this may
-   require reading from the input file descriptor. */
+   require reading from the input file descriptor.
+
+   On non-blocking descriptors, returns MBUF_AGAIN if
+   either descriptor would block; call it again (once
+   they are ready) to finish sending the message. */
 int pgr_mbuf_send(MBUF *m)
 {
-	int wr_ok, cache_ok;
-	unsigned int len;
-	ssize_t n, off;
-
-	if (available(m) < 5) {
-		return 1;
-	}
-
 	pgr_debugf("sending message %d -> %d", m->infd, m->outfd);
 	pgr_mbuf_dump(m);
-
-	wr_ok = 1;
-	len = size(m);
-	while (len > available(m)) {
-		if (m->cache < 0) {
-			/* time to warm up the cache */
-			m->cache = tmpfd();
-			if (m->cache < 0) { /* still! */
-				return 1;
-			}
-
-			if (m->start > 0) {
-				n = writen(m->cache, m->buf, m->start);
-				if (n <= 0) {
-					return 1;
-				}
-				memmove(m->buf, m->buf + m->start, m->fill - m->start);
-				m->fill -= m->start;
-				m->start = 0;
-			}
-		}
-		n = writen(m->outfd, m->buf + m->start, available(m));
-		wr_ok = (n > 0);
-
-		n = writen(m->cache, m->buf + m->start, available(m));
-		if (n <= 0) {
-			return 1;
-		}
-
-		len -= available(m);
-		m->fill = m->start;
-
-		n = read(m->infd, m->buf + m->fill, m->len - m->fill);
-		if (n <= 0) {
-			return n;
-		}
-		m->fill += n;
-	}
-
-	if (len > 0) {
-		n = writen(m->outfd, m->buf + m->start, len);
-		wr_ok = (n > 0);
-
-		if (m->cache >= 0) {
-			n = writen(m->cache, m->buf + m->start, len);
-			if (n <= 0) {
-				return 1;
-			}
-
-			memmove(m->buf + m->start, m->buf + m->start + len, m->fill - m->start - len);
-			m->fill -= len;
-
-		} else {
-			m->start += len;
-		}
-	}
-
-	return wr_ok ? 0 : 1;
+	return pass(m, PASS_SEND);
 }
 
 /* Resend all buffered message for which we've
-   buffered data (i.e. via pgr_mbuf_send) */
+   buffered data (i.e. via pgr_mbuf_send)
+
+   On a non-blocking output descriptor, returns
+   MBUF_AGAIN if it would block; call it again to
+   resend the rest. */
 int pgr_mbuf_resend(MBUF *m)
 {
-	size_t until;
+	off_t cached;
 	ssize_t n;
+	char block[2048];
 
+	cached = 0;
 	if (m->cache >= 0) {
-		char *block = malloc(2048);
-		off_t offset = lseek(m->cache, 0, SEEK_CUR);
-		lseek(m->cache, 0, SEEK_SET);
-		while (offset > 0) {
-			n = read(m->cache, block, 2048);
-			if (n <= 0) {
-				free(block);
-				return 1;
-			}
-			offset -= n;
-			n = writen(m->outfd, block, n);
-			if (n <= 0) {
-				free(block);
-				return 1;
-			}
-		}
-		free(block);
+		cached = lseek(m->cache, 0, SEEK_CUR);
 	}
 
-	until = m->start;
-	m->start = 0; /* FIXME: naïve */
+	while (m->redo < cached) {
+		n = pread(m->cache, block, min(sizeof(block), cached - m->redo), m->redo);
+		if (n <= 0) {
+			return 1;
+		}
+		n = write(m->outfd, block, n);
+		if (n < 0 && wouldblock()) {
+			return MBUF_AGAIN;
+		}
+		if (n <= 0) {
+			return 1;
+		}
+		m->redo += n;
+	}
 
-	while (until > m->start) {
-		n = write(m->outfd, m->buf + m->start, until - m->start);
+	while (m->redo < cached + m->start) {
+		n = write(m->outfd, m->buf + (m->redo - cached), cached + m->start - m->redo);
+		if (n < 0 && wouldblock()) {
+			return MBUF_AGAIN;
+		}
 		if (n <= 0) {
 			return 1;
 		}
-		m->start += n;
+		m->redo += n;
 	}
+
+	m->redo = 0;
 	return 0;
 }
 
+/* Retain the first message in the buffer, as if it
+   had been sent (via pgr_mbuf_send), without writing it
+   out; the next pgr_mbuf_resend will send it.
+
+   On a non-blocking input descriptor, returns MBUF_AGAIN
+   if it would block; call it again to keep the rest. */
+int pgr_mbuf_keep(MBUF *m)
+{
+	pgr_debugf("keeping message from %d, for resend", m->infd);
+	return pass(m, PASS_KEEP);
+}
+
 /* Relay the first message in the buffer to the output
    file descriptor, and reposition the buffer at the
    beginning of the next message.  This may lead to an
-   empty buffer. */
+   empty buffer.
+
+   On non-blocking descriptors, returns MBUF_AGAIN if
+   either descriptor would block; call it again (once
+   they are ready) to finish relaying the message. */
 int pgr_mbuf_relay(MBUF *m)
 {
-	int len, wr_ok;
-	ssize_t n, off;
-
-	if (available(m) < 5) {
-		return 1;
-	}
-
 	pgr_debugf("relaying message to from %d -> %d", m->infd, m->outfd);
 	pgr_mbuf_dump(m);
+	return pass(m, PASS_RELAY);
+}
 
-	wr_ok = 1;
-	len = size(m);
-	while (len > available(m)) {
-		off = m->start;
-		while (wr_ok && off < m->fill) {
-			n = write(m->outfd, m->buf + off, m->fill - off);
-			wr_ok = (n > 0);
-			off += n;
-		}
-
-		len -= available(m);
-		m->fill = m->start;
+/* Relay all of the messages in the buffer to the
+   output descriptor, without reading anything from
+   the input descriptor.  Meant for buffers filled
+   via pgr_mbuf_cat, with replies of our own making. */
+int pgr_mbuf_flush(MBUF *m)
+{
+	int rc;
 
-		n = read(m->infd, m->buf + m->fill, m->len - m->fill);
-		if (n <= 0) {
-			return 1;
+	while (m->left > 0 || available(m) >= 5) {
+		rc = pass(m, PASS_RELAY);
+		if (rc != 0) {
+			return rc;
 		}
-		m->fill += n;
 	}
+	return push(m);
+}
 
-	if (len > 0) {
-		off = 0;
-		while (wr_ok && off < len) {
-			n = write(m->outfd, m->buf + m->start + off, (len - off));
-			wr_ok = (n > 0);
-			off += n;
-		}
-
-		memmove(m->buf + m->start, m->buf + m->start + len, m->fill - m->start - len);
-		m->fill -= len;
-	}
-	return wr_ok ? 0 : 1;
+/* Write out all of the messages staged by a corked
+   MBUF (see pgr_mbuf_cork).  Returns MBUF_AGAIN if the
+   output descriptor would block. */
+int pgr_mbuf_push(MBUF *m)
+{
+	return push(m);
 }
 
 /* Discard all buffered data for the current message,
@@ -323,55 +510,57 @@ int pgr_mbuf_relay(MBUF *m)
    if necessary. */
 int pgr_mbuf_discard(MBUF *m)
 {
-	int len;
-	ssize_t n;
-
-	if (available(m) < 5) {
-		return 1;
-	}
-
-	len = size(m);
-	while (len > available(m)) {
-		len -= available(m);
-		m->fill = m->start;
-
-		n = read(m->infd, m->buf + m->fill, m->len - m->fill);
-		if (n <= 0) {
-			return (int)n;
-		}
-		m->fill += n;
-	}
-
-	if (len > 0) {
-		memmove(m->buf + m->start, m->buf + m->start + len, m->fill - m->start - len);
-		m->fill -= len;
-	}
-
-	return 0;
+	return pass(m, PASS_DISCARD);
 }
 
 /* Keep receiving and discarding messages until a
    message of type `until` is seen.
-   Any previous messages in the buffer are kept. */
+   Any previous messages in the buffer are kept.
+
+   On a non-blocking input descriptor, returns
+   MBUF_AGAIN if it would block; call it again to
+   keep draining.  The `until` message itself must
+   fit in the buffer. */
 int pgr_mbuf_drain(MBUF *m, char until)
 {
 	char type;
+	int rc;
 
 	for (;;) {
+		if (m->left > 0) {
+			/* finish discarding a message we started on */
+			rc = pass(m, PASS_DISCARD);
+			if (rc != 0) {
+				return rc;
+			}
+		}
+
+		rc = pgr_mbuf_recv(m);
+		if (rc == MBUF_AGAIN) {
+			return rc;
+		}
+		if (rc <= 0) {
+			return -1;
+		}
+
 		type = pgr_mbuf_msgtype(m);
 		if (type < 0) {
 			return -1;
 		}
 
-		pgr_mbuf_discard(m);
-
 		pgr_debugf("discarding %c (%02x) message", isprint(type) ? type : '.', type);
+		rc = pass(m, PASS_DISCARD);
+		if (rc == MBUF_AGAIN && type != until) {
+			return rc;
+		}
+		if (rc != 0) {
+			return -1;
+		}
+
 		if (type == until) {
 			pgr_debugf("exiting");
 			return 0;
 		}
-
-		pgr_mbuf_recv(m);
 	}
 }
 
@@ -470,7 +659,7 @@ int pgr_mbuf_u16(MBUF *m, size_t at)
 
 long int pgr_mbuf_u32(MBUF *m, size_t at)
 {
-	void *x = pgr_mbuf_data(m, at, 2);
+	void *x = pgr_mbuf_data(m, at, 4);
 	if (!x) {
 		return -1;
 	}
@@ -568,7 +757,7 @@ static void reset_test()
 {
 	char *s;
 
-	m->fill = 0;
+	pgr_mbuf_reset(m);
 
 	ftruncate(in, 0);
 	lseek(in, 0, SEEK_SET);
@@ -742,6 +931,23 @@ int main(int argc, char **argv)
 
 	msg_is("after sending 'L' message", m, 'S', 0);
 
+	 /********************************************************/
+	/* Keep                                                 */
+	reset_test();
+	so("recv ok", pgr_mbuf_recv(m) > 0);
+	ok(pgr_mbuf_keep(m));
+	so("nothing written while keeping", lseek(out, 0, SEEK_CUR) == 0);
+
+	msg_is("after keeping SSLRequest message", m, MSG_STARTUP, 5);
+	so("recv ok", pgr_mbuf_recv(m) > 0);
+	ok(pgr_mbuf_keep(m));
+	so("nothing written while keeping", lseek(out, 0, SEEK_CUR) == 0);
+
+	ok(pgr_mbuf_resend(m));
+	fileok(out, "\0\0\0\x08\x04\xd2\x16\x2f"
+	            "\0\0\0\x09\x00\x03\x00\x00\x00", 8+9);
+	msg_is("after keeping StartupMessage message", m, 'I', 0);
+
 	 /********************************************************/
 	/* Drain                                                */
 	reset_test();
@@ -779,6 +985,39 @@ int main(int argc, char **argv)
 	ok(pgr_mbuf_relay(m));
 	fileok(out, "Q\0\0\0\x12" "SELECT THINGS\0", 19);
 
+	/* (unframed octets, ahead of a message) */
+	reset_test();
+	ok(pgr_mbuf_cat_raw(m, "N", 1));
+	notok(pgr_mbuf_cat_raw(m, "N", 1));
+	pgr_mbuf_cat(m, "Q\0\0\0\x12" "SELECT THINGS\0", 19);
+	ok(pgr_mbuf_flush(m));
+	fileok(out, "N" "Q\0\0\0\x12" "SELECT THINGS\0", 1+19);
+
+	 /********************************************************/
+	/* Corking                                              */
+	reset_test();
+	pgr_mbuf_cork(m, 64);
+	so("recv ok", pgr_mbuf_recv(m) > 0);
+	ok(pgr_mbuf_relay(m));
+	so("recv ok", pgr_mbuf_recv(m) > 0);
+	ok(pgr_mbuf_relay(m));
+	so("nothing written while corked", lseek(out, 0, SEEK_CUR) == 0);
+	ok(pgr_mbuf_push(m));
+	fileok(out, "\0\0\0\x08\x04\xd2\x16\x2f"
+	            "\0\0\0\x09\x00\x03\x00\x00\x00", 8+9);
+
+	/* messages too big to stage are written through,
+	   right after everything staged ahead of them */
+	so("recv ok", pgr_mbuf_recv(m) > 0);
+	ok(pgr_mbuf_relay(m));
+	so("recv ok", pgr_mbuf_recv(m) > 0);
+	ok(pgr_mbuf_relay(m));
+	so("recv ok", pgr_mbuf_recv(m) > 0);
+	ok(pgr_mbuf_relay(m));
+	ok(pgr_mbuf_push(m));
+	so("all of the L message was relayed, after the staged messages",
+			lseek(out, 0, SEEK_CUR) == 8+9+5+38+0x8000+5);
+
 	/********************************************************/
 
 	printf("PASS\n");
@@ -68,7 +68,7 @@ static char* gethost(const char *ep)
 	return host;
 }
 
-static int bind_and_listen(const char *ep, struct sockaddr* sa, int fd, int backlog)
+static int bind_and_listen(const char *ep, struct sockaddr* sa, int fd, int backlog, int reuseport)
 {
 	int rc;
 	int ena = 1;
@@ -79,6 +79,17 @@ static int bind_and_listen(const char *ep, struct sockaddr* sa, int fd, int back
 		pgr_logf(stderr, LOG_ERR, "(continuing, but bind may fail...)");
 	}
 
+	if (reuseport) {
+		ena = 1;
+		rc = setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &ena, sizeof(ena));
+		if (rc != 0) {
+			pgr_logf(stderr, LOG_ERR, "failed to set SO_REUSEPORT on [%s]: %s (errno %d)",
+					ep, strerror(errno), errno);
+			close(fd);
+			return -1;
+		}
+	}
+
 	if (sa->sa_family == AF_INET6) {
 		ena = 1;
 		rc = setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &ena, sizeof(ena));
@@ -199,7 +210,7 @@ static int ipv6_endpoint(struct sockaddr_in6 *sa, const char *ep)
 	return 0;
 }
 
-int pgr_listen4(const char *ep, int backlog)
+int pgr_listen4(const char *ep, int backlog, int reuseport)
 {
 	int rc, fd;
 	struct sockaddr_in sa;
@@ -226,10 +237,10 @@ int pgr_listen4(const char *ep, int backlog)
 	}
 
 	pgr_debugf("binding / listening on fd %d", fd);
-	return bind_and_listen(ep, (struct sockaddr*)(&sa), fd, backlog);
+	return bind_and_listen(ep, (struct sockaddr*)(&sa), fd, backlog, reuseport);
 }
 
-int pgr_listen6(const char *ep, int backlog)
+int pgr_listen6(const char *ep, int backlog, int reuseport)
 {
 	int rc, fd;
 	struct sockaddr_in6 sa;
@@ -255,10 +266,10 @@ int pgr_listen6(const char *ep, int backlog)
 	}
 
 	pgr_debugf("binding / listening on fd %d", fd);
-	return bind_and_listen(ep, (struct sockaddr*)(&sa), fd, backlog);
+	return bind_and_listen(ep, (struct sockaddr*)(&sa), fd, backlog, reuseport);
 }
 
-int pgr_connect(const char *host, int port, int timeout_ms)
+static int open_connection(const char *host, int port, int flags)
 {
 	int rc, fd, type;
 	struct sockaddr_in ipv4;
@@ -268,14 +279,14 @@ int pgr_connect(const char *host, int port, int timeout_ms)
 
 	rc = ipv4_hostport(&ipv4, host, port);
 	if (rc == 0) {
-		fd = socket(ipv4.sin_family, SOCK_STREAM, 0);
+		fd = socket(ipv4.sin_family, SOCK_STREAM | flags, 0);
 		type = 4;
 	} else {
 		rc = ipv6_hostport(&ipv6, host, port);
 		if (rc != 0) {
 			return -1;
 		}
-		fd = socket(ipv6.sin6_family, SOCK_STREAM, 0);
+		fd = socket(ipv6.sin6_family, SOCK_STREAM | flags, 0);
 		type = 6;
 	}
 	if (fd < 0) {
@@ -300,6 +311,9 @@ int pgr_connect(const char *host, int port, int timeout_ms)
 		close(fd);
 		return -1;
 	}
+	if (rc != 0 && (flags & SOCK_NONBLOCK) && errno == EINPROGRESS) {
+		return fd;
+	}
 	if (rc != 0) {
 		pgr_logf(stderr, LOG_ERR, "failed to connect (ipv%d) to host %s on port %d: %s (errno %d)",
 				type, host, port, strerror(errno), errno);
@@ -309,6 +323,20 @@ int pgr_connect(const char *host, int port, int timeout_ms)
 	return fd;
 }
 
+int pgr_connect(const char *host, int port, int timeout_ms)
+{
+	return open_connection(host, port, 0);
+}
+
+/* Start connecting to host:port, on a non-blocking socket,
+   without waiting for the connection to be established.
+   The socket becomes writable once it is (or once it has
+   failed to be, in which case the first write will tell). */
+int pgr_connect_async(const char *host, int port)
+{
+	return open_connection(host, port, SOCK_NONBLOCK);
+}
+
 int pgr_sendn(int fd, const void *buf, size_t n)
 {
 	ssize_t nwrit;
@@ -20,6 +20,7 @@
 #include <stdint.h>
 #include <pthread.h>
 #include <syslog.h>
+#include <time.h>
 
 #define RAND_DEVICE "/dev/urandom"
 
@@ -43,6 +44,17 @@ char* pgr_backend_role(int role);
 #define BACKEND_TLS_VERIFY   1  /* do SSL/TLS; verify certs.    */
 #define BACKEND_TLS_NOVERIFY 2  /* do SSL/TLS; skip verif.      */
 
+/* Frontend listener behaviors */
+#define REUSEPORT_OFF        0  /* all workers share one socket */
+#define REUSEPORT_ON         1  /* one socket per worker        */
+#define REUSEPORT_BALANCED   2  /* ... + least-loaded steering  */
+
+/* Backend connection pooling modes */
+#define POOL_OFF             0  /* connect anew, every time     */
+#define POOL_SESSION         1  /* reuse, once a client is done */
+#define POOL_TRANSACTION     2  /* reuse, between transactions  */
+#define POOL_STATEMENT       3  /* ... and between reads        */
+
 /* Exit codes */
 #define ABORT_UNKNOWN  1
 #define ABORT_MEMFAIL  2
@@ -56,6 +68,10 @@ char* pgr_backend_role(int role);
 /* Defaults */
 #define DEFAULT_MONITOR_BIND  "127.0.0.1:14231"
 #define DEFAULT_FRONTEND_BIND "*:5432"
+#define DEFAULT_POOL_SIZE     20
+#define DEFAULT_POOL_RATE     10
+#define DEFAULT_POOL_LIFETIME 3600
+#define DEFAULT_POOL_IDLE     600
 
 /* Hard-coded values */
 #define FRONTEND_BACKLOG 64
@@ -70,6 +86,62 @@ typedef struct {
 	unsigned int  blk[16];
 } MD5;
 
+typedef struct __param PARAM;
+struct __param {
+	char *name;
+	char *value;
+	struct __param *next;
+};
+
+/* What a backend tells us about itself at startup, and
+   what we pass on to the clients it ends up serving. */
+typedef struct {
+	char *status;               /* ParameterStatus msgs, as-is  */
+	size_t len;                 /* (octets of the above)        */
+	uint32_t pid;               /* BackendKeyData process id    */
+	uint32_t key;               /* BackendKeyData secret key    */
+} GREETING;
+
+/* A named prepared statement that a backend connection has
+   (or, if its hash is 0, might have); see pgr_conn_prepare. */
+typedef struct __prepared PREPARED;
+struct __prepared {
+	char *name;
+	uint64_t hash;              /* of its Parse (0 = not sure)  */
+	PREPARED *next;
+};
+
+typedef struct __pooled POOLED;
+struct __pooled {
+	int fd;                     /* idle, authenticated socket   */
+	int serial;                 /* BACKEND.serial at connect    */
+	char *key;                  /* startup parameters, sorted   */
+	time_t born;                /* when it was connected        */
+	time_t idle;                /* when it was checked in       */
+	int resetting;              /* awaiting the reset's reply?  */
+	GREETING greeting;          /* from the backend's startup   */
+	PREPARED *prepared;         /* statements it has, by name   */
+	char *who;                  /* "user@database", for quotas  */
+	POOLED *next;
+};
+
+/* How many connections to a backend are open, for one
+   user@database pair (see BACKEND.limits.quota). */
+typedef struct __usage USAGE;
+struct __usage {
+	char *who;                  /* "user@database"              */
+	int n;                      /* how many connections         */
+	USAGE *next;
+};
+
+/* A place in line, for a new connection to a backend
+   that's at one of its limits. */
+typedef struct __waiter WAITER;
+struct __waiter {
+	char *who;                  /* "user@database"              */
+	WAITER *next;
+};
+
 typedef struct {
 	pthread_rwlock_t lock;      /* read/write lock for sync.    */
 	int serial;                 /* increment on config reload.  */
@@ -89,15 +161,97 @@ typedef struct {
 		char *password;         /* password to auth. with       */
 
 		lag_t lag;              /* replication lag, in bytes    */
+		lag_t pos;              /* xlog position (see pgr_xlog) */
+		int version;            /* server_version_num, or 0     */
 		lag_t threshold;        /* threshold for lag (bytes)    */
 	} health;
+
+	struct {
+		POOLED *idle;           /* idle connections, for reuse  */
+		int size;               /* how many are in the pool     */
+
+		struct {
+			char *key;          /* last startup params. wanted  */
+			PARAM *params;      /* (the params themselves)      */
+			char *pwhash;       /* (and how to authenticate)    */
+		} warm;                 /* what to pre-connect, if any  */
+	} pool;
+
+	struct {
+		int max;                /* max conns. (0 = no limit)    */
+		int quota;              /* max conns. per user@database */
+		int rate;               /* max new conns. per second    */
+
+		int open;               /* conns. open (or pooled) now  */
+		USAGE *usage;           /* (and per user@database)      */
+		WAITER *queue;          /* FIFO of clients waiting      */
+		double tokens;          /* connect-rate token bucket    */
+		double refilled;        /* when we last topped it up    */
+	} limits;
 } BACKEND;
 
+/* Key data we issued to a client (in place of that of
+   any one backend), and where its cancels should go. */
+typedef struct __cancelkey CANCELKEY;
+struct __cancelkey {
+	uint32_t pid;               /* process ID, as we told it    */
+	uint32_t key;               /* secret key, as we told it    */
+
+	int index;                  /* backend running its query    */
+	uint32_t be_pid;            /* (and that backend's actual   */
+	uint32_t be_key;            /*  key data), or index -1      */
+
+	CANCELKEY *next;
+};
+
+#define CANCEL_BUCKETS 1024
+
+/* A set of function names (lowercased), hashed with open
+   addressing.  Once built, it is never changed; the WATCHER
+   builds a new one, and swaps it in. */
+typedef struct {
+	unsigned int size;          /* how many slots (power of 2)  */
+	unsigned int n;             /* how many names in the set    */
+	char **slots;               /* names, or NULL if empty      */
+} FUNCSET;
+
+/* A query (by fingerprint), and where it ought to go. */
+typedef struct __qentry QENTRY;
+struct __qentry {
+	uint64_t fingerprint;       /* see pgr_sql_fingerprint      */
+	int verdict;                /* SQL_READ or SQL_WRITE        */
+	unsigned int generation;    /* of the FUNCSET it came from  */
+
+	QENTRY *newer;              /* for the LRU list, most and   */
+	QENTRY *older;              /* least recently used at ends  */
+	QENTRY *next;               /* for the hash bucket          */
+};
+
+/* The query cache is split into shards (by fingerprint),
+   each with its own lock and its own LRU list, so that the
+   workers don't all queue up behind one lock. */
+#define QCACHE_SHARDS   16
+#define QCACHE_ENTRIES  256     /* per shard                    */
+#define QCACHE_BUCKETS  512     /* per shard                    */
+
+typedef struct {
+	pthread_rwlock_t lock;      /* (its own, for the workers)   */
+	QENTRY *buckets[QCACHE_BUCKETS];
+	QENTRY *newest;             /* most recently used           */
+	QENTRY *oldest;             /* next to be evicted           */
+	int entries;                /* how many we hold             */
+
+	unsigned long hits;         /* lookups we had an answer for */
+	unsigned long misses;       /* lookups we didn't            */
+} QSHARD;
+
 typedef struct {
 	pthread_rwlock_t lock;      /* read/write lock for sync.    */
 
 	int frontend4;              /* ipv4 pg frontend socket      */
 	int frontend6;              /* ipv6 pg frontend socket      */
+	int *frontends4;            /* per-worker ipv4 sockets      */
+	int *frontends6;            /* per-worker ipv6 sockets      */
 	int monitor4;               /* ipv4 monitoring socket       */
 	int monitor6;               /* ipv6 monitoring socket       */
 
@@ -113,6 +267,32 @@ typedef struct {
 		char *password;         /* password to auth. with       */
 	} health;
 
+	struct {
+		int mode;               /* a POOL_* constant            */
+		int size;               /* max idle conns. per backend  */
+		int min;                /* min warm conns. per backend  */
+		int rate;               /* max pre-connects per second  */
+		int lifetime;           /* max age of a conn., seconds  */
+		int idle;               /* max idle time, in seconds    */
+
+		unsigned long arrivals; /* clients accepted, all-time   */
+	} pool;
+
+	struct {
+		pthread_rwlock_t lock;  /* (its own, for the workers)   */
+		CANCELKEY *keys[CANCEL_BUCKETS];
+	} cancel;
+
+	QSHARD qcache[QCACHE_SHARDS];
+
+	struct {
+		pthread_rwlock_t lock;  /* (its own, for the workers)   */
+		FUNCSET *writers;       /* volatile functions, per the  */
+		uint64_t checksum;      /* master's pg_proc (if known)  */
+		unsigned int generation;/* bumped with every new set    */
+		time_t loaded;          /* when we last looked          */
+	} functions;
+
 	struct {
 		char *file;             /* path to authdb               */
 		int num_entries;        /* how many entries are there?  */
@@ -134,8 +314,16 @@ typedef struct {
 		char *user;             /* user to run as               */
 		char *group;            /* group to run as              */
 		int daemonize;          /* to daemonize or not          */
+		int reuseport;          /* a REUSEPORT_* constant       */
 	} startup;
 
+	struct {
+		int map;                /* BPF map fd, or -1 if unused  */
+		int target;             /* worker the map points at     */
+		int n;                  /* how many workers we steer to */
+		int *load;              /* sessions, per worker         */
+	} steering;
+
 	int fe_conns;               /* how many connected clients?  */
 	int be_conns;               /* how many backend conn.?      */
 
@@ -144,12 +332,7 @@ typedef struct {
 	BACKEND *backends;          /* the backends -- epic         */
 } CONTEXT;
 
-typedef struct __param PARAM;
-struct __param {
-	char *name;
-	char *value;
-	struct __param *next;
-};
+typedef struct __mbuf MBUF;
 
 typedef struct {
 	CONTEXT *context;
@@ -169,6 +352,22 @@ typedef struct {
 	PARAM *params;
 
 	int fd;
+	char txn;                   /* status from ReadyForQuery    */
+	GREETING greeting;          /* startup messages (or keys)   */
+	PREPARED *prepared;         /* (backend) statements it has  */
+	time_t born;                /* when (backend) startup ended */
+	int counted;                /* holds a slot in BACKEND.limits */
+	WAITER *waiting;            /* our place in line, for one   */
+
+	struct {
+		MBUF *buf;              /* non-NULL until it's done     */
+		int pending;            /* do we have a message to go?  */
+	} startup;                  /* (backend) startup, underway  */
+
+	struct {
+		int fd;                 /* to the backend, or -1        */
+		uint32_t msg[4];        /* our CancelRequest, to go     */
+	} cancel;                   /* (frontend) cancel, underway  */
 } CONNECTION;
 
 #define MSG_STARTUP 1
@@ -178,7 +377,12 @@ typedef struct {
 #define MBUF_SAME_FD -2
 #define MBUF_NO_FD   -1
 
-typedef struct {
+/* Returned by MBUF operations on non-blocking file
+   descriptors that aren't ready yet; the operation
+   should be retried once they are. */
+#define MBUF_AGAIN   -11
+
+struct __mbuf {
 	int     infd;  /* file descripto ro read from      */
 	int     outfd; /* file descriptor to write to      */
 	int     cache; /* cache file descriptor (overflow) */
@@ -186,14 +390,32 @@ typedef struct {
 	size_t  start; /* offset of next available message */
 	size_t  fill;  /* offset for next read/write op    */
 	size_t  len;   /* total length of allocated buffer */
+	size_t  left;  /* octets of current message to go  */
+	size_t  redo;  /* octets resent so far (resend)    */
+	uint8_t *out;  /* staged output (if corked)        */
+	size_t  olen;  /* octets staged for output         */
+	size_t  omax;  /* size of the staging area         */
 	uint8_t buf[]; /* the buffer, in all its glory...  */
-} MBUF;
+};
 
 /* Generate a new MBUF structure of the given size,
    allocated on the heap. The `len` argument must be
    at least 16 (octets). */
 MBUF* pgr_mbuf_new(size_t len);
 
+/* Free an MBUF structure, and close its overflow
+   cache file (if any).  The input and output file
+   descriptors are left open. */
+void pgr_mbuf_free(MBUF *m);
+
+/* Cork the output side of the MBUF, staging up to `len`
+   octets of complete messages (from send / relay) in
+   an output area, instead of writing each one out as
+   soon as it is passed along.  Staged messages go out,
+   all at once, via pgr_mbuf_push, or whenever the MBUF
+   is about to block waiting on the input descriptor. */
+void pgr_mbuf_cork(MBUF *m, size_t len);
+
 /* Set the input and output file descriptors to the
    passed values.  To leave existing fd untouched,
    specify the constant `MBUF_SAME_FD`.  To unset a
@@ -203,6 +425,11 @@ void pgr_mbuf_setfd(MBUF *m, int in, int out);
 /* Reset the message buffer to its empty state. */
 void pgr_mbuf_reset(MBUF *m);
 
+/* Forget about all of the messages we have sent and
+   retained (via pgr_mbuf_send), without disturbing
+   any messages that we have yet to process. */
+void pgr_mbuf_forget(MBUF *m);
+
 /* Dump important parts of the MBUF structure to
    standard error, if we are in debugging mode. */
 void pgr_mbuf_dump(MBUF *m);
@@ -212,30 +439,54 @@ void pgr_mbuf_dump(MBUF *m);
    that are too big to fit in the buffer */
 int pgr_mbuf_cat(MBUF *m, const void *buf, size_t len);
 
-/* Fill as much of the buffer with octets read from
-   the input file descriptor.  If the buffer already
-   contains enough data to see the first 5 octets of
-   a message, this call does nothing and returns
-   immediately. */
+/* Append octets that aren't a (framed) message to an
+   otherwise empty buffer, for pgr_mbuf_flush to write
+   out as-is. */
+int pgr_mbuf_cat_raw(MBUF *m, const void *buf, size_t len);
+
+/* Fill the buffer with octets read from the input
+   file descriptor, until the first message is in the
+   buffer in its entirety (or we run out of room).  If
+   the buffer already holds the whole message, this
+   call does nothing and returns immediately. */
 int pgr_mbuf_recv(MBUF *m);
 
 /* Send the first message in the buffer to the output
    file descriptor, buffering all data sent, so that
    it can be resent later.  For very large messages,
    i.e. INSERT statements with large blobs), this may
-   require reading from the input file descriptor. */
+   require reading from the input file descriptor.
+   Returns MBUF_AGAIN if either descriptor would
+   block; call it again to finish sending. */
 int pgr_mbuf_send(MBUF *m);
 
 /* Resend all buffered message for which we've
    buffered data (i.e. via pgr_mbuf_send) */
 int pgr_mbuf_resend(MBUF *m);
 
+/* Retain the first message in the buffer, as if it
+   had been sent (via pgr_mbuf_send), without writing it
+   out; the next pgr_mbuf_resend will send it. */
+int pgr_mbuf_keep(MBUF *m);
+
 /* Relay the first message in the buffer to the output
    file descriptor, and reposition the buffer at the
    beginning of the next message.  This may lead to an
-   empty buffer. */
+   empty buffer.  Returns MBUF_AGAIN if either of the
+   descriptors would block; call it again to finish. */
 int pgr_mbuf_relay(MBUF *m);
 
+/* Relay all of the messages in the buffer to the
+   output descriptor, without reading anything from
+   the input descriptor.  Meant for buffers filled
+   via pgr_mbuf_cat, with replies of our own making. */
+int pgr_mbuf_flush(MBUF *m);
+
+/* Write out all of the messages staged by a corked
+   MBUF (see pgr_mbuf_cork).  Returns MBUF_AGAIN if the
+   output descriptor would block. */
+int pgr_mbuf_push(MBUF *m);
+
 /* Discard all buffered data for the current message,
    reading (and discarding) from the input descriptor
    if necessary. */
@@ -259,10 +510,11 @@ int pgr_mbuf_u16(MBUF *m, size_t at);
 long int pgr_mbuf_u32(MBUF *m, size_t at);
 
 /* process control subroutines */
-void pgr_abort(int code);
+void pgr_abort(int code) __attribute__((noreturn));
 
 /* randomness subroutines */
 int pgr_rand(int start, int end);
+void pgr_rand_bytes(void *buf, size_t n);
 void pgr_srand(int seed);
 
 /* configuration subroutines */
@@ -297,24 +549,89 @@ void pgr_hexdump_irl(const void *buf, size_t len);
 #endif
 
 /* network subroutines */
-int pgr_listen4(const char *ep, int backlog);
-int pgr_listen6(const char *ep, int backlog);
+int pgr_listen4(const char *ep, int backlog, int reuseport);
+int pgr_listen6(const char *ep, int backlog, int reuseport);
 int pgr_connect(const char *host, int port, int timeout_ms);
+int pgr_connect_async(const char *host, int port);
 int pgr_sendn(int fd, const void *buf, size_t n);
 int pgr_sendf(int fd, const char *fmt, ...);
 int pgr_recvn(int fd, void *buf, size_t n);
 
+/* connection steering subroutines */
+int pgr_steer_map(void);
+int pgr_steer(int map, int fd);
+int pgr_steer_to(int map, int worker);
+
 /* connection subroutines */
 void pgr_conn_init(CONTEXT *c, CONNECTION *dst);
 void pgr_conn_frontend(CONNECTION *dst, int fd);
 void pgr_conn_backend(CONNECTION *dst, BACKEND *b, int i);
 int pgr_conn_copy(CONNECTION *dst, CONNECTION *src);
-int pgr_conn_connect(CONNECTION *c);
-int pgr_conn_accept(CONNECTION *c);
+int pgr_conn_start(CONNECTION *c);
+int pgr_conn_handshake(CONNECTION *c);
+void pgr_conn_close(CONNECTION *c);
+void pgr_conn_deinit(CONNECTION *c);
+int pgr_conn_accept(CONNECTION *c, MBUF *in, MBUF *out);
+int pgr_conn_ready(CONNECTION *c, CONNECTION *be, MBUF *out);
+int pgr_conn_fatal(MBUF *out, char *code, char *msg);
+PARAM* pgr_params_dup(PARAM *src);
+void pgr_params_free(PARAM *p);
+PREPARED* pgr_conn_prepared(CONNECTION *c, const char *name);
+void pgr_conn_prepare(CONNECTION *c, const char *name, uint64_t hash);
+void pgr_conn_unprepare(CONNECTION *c, const char *name);
+void pgr_conn_doubt(CONNECTION *c);
+void pgr_prepared_free(PREPARED *p);
+
+/* query cancellation subroutines */
+void pgr_cancel_register(CONTEXT *c, uint32_t *pid, uint32_t *key);
+void pgr_cancel_target(CONTEXT *c, uint32_t pid, CONNECTION *be);
+void pgr_cancel_forget(CONTEXT *c, uint32_t pid);
+int pgr_cancel(CONNECTION *c, uint32_t pid, uint32_t key);
+int pgr_cancel_send(CONNECTION *c);
+
+/* pooling subroutines */
+char* pgr_pool_key(CONNECTION *c);
+int pgr_pool_checkout(CONNECTION *c);
+int pgr_pool_checkin(CONNECTION *c, int reset);
+int pgr_pool_admit(CONNECTION *c, int wait);
+void pgr_pool_leave(CONNECTION *c);
+int pgr_pool_warmer(CONTEXT *c, pthread_t *tid);
+void pgr_pool_sweep(CONTEXT *c);
+
+/* query classification subroutines */
+#define SQL_READ  0
+#define SQL_WRITE 1
+#define SQL_BEGIN    2  /* see pgr_sql_begins */
+#define SQL_BEGIN_RO 3
+#define SQL_DEALLOCATE     4  /* see pgr_sql_deallocates */
+#define SQL_DEALLOCATE_ALL 5
+#define SQL_LISTEN         6  /* see pgr_sql_listens */
+#define SQL_UNLISTEN       7
+#define SQL_UNLISTEN_ALL   8
+int pgr_sql_classify(const char *sql, const FUNCSET *writers);
+uint64_t pgr_sql_fingerprint(const char *sql);
+int pgr_sql_begins(const char *sql, int txn);
+int pgr_sql_pins(const char *sql);
+int pgr_sql_autonomous(const char *sql);
+int pgr_sql_deallocates(const char **sql, char *buf, size_t size);
+int pgr_sql_listens(const char *sql, char *buf, size_t size);
+FUNCSET* pgr_funcset_new(unsigned int n);
+void pgr_funcset_add(FUNCSET *set, const char *name);
+int pgr_funcset_has(const FUNCSET *set, const char *name, size_t len);
+void pgr_funcset_free(FUNCSET *set);
+
+/* query cache subroutines */
+int pgr_qcache_get(CONTEXT *c, uint64_t fingerprint, unsigned int generation);
+void pgr_qcache_put(CONTEXT *c, uint64_t fingerprint, int verdict, unsigned int generation);
+void pgr_qcache_flush(CONTEXT *c);
+void pgr_qcache_stats(CONTEXT *c, unsigned long *hits, unsigned long *misses, int *entries);
 
 /* thread subroutines */
 int pgr_watcher(CONTEXT *c, pthread_t* tid);
+int pgr_xlog(const char *s, lag_t *pos);
+const char* pgr_xlog_query(int version, int role);
+int pgr_housekeeper(CONTEXT *c, pthread_t* tid);
 int pgr_monitor(CONTEXT *c, pthread_t* tid);
-int pgr_worker(CONTEXT *c, pthread_t *tid);
+int pgr_worker(CONTEXT *c, int id, pthread_t *tid);
 
 #endif
@@ -0,0 +1,1022 @@
+/*
+  Copyright (c) 2016 James Hunt
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+ */
+
+#include "pgrouter.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <arpa/inet.h>
+
+#define SUBSYS "pool"
+#include "locks.inc.c"
+
+/*
+   Each BACKEND keeps a list of idle, already-authenticated
+   connections that were handed back by client sessions that
+   are done with them.  A connection can only be reused by a
+   session that would have sent the exact same StartupMessage,
+   so each one is tagged with a key made from all of its
+   startup parameters (including user and database), sorted
+   by name.
+ */
+
+static int by_name(const void *a, const void *b)
+{
+	return strcmp((*(PARAM **)a)->name, (*(PARAM **)b)->name);
+}
+
+/* Build the pool key for a connection, from its startup
+   parameters.  Each name and value is length-prefixed,
+   so that no two distinct parameter lists can collide. */
+char* pgr_pool_key(CONNECTION *c)
+{
+	PARAM *p, **sorted;
+	char *key;
+	size_t len, n, i;
+
+	n = 0; len = 1;
+	for (p = c->params; p; p = p->next) {
+		len += strlen(p->name) + strlen(p->value) + 2 * 21;
+		n++;
+	}
+
+	sorted = calloc(n ? n : 1, sizeof(PARAM *));
+	key = calloc(len, sizeof(char));
+	if (!sorted || !key) {
+		pgr_abort(ABORT_MEMFAIL);
+	}
+
+	for (i = 0, p = c->params; p; p = p->next) {
+		sorted[i++] = p;
+	}
+	qsort(sorted, n, sizeof(PARAM *), by_name);
+
+	for (len = 0, i = 0; i < n; i++) {
+		len += sprintf(key + len, "%zu:%s%zu:%s",
+				strlen(sorted[i]->name),  sorted[i]->name,
+				strlen(sorted[i]->value), sorted[i]->value);
+	}
+
+	free(sorted);
+	return key;
+}
+
+/* Is the (idle) pooled connection still usable?  An idle
+   backend has nothing to say to us; if there's something
+   to read, it's either an EOF or an error / notice about
+   the backend going away, and we can't hand that out. */
+static int alive(int fd)
+{
+	char c;
+	ssize_t n = recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+	return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+/* Remember the startup parameters (and credentials) that
+   sessions are asking for, so that the warmer knows what
+   kind of connections to make ahead of time.  Must be
+   called with the BACKEND write-locked. */
+static void wanted(BACKEND *b, CONNECTION *c, const char *key)
+{
+	if (!c->pwhash || (b->pool.warm.key && strcmp(b->pool.warm.key, key) == 0)) {
+		return;
+	}
+
+	free(b->pool.warm.key);
+	free(b->pool.warm.pwhash);
+	pgr_params_free(b->pool.warm.params);
+
+	b->pool.warm.key    = strdup(key);
+	b->pool.warm.pwhash = strdup(c->pwhash);
+	b->pool.warm.params = pgr_params_dup(c->params);
+	if (!b->pool.warm.key || !b->pool.warm.pwhash) {
+		pgr_abort(ABORT_MEMFAIL);
+	}
+}
+
+/* Connections handed back at the end of a session get
+   their session state (settings, prepared statements,
+   temp tables, etc.) wiped before anyone else gets them.
+   The query goes out at checkin, and its reply is read
+   (without waiting) at checkout. */
+#define RESET_QUERY "Q\0\0\0\x10" "DISCARD ALL\0"
+
+/* Has the reply to our reset query come back (in full)?
+   Returns 1 if so (having read it off the socket), 0 if
+   it hasn't yet, and -1 if the reset didn't work out. */
+static int reset_done(int fd)
+{
+	uint8_t buf[1024];
+	ssize_t n, off;
+	uint32_t len;
+
+	n = recv(fd, buf, sizeof(buf), MSG_PEEK | MSG_DONTWAIT);
+	if (n < 0) {
+		return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+	}
+	if (n == 0) {
+		return -1;
+	}
+
+	for (off = 0; off + 5 <= n; off += 1 + len) {
+		memcpy(&len, buf + off + 1, 4);
+		len = ntohl(len);
+		if (len < 4 || off + 1 + len > n) {
+			break;
+		}
+
+		switch (buf[off]) {
+		case 'E':
+			return -1;
+
+		case 'Z':
+			if (off + 1 + len != n || buf[off + 5] != 'I') {
+				return -1;
+			}
+			return recv(fd, buf, n, MSG_DONTWAIT) == n ? 1 : -1;
+		}
+		/* CommandComplete, or ParameterStatus as settings revert */
+	}
+
+	/* not all here yet (unless it'll never fit) */
+	return n == sizeof(buf) ? -1 : 0;
+}
+
+static void pooled_free(POOLED *p)
+{
+	close(p->fd);
+	free(p->key);
+	free(p->who);
+	free(p->greeting.status);
+	pgr_prepared_free(p->prepared);
+	free(p);
+}
+
+/*
+   A BACKEND can be given a cap on the number of connections
+   we'll have open to it (checked out or pooled; `connections`
+   in its config), a cap on how many of those can belong to
+   any one user@database pair (`quota`), and a cap on how many
+   new connections we'll make per second (`rate`), so that a
+   backend that's just come back from the dead doesn't get
+   hit with a fork storm from every waiting client at once.
+
+   Clients that need a new connection to a backend that's at
+   one of its limits get in line.  The line is first-come,
+   first-served, except that a client that's only waiting on
+   its own quota doesn't hold up anyone behind it.
+ */
+
+static double now()
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+/* Who is this connection for, as far as quotas go? */
+static char* who(CONNECTION *c)
+{
+	PARAM *p;
+	const char *user, *db;
+	char *s;
+
+	user = db = NULL;
+	for (p = c->params; p; p = p->next) {
+		if (strcmp(p->name, "user") == 0) {
+			user = p->value;
+		} else if (strcmp(p->name, "database") == 0) {
+			db = p->value;
+		}
+	}
+	if (!user) {
+		user = "";
+	}
+	if (!db) {
+		db = user; /* same as postgres */
+	}
+
+	s = calloc(strlen(user) + strlen(db) + 2, sizeof(char));
+	if (!s) {
+		pgr_abort(ABORT_MEMFAIL);
+	}
+	sprintf(s, "%s@%s", user, db);
+	return s;
+}
+
+/* Find the USAGE entry for a user@database pair, making it
+   if `create` is set.  Must be called with the BACKEND
+   write-locked. */
+static USAGE* usage(BACKEND *b, const char *who, int create)
+{
+	USAGE *u;
+
+	for (u = b->limits.usage; u; u = u->next) {
+		if (strcmp(u->who, who) == 0) {
+			return u;
+		}
+	}
+	if (!create) {
+		return NULL;
+	}
+
+	u = calloc(1, sizeof(USAGE));
+	if (!u || !(u->who = strdup(who))) {
+		pgr_abort(ABORT_MEMFAIL);
+	}
+	u->next = b->limits.usage;
+	b->limits.usage = u;
+	return u;
+}
+
+/* Count a connection (open or pooled) against the limits
+   of its BACKEND, or stop counting it.  Must be called
+   with the BACKEND write-locked. */
+static void count(BACKEND *b, const char *who)
+{
+	b->limits.open++;
+	usage(b, who, 1)->n++;
+}
+
+static void uncount(BACKEND *b, const char *who)
+{
+	USAGE *u, **uu;
+
+	b->limits.open--;
+	for (uu = &b->limits.usage; (u = *uu) != NULL; uu = &u->next) {
+		if (strcmp(u->who, who) == 0) {
+			if (--u->n <= 0) {
+				*uu = u->next;
+				free(u->who);
+				free(u);
+			}
+			return;
+		}
+	}
+}
+
+#define LIMIT_OK    0
+#define LIMIT_MAX   1           /* too many connections      */
+#define LIMIT_QUOTA 2           /* too many for this user/db */
+#define LIMIT_RATE  3           /* too many, too quickly     */
+
+/* Could we make a new connection to the backend, for who,
+   right now?  Must be called with the BACKEND write-locked. */
+static int limited(BACKEND *b, const char *who)
+{
+	USAGE *u;
+
+	if (b->limits.max > 0 && b->limits.open >= b->limits.max) {
+		return LIMIT_MAX;
+	}
+	if (b->limits.quota > 0 && (u = usage(b, who, 0)) != NULL && u->n >= b->limits.quota) {
+		return LIMIT_QUOTA;
+	}
+	if (b->limits.rate > 0 && b->limits.tokens < 1.0) {
+		return LIMIT_RATE;
+	}
+	return LIMIT_OK;
+}
+
+/* Top up the connect-rate token bucket of the backend, which
+   holds (at most) a second's worth.  Must be called with the
+   BACKEND write-locked. */
+static void refill(BACKEND *b)
+{
+	double t = now();
+
+	if (b->limits.rate > 0) {
+		b->limits.tokens += (t - b->limits.refilled) * b->limits.rate;
+		if (b->limits.tokens > b->limits.rate) {
+			b->limits.tokens = b->limits.rate;
+		}
+	}
+	b->limits.refilled = t;
+}
+
+/* Make room for a new connection by closing the idle pooled
+   connection (for who, unless that's NULL) that's gone the
+   longest without being used.  Returns non-zero if there
+   was one to close.  Must be called with the BACKEND
+   write-locked. */
+static int evict(BACKEND *b, const char *who)
+{
+	POOLED *p, **pp, **oldest;
+
+	oldest = NULL;
+	for (pp = &b->pool.idle; (p = *pp) != NULL; pp = &p->next) {
+		if (!who || strcmp(p->who, who) == 0) {
+			if (!oldest || p->idle <= (*oldest)->idle) {
+				oldest = pp;
+			}
+		}
+	}
+	if (!oldest) {
+		return 0;
+	}
+
+	p = *oldest;
+	*oldest = p->next;
+	b->pool.size--;
+	uncount(b, p->who);
+
+	pgr_debugf("evicting pooled connection (fd %d) to make room", p->fd);
+	send(p->fd, "X\0\0\0\x4", 5, MSG_DONTWAIT | MSG_NOSIGNAL);
+	pooled_free(p);
+	return 1;
+}
+
+static void dequeue(BACKEND *b, WAITER *w)
+{
+	WAITER **ww;
+
+	for (ww = &b->limits.queue; *ww; ww = &(*ww)->next) {
+		if (*ww == w) {
+			*ww = w->next;
+			break;
+		}
+	}
+	free(w->who);
+	free(w);
+}
+
+/* Ask for a slot, under the limits of its BACKEND, for a
+   new connection (i.e. one that didn't come out of the
+   pool).  Returns 0 if the connection can go ahead.  If
+   not, and `wait` is set, it gets in line (or stays there)
+   and MBUF_AGAIN is returned; the caller should ask again
+   in a little while.  Otherwise, 1 is returned. */
+int pgr_pool_admit(CONNECTION *c, int wait)
+{
+	BACKEND *b;
+	WAITER *w, **ww;
+	char *id;
+	int rc;
+
+	if (c->index < 0 || c->counted) {
+		return 0;
+	}
+
+	id = who(c);
+	b = &c->context->backends[c->index];
+
+	wrlock(&b->lock, "backend", c->index);
+	refill(b);
+
+	rc = limited(b, id);
+	if ((rc == LIMIT_MAX   && evict(b, NULL))
+	 || (rc == LIMIT_QUOTA && evict(b, id))) {
+		rc = limited(b, id);
+	}
+
+	if (rc == LIMIT_OK) {
+		/* don't cut in front of anyone who could go now */
+		for (w = b->limits.queue; w && w != c->waiting; w = w->next) {
+			if (limited(b, w->who) == LIMIT_OK) {
+				rc = LIMIT_RATE;
+				break;
+			}
+		}
+	}
+
+	if (rc == LIMIT_OK) {
+		if (c->waiting) {
+			dequeue(b, c->waiting);
+			c->waiting = NULL;
+		}
+		if (b->limits.rate > 0) {
+			b->limits.tokens -= 1.0;
+		}
+		count(b, id);
+		c->counted = 1;
+
+	} else if (wait && !c->waiting) {
+		pgr_debugf("backend/%d is at its %s limit; %s has to wait", c->index,
+				rc == LIMIT_MAX ? "connection" : rc == LIMIT_QUOTA ? "quota" : "rate", id);
+
+		w = calloc(1, sizeof(WAITER));
+		if (!w) {
+			pgr_abort(ABORT_MEMFAIL);
+		}
+		w->who = id;
+		id = NULL;
+
+		for (ww = &b->limits.queue; *ww; ww = &(*ww)->next)
+			;
+		*ww = w;
+		c->waiting = w;
+	}
+	unlock(&b->lock, "backend", c->index);
+
+	free(id);
+	return rc == LIMIT_OK ? 0 : wait ? MBUF_AGAIN : 1;
+}
+
+/* Give back a connection's slot (or its place in line)
+   under the limits of its BACKEND, once it's closed. */
+void pgr_pool_leave(CONNECTION *c)
+{
+	BACKEND *b;
+	char *id;
+
+	if (c->index < 0 || (!c->counted && !c->waiting)) {
+		return;
+	}
+
+	id = who(c);
+	b = &c->context->backends[c->index];
+
+	wrlock(&b->lock, "backend", c->index);
+	if (c->waiting) {
+		dequeue(b, c->waiting);
+		c->waiting = NULL;
+	}
+	if (c->counted) {
+		uncount(b, id);
+		c->counted = 0;
+	}
+	unlock(&b->lock, "backend", c->index);
+
+	free(id);
+}
+
+/* Try to satisfy a backend connection out of the pool for
+   its BACKEND.  On success, the connection's fd is set to
+   the pooled (authenticated, idle) socket, and 0 is
+   returned.  Otherwise, the caller will have to connect
+   the hard way, via pgr_conn_start(). */
+int pgr_pool_checkout(CONNECTION *c)
+{
+	BACKEND *b;
+	POOLED *p, **pp;
+	char *key;
+
+	if (c->context->pool.mode == POOL_OFF || c->index < 0) {
+		return 1;
+	}
+
+	key = pgr_pool_key(c);
+	b = &c->context->backends[c->index];
+
+	wrlock(&b->lock, "backend", c->index);
+	wanted(b, c, key);
+	for (pp = &b->pool.idle; *pp; ) {
+		p = *pp;
+		if (p->serial == b->serial && p->resetting) {
+			switch (reset_done(p->fd)) {
+			case 0:  pp = &p->next; continue; /* try the next one */
+			case 1:  p->resetting = 0;        break;
+			}
+		}
+
+		if (p->serial != b->serial || p->resetting || !alive(p->fd)) {
+			/* stale (config reloaded) or dead; get rid of it */
+			pgr_debugf("discarding pooled connection (fd %d) to backend/%d", p->fd, c->index);
+			*pp = p->next;
+			b->pool.size--;
+			uncount(b, p->who);
+			pooled_free(p);
+			continue;
+		}
+
+		if (p->serial == c->serial && strcmp(p->key, key) == 0) {
+			*pp = p->next;
+			b->pool.size--;
+
+			/* its slot under the limits comes with it */
+			if (c->waiting) {
+				dequeue(b, c->waiting);
+				c->waiting = NULL;
+			}
+			c->counted = 1;
+			unlock(&b->lock, "backend", c->index);
+
+			pgr_debugf("reusing pooled connection (fd %d) to backend/%d", p->fd, c->index);
+			c->fd = p->fd;
+			c->txn = 'I';
+			c->born = p->born;
+			free(c->greeting.status);
+			c->greeting = p->greeting;
+			pgr_prepared_free(c->prepared);
+			c->prepared = p->prepared;
+			free(p->key);
+			free(p->who);
+			free(p);
+			free(key);
+			return 0;
+		}
+		pp = &p->next;
+	}
+	unlock(&b->lock, "backend", c->index);
+
+	free(key);
+	return 1;
+}
+
+/* Hand an idle backend connection back to the pool for its
+   BACKEND, so that another session can use it.  If `reset`
+   is set, the session state is wiped first.  Returns 0
+   if the pool took it (in which case the connection's fd
+   is set to -1, so pgr_conn_deinit won't close it), and
+   non-zero if the caller should close it. */
+int pgr_pool_checkin(CONNECTION *c, int reset)
+{
+	BACKEND *b;
+	POOLED *p;
+
+	if (c->context->pool.mode == POOL_OFF || c->index < 0 || c->fd < 0) {
+		return 1;
+	}
+	if (c->startup.buf) {
+		pgr_debugf("not pooling connection (fd %d) that is still starting up", c->fd);
+		return 1;
+	}
+	if (c->txn != 'I') {
+		pgr_debugf("not pooling connection (fd %d) with transaction status '%c'", c->fd, c->txn);
+		return 1;
+	}
+	if (c->context->pool.lifetime > 0 && time(NULL) - c->born >= c->context->pool.lifetime) {
+		pgr_debugf("not pooling connection (fd %d) that has reached its max lifetime", c->fd);
+		return 1;
+	}
+
+	if (reset && send(c->fd, RESET_QUERY, sizeof(RESET_QUERY) - 1,
+	                  MSG_DONTWAIT | MSG_NOSIGNAL) != sizeof(RESET_QUERY) - 1) {
+		pgr_debugf("failed to reset connection (fd %d); not pooling it", c->fd);
+		return 1;
+	}
+
+	b = &c->context->backends[c->index];
+
+	wrlock(&b->lock, "backend", c->index);
+	if (b->serial != c->serial || b->pool.size >= c->context->pool.size) {
+		unlock(&b->lock, "backend", c->index);
+		return 1;
+	}
+
+	p = calloc(1, sizeof(POOLED));
+	if (!p) {
+		pgr_abort(ABORT_MEMFAIL);
+	}
+	p->fd        = c->fd;
+	p->serial    = c->serial;
+	p->key       = pgr_pool_key(c);
+	p->who       = who(c);
+	p->born      = c->born;
+	p->idle      = time(NULL);
+	p->resetting = reset;
+	p->greeting  = c->greeting;
+	memset(&c->greeting, 0, sizeof(c->greeting));
+	if (reset) {
+		/* (DISCARD ALL takes the prepared statements too) */
+		pgr_prepared_free(c->prepared);
+	} else {
+		p->prepared = c->prepared;
+	}
+	c->prepared = NULL;
+
+	/* the pool holds its slot under the limits now */
+	if (!c->counted) {
+		count(b, p->who);
+	}
+	c->counted = 0;
+
+	p->next = b->pool.idle;
+	b->pool.idle = p;
+	b->pool.size++;
+	unlock(&b->lock, "backend", c->index);
+
+	pgr_debugf("pooled connection (fd %d) to backend/%d", c->fd, c->index);
+	c->fd = -1;
+	return 0;
+}
+
+/* Go over the idle connections in every BACKEND's pool and
+   drop the ones that shouldn't be handed out: those that
+   are past `pool.lifetime`, or have sat idle for longer
+   than `pool.idle`, or belong to a backend that the watcher
+   says is down.  Connections that died (or whose reset
+   failed) while they sat there go too; that is as far as
+   validation goes: a peek at the socket (see alive), not a
+   query, so a backend that is up but wedged isn't caught. */
+void pgr_pool_sweep(CONTEXT *c)
+{
+	int i, rc, lifetime, idle;
+	const char *why;
+	POOLED *p, **pp, *dead;
+	BACKEND *b;
+	time_t now;
+
+	rdlock(&c->lock, "context", 0);
+	lifetime = c->pool.lifetime;
+	idle     = c->pool.idle;
+
+	dead = NULL;
+	now  = time(NULL);
+	for (i = 0; i < c->num_backends; i++) {
+		b = &c->backends[i];
+
+		wrlock(&b->lock, "backend", i);
+		for (pp = &b->pool.idle; *pp; ) {
+			p = *pp;
+
+			why = NULL;
+			if (b->status == BACKEND_IS_FAILED) {
+				why = "backend is down";
+			} else if (lifetime > 0 && now - p->born >= lifetime) {
+				why = "reached its max lifetime";
+			} else if (idle > 0 && now - p->idle >= idle) {
+				why = "idle for too long";
+			} else if (p->resetting && (rc = reset_done(p->fd)) != 0) {
+				if (rc < 0) {
+					why = "reset failed";
+				}
+				p->resetting = 0;
+			}
+			if (!why && !p->resetting && !alive(p->fd)) {
+				why = "connection lost";
+			}
+
+			if (!why) {
+				pp = &p->next;
+				continue;
+			}
+
+			pgr_debugf("dropping pooled connection (fd %d) to backend/%d: %s", p->fd, i, why);
+			*pp = p->next;
+			b->pool.size--;
+			uncount(b, p->who);
+			p->next = dead;
+			dead = p;
+		}
+		unlock(&b->lock, "backend", i);
+	}
+	unlock(&c->lock, "context", 0);
+
+	/* say goodbye, without holding up everyone else */
+	while (dead) {
+		p = dead;
+		dead = p->next;
+		send(p->fd, "X\0\0\0\x4", 5, MSG_DONTWAIT | MSG_NOSIGNAL);
+		pooled_free(p);
+	}
+}
+
+/*
+   The warmer keeps each BACKEND stocked with idle connections
+   (made with the most recently wanted startup parameters), so
+   that bursts of new clients don't have to pay for backend
+   startup in the hot path.  It aims for `pool.min` connections,
+   plus however many it expects to be checked out before it
+   next wakes up, going by an exponentially-weighted moving
+   average of the client arrival rate (as counted by the
+   workers), split across the slaves by weight.  It never
+   makes more than `pool.rate` new connections per second to
+   any one backend, and never goes over `pool.size`.
+ */
+
+#define WARM_INTERVAL 1         /* seconds between rounds     */
+#define WARM_ALPHA    0.3       /* EWMA smoothing factor      */
+
+/* Make one new backend connection, start to finish, and
+   (if it works out) put it in the pool. */
+static int warm_up(CONNECTION *c, int timeout_ms)
+{
+	struct pollfd pfd;
+	int rc;
+
+	if (pgr_conn_start(c) != 0) {
+		return -1;
+	}
+
+	for (;;) {
+		rc = pgr_conn_handshake(c);
+		if (rc != MBUF_AGAIN) {
+			break;
+		}
+
+		pfd.fd = c->fd;
+		pfd.events = c->startup.pending ? POLLOUT : POLLIN;
+		if (poll(&pfd, 1, timeout_ms) <= 0) {
+			pgr_logf(stderr, LOG_ERR, "[pool] timed out pre-connecting to backend/%d", c->index);
+			return -1;
+		}
+	}
+
+	if (rc != 0) {
+		return rc;
+	}
+	return pgr_pool_checkin(c, 0);
+}
+
+static void warm(CONTEXT *c, double rate)
+{
+	int i, n, idle, total, timeout;
+	double want;
+	CONNECTION conn;
+	BACKEND *b;
+	POOLED *p;
+
+	rdlock(&c->lock, "context", 0);
+	if (c->pool.mode == POOL_OFF) {
+		unlock(&c->lock, "context", 0);
+		return;
+	}
+	timeout = c->health.timeout * 1000;
+
+	/* the slaves split new clients by weight */
+	total = 0;
+	for (i = 0; i < c->num_backends; i++) {
+		rdlock(&c->backends[i].lock, "backend", i);
+		if (c->backends[i].role != BACKEND_ROLE_MASTER &&
+		    c->backends[i].status == BACKEND_IS_OK) {
+			total += c->backends[i].weight;
+		}
+		unlock(&c->backends[i].lock, "backend", i);
+	}
+
+	for (i = 0; i < c->num_backends; i++) {
+		b = &c->backends[i];
+
+		wrlock(&b->lock, "backend", i);
+		if (b->status != BACKEND_IS_OK || !b->pool.warm.key) {
+			unlock(&b->lock, "backend", i);
+			continue;
+		}
+
+		idle = 0;
+		for (p = b->pool.idle; p; p = p->next) {
+			if (p->serial == b->serial && strcmp(p->key, b->pool.warm.key) == 0) {
+				idle++;
+			}
+		}
+
+		n = c->pool.min;
+		if (b->role != BACKEND_ROLE_MASTER && total > 0) {
+			want = rate * WARM_INTERVAL * b->weight / total;
+			n += (int)want + ((int)want < want ? 1 : 0);
+		}
+		if (n > c->pool.size) {
+			n = c->pool.size;
+		}
+		n -= idle;
+		if (n > c->pool.rate * WARM_INTERVAL) {
+			n = c->pool.rate * WARM_INTERVAL;
+		}
+
+		if (n > 0) {
+			pgr_conn_init(c, &conn);
+			conn.params   = pgr_params_dup(b->pool.warm.params);
+			conn.pwhash   = strdup(b->pool.warm.pwhash);
+			conn.index    = i;
+			conn.serial   = b->serial;
+			conn.hostname = strdup(b->hostname);
+			conn.port     = b->port;
+			if (!conn.pwhash || !conn.hostname) {
+				pgr_abort(ABORT_MEMFAIL);
+			}
+		}
+		unlock(&b->lock, "backend", i);
+
+		if (n <= 0) {
+			continue;
+		}
+
+		/* checkin takes the locks it needs */
+		unlock(&c->lock, "context", 0);
+
+		pgr_debugf("pre-connecting %d connection(s) to backend/%d", n, i);
+		while (n-- > 0) {
+			/* clients waiting on the limits come first */
+			if (pgr_pool_admit(&conn, 0) != 0 || warm_up(&conn, timeout) != 0) {
+				break;
+			}
+		}
+		if (conn.fd >= 0 && !conn.startup.buf) {
+			pgr_sendn(conn.fd, "X\0\0\0\x4", 5);
+		}
+		free((char *)conn.pwhash);
+		free(conn.hostname);
+		pgr_conn_deinit(&conn);
+
+		rdlock(&c->lock, "context", 0);
+	}
+	unlock(&c->lock, "context", 0);
+}
+
+static void* do_warmer(void *_c)
+{
+	CONTEXT *c = (CONTEXT*)_c;
+	unsigned long seen, last;
+	double rate, then, t;
+
+	rdlock(&c->lock, "context", 0);
+	last = c->pool.arrivals;
+	unlock(&c->lock, "context", 0);
+
+	rate = 0.0;
+	then = now();
+	for (;;) {
+		sleep(WARM_INTERVAL);
+
+		rdlock(&c->lock, "context", 0);
+		seen = c->pool.arrivals;
+		unlock(&c->lock, "context", 0);
+
+		t = now();
+		if (t > then) {
+			rate = WARM_ALPHA * ((seen - last) / (t - then))
+			     + (1.0 - WARM_ALPHA) * rate;
+		}
+		last = seen;
+		then = t;
+
+		pgr_debugf("client arrival rate is %lf/s (ewma)", rate);
+		warm(c, rate);
+	}
+
+	return NULL;
+}
+
+int pgr_pool_warmer(CONTEXT *c, pthread_t *tid)
+{
+	int rc = pthread_create(tid, NULL, do_warmer, c);
+	if (rc != 0) {
+		pgr_logf(stderr, LOG_ERR, "[pool] failed to spin up warmer: %s (errno %d)",
+				strerror(errno), errno);
+		return 1;
+	}
+
+	pgr_logf(stderr, LOG_INFO, "[pool] spinning up warmer [tid=%i]", *tid);
+	return 0;
+}
+
+#ifdef LTEST
+#include <stdio.h>
+
+#define so(s,x) do {\
+	if (x) { \
+		fprintf(stderr, "%s ... OK\n", s); \
+	} else { \
+		fprintf(stderr, "%s:%d: FAIL: %s [!(%s)]\n", __FILE__, __LINE__, s, #x); \
+		exit(1); \
+	} \
+} while (0)
+
+#define is(x,n) so(#x " should equal " #n, (x) == (n))
+
+static CONTEXT C;
+static BACKEND B;
+
+/* A (backend) connection, on behalf of user@db. */
+static void client(CONNECTION *x, const char *user)
+{
+	static PARAM db = { "database", "db", NULL };
+	PARAM *p;
+
+	pgr_conn_init(&C, x);
+	x->index = 0;
+
+	p = calloc(1, sizeof(PARAM));
+	p->name  = "user";
+	p->value = (char *)user;
+	p->next  = &db;
+	x->params = p;
+}
+
+static int waiting()
+{
+	WAITER *w;
+	int n = 0;
+
+	for (w = B.limits.queue; w; w = w->next) {
+		n++;
+	}
+	return n;
+}
+
+int main(int argc, char **argv)
+{
+	CONNECTION a, b, c, d;
+	POOLED *p;
+	char buf[8];
+	int sv[2];
+
+	pthread_rwlock_init(&C.lock, NULL);
+	pthread_rwlock_init(&B.lock, NULL);
+	C.backends = &B;
+	C.num_backends = 1;
+
+	/* at the connection limit, clients wait in line */
+	B.limits.max = 2;
+	client(&a, "alice");
+	client(&b, "bob");
+	client(&c, "carol");
+	client(&d, "dave");
+	is(pgr_pool_admit(&a, 1), 0);
+	is(pgr_pool_admit(&b, 1), 0);
+	is(B.limits.open, 2);
+	is(pgr_pool_admit(&c, 1), MBUF_AGAIN);
+	is(pgr_pool_admit(&d, 1), MBUF_AGAIN);
+	is(pgr_pool_admit(&c, 1), MBUF_AGAIN); /* (keeps its place) */
+	is(waiting(), 2);
+	is(pgr_pool_admit(&a, 1), 0);          /* (already in)      */
+	is(B.limits.open, 2);
+
+	/* ... and go first-come, first-served */
+	pgr_pool_leave(&a);
+	is(B.limits.open, 1);
+	is(pgr_pool_admit(&d, 1), MBUF_AGAIN);
+	is(pgr_pool_admit(&c, 1), 0);
+	is(pgr_pool_admit(&d, 1), MBUF_AGAIN);
+	is(waiting(), 1);
+
+	/* giving up a place in line lets the next one go */
+	client(&a, "alice");
+	is(pgr_pool_admit(&a, 1), MBUF_AGAIN);
+	pgr_pool_leave(&d);
+	pgr_pool_leave(&b);
+	is(pgr_pool_admit(&a, 1), 0);
+	is(waiting(), 0);
+
+	/* without `wait`, no line */
+	is(pgr_pool_admit(&d, 0), 1);
+	is(waiting(), 0);
+	pgr_pool_leave(&a);
+	pgr_pool_leave(&c);
+	is(B.limits.open, 0);
+	so("usage should be cleaned up", B.limits.usage == NULL);
+
+	/* a client held up by its own quota doesn't hold
+	   up anyone behind it */
+	B.limits.max = 3;
+	B.limits.quota = 1;
+	client(&a, "alice");
+	client(&b, "alice");
+	client(&c, "bob");
+	is(pgr_pool_admit(&a, 1), 0);
+	is(pgr_pool_admit(&b, 1), MBUF_AGAIN);
+	is(pgr_pool_admit(&c, 1), 0);
+	is(pgr_pool_admit(&b, 1), MBUF_AGAIN);
+	pgr_pool_leave(&a);
+	is(pgr_pool_admit(&b, 1), 0);
+	pgr_pool_leave(&b);
+	pgr_pool_leave(&c);
+	B.limits.quota = 0;
+
+	/* an idle pooled connection makes way for a new one */
+	B.limits.max = 1;
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) {
+		fprintf(stderr, "socketpair failed: %s\n", strerror(errno));
+		return 2;
+	}
+	p = calloc(1, sizeof(POOLED));
+	p->fd  = sv[0];
+	p->key = strdup("");
+	p->who = strdup("alice@db");
+	B.pool.idle = p;
+	B.pool.size = 1;
+	count(&B, p->who);
+	client(&a, "bob");
+	is(pgr_pool_admit(&a, 1), 0);
+	is(B.pool.size, 0);
+	is(B.limits.open, 1);
+	is(recv(sv[1], buf, sizeof(buf), 0), 5);
+	is(buf[0], 'X');
+	close(sv[1]);
+	pgr_pool_leave(&a);
+
+	/* connect rate: a second's worth, then wait */
+	B.limits.max = 0;
+	B.limits.rate = 2;
+	B.limits.tokens = B.limits.rate; /* (as config does) */
+	client(&a, "alice");
+	client(&b, "bob");
+	client(&c, "carol");
+	is(pgr_pool_admit(&a, 1), 0);
+	is(pgr_pool_admit(&b, 1), 0);
+	is(pgr_pool_admit(&c, 1), MBUF_AGAIN);
+	usleep(600 * 1000);
+	is(pgr_pool_admit(&c, 1), 0);
+
+	fprintf(stderr, "ALL TESTS PASSED\n");
+	return 0;
+}
+#endif
@@ -0,0 +1,296 @@
+/*
+  Copyright (c) 2016 James Hunt
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+ */
+
+#include "pgrouter.h"
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#define SUBSYS "qcache"
+#include "locks.inc.c"
+
+/*
+   Applications send the same few hundred query shapes over
+   and over, so we remember where each one (by fingerprint;
+   see pgr_sql_fingerprint) ought to go.  The classifier's
+   verdict goes in the first time we see it, and if a slave
+   ever answers one with a 25006, the master's does; from
+   then on, that query shape goes straight to the master,
+   without bouncing off of a slave first.
+
+   Every entry carries the generation of the set of
+   volatile functions (see load_functions, in the WATCHER)
+   that its verdict was reached with, and is only good for
+   that generation.  Flushing the cache isn't enough on its
+   own: a worker that classified a query just before the
+   flush can still put its (stale) verdict in just after.
+
+   Each shard is a bounded LRU: a hash table of entries,
+   threaded onto a list from most- to least-recently used.
+   Once a shard is full, its oldest entry makes way.
+ */
+
+static QSHARD* shard(CONTEXT *c, uint64_t fp)
+{
+	return &c->qcache[fp % QCACHE_SHARDS];
+}
+
+static QENTRY** bucket(QSHARD *q, uint64_t fp)
+{
+	return &q->buckets[(fp / QCACHE_SHARDS) % QCACHE_BUCKETS];
+}
+
+/* Must be called with the shard locked. */
+static QENTRY* lookup(QSHARD *q, uint64_t fp)
+{
+	QENTRY *e;
+
+	for (e = *bucket(q, fp); e; e = e->next) {
+		if (e->fingerprint == fp) {
+			return e;
+		}
+	}
+	return NULL;
+}
+
+/* Take an entry off of the LRU list. */
+static void unlink_lru(QSHARD *q, QENTRY *e)
+{
+	if (e->newer) e->newer->older = e->older; else q->newest = e->older;
+	if (e->older) e->older->newer = e->newer; else q->oldest = e->newer;
+	e->newer = e->older = NULL;
+}
+
+/* Put an entry at the front (most recent end) of the LRU. */
+static void touch(QSHARD *q, QENTRY *e)
+{
+	if (q->newest == e) {
+		return;
+	}
+	if (e->newer || e->older || q->oldest == e) {
+		unlink_lru(q, e);
+	}
+	e->older = q->newest;
+	if (q->newest) {
+		q->newest->newer = e;
+	}
+	q->newest = e;
+	if (!q->oldest) {
+		q->oldest = e;
+	}
+}
+
+/* Evict the least recently used entry, and return it
+   for reuse.  The shard must not be empty. */
+static QENTRY* evict(QSHARD *q)
+{
+	QENTRY *e, **ee;
+
+	assert(q->oldest != NULL);
+	e = q->oldest;
+	unlink_lru(q, e);
+	for (ee = bucket(q, e->fingerprint); *ee; ee = &(*ee)->next) {
+		if (*ee == e) {
+			*ee = e->next;
+			break;
+		}
+	}
+	q->entries--;
+	return e;
+}
+
+/* Look up where the query with the given fingerprint
+   ought to go, as of the given generation of volatile
+   functions.  Returns SQL_READ or SQL_WRITE, or -1 if
+   we don't know (in which case, the caller should work it
+   out, and tell us via pgr_qcache_put). */
+int pgr_qcache_get(CONTEXT *c, uint64_t fp, unsigned int generation)
+{
+	QSHARD *q;
+	QENTRY *e;
+	int verdict;
+
+	q = shard(c, fp);
+	wrlock(&q->lock, "qcache", fp % QCACHE_SHARDS);
+	e = lookup(q, fp);
+	if (e && e->generation == generation) {
+		touch(q, e);
+		verdict = e->verdict;
+		q->hits++;
+	} else {
+		verdict = -1;
+		q->misses++;
+	}
+	unlock(&q->lock, "qcache", fp % QCACHE_SHARDS);
+	return verdict;
+}
+
+/* Remember where the query with the given fingerprint
+   ought to go (overriding whatever we thought before), as
+   worked out with the given generation of functions. */
+void pgr_qcache_put(CONTEXT *c, uint64_t fp, int verdict, unsigned int generation)
+{
+	QSHARD *q;
+	QENTRY *e;
+
+	q = shard(c, fp);
+	wrlock(&q->lock, "qcache", fp % QCACHE_SHARDS);
+	e = lookup(q, fp);
+	if (!e) {
+		e = q->entries >= QCACHE_ENTRIES && q->oldest ? evict(q) : NULL;
+		if (!e) {
+			e = malloc(sizeof(QENTRY));
+			if (!e) {
+				pgr_abort(ABORT_MEMFAIL);
+			}
+		}
+		memset(e, 0, sizeof(QENTRY));
+		e->fingerprint = fp;
+		e->next = *bucket(q, fp);
+		*bucket(q, fp) = e;
+		q->entries++;
+	}
+	if (e->verdict != verdict) {
+		pgr_debugf("query %016llx now goes to the %s", (unsigned long long)fp,
+				verdict == SQL_WRITE ? "writer" : "reader");
+	}
+	e->verdict = verdict;
+	e->generation = generation;
+	touch(q, e);
+	unlock(&q->lock, "qcache", fp % QCACHE_SHARDS);
+}
+
+/* Forget everything we know about where queries go (but
+   not our hit / miss counts), because whatever we based
+   it on has changed. */
+void pgr_qcache_flush(CONTEXT *c)
+{
+	QSHARD *q;
+	QENTRY *e;
+	int i;
+
+	for (i = 0; i < QCACHE_SHARDS; i++) {
+		q = &c->qcache[i];
+		wrlock(&q->lock, "qcache", i);
+		while ((e = q->oldest) != NULL) {
+			q->oldest = e->newer;
+			free(e);
+		}
+		q->newest = NULL;
+		q->entries = 0;
+		memset(q->buckets, 0, sizeof(q->buckets));
+		unlock(&q->lock, "qcache", i);
+	}
+}
+
+/* Add up the hits, misses and entries of all the shards,
+   for the monitor. */
+void pgr_qcache_stats(CONTEXT *c, unsigned long *hits, unsigned long *misses, int *entries)
+{
+	int i;
+
+	*hits = *misses = 0;
+	*entries = 0;
+	for (i = 0; i < QCACHE_SHARDS; i++) {
+		rdlock(&c->qcache[i].lock, "qcache", i);
+		*hits    += c->qcache[i].hits;
+		*misses  += c->qcache[i].misses;
+		*entries += c->qcache[i].entries;
+		unlock(&c->qcache[i].lock, "qcache", i);
+	}
+}
+
+#ifdef PTEST
+#include <stdio.h>
+
+#define so(s,x) do {\
+	if (x) { \
+		fprintf(stderr, "%s ... OK\n", s); \
+	} else { \
+		fprintf(stderr, "%s:%d: FAIL: %s [!(%s)]\n", __FILE__, __LINE__, s, #x); \
+		exit(1); \
+	} \
+} while (0)
+
+#define is(x,n) so(#x " should equal " #n, (x) == (n))
+
+/* (the `n`th fingerprint in the first shard) */
+#define FP(n) ((uint64_t)(n) * QCACHE_SHARDS)
+
+static CONTEXT C;
+
+int main(int argc, char **argv)
+{
+	CONTEXT *c = &C;
+	unsigned long hits, misses;
+	int i, entries;
+
+	for (i = 0; i < QCACHE_SHARDS; i++) {
+		pthread_rwlock_init(&c->qcache[i].lock, NULL);
+	}
+
+	/* misses, then hits */
+	is(pgr_qcache_get(c, FP(1), 0), -1);
+	pgr_qcache_put(c, FP(1), SQL_READ, 0);
+	is(pgr_qcache_get(c, FP(1), 0), SQL_READ);
+	is(pgr_qcache_get(c, FP(2), 0), -1);
+
+	/* a 25006 sends a read to the master, from then on */
+	pgr_qcache_put(c, FP(1), SQL_WRITE, 0);
+	is(pgr_qcache_get(c, FP(1), 0), SQL_WRITE);
+	is(c->qcache[0].entries, 1);
+
+	/* a verdict from another generation of functions is no good */
+	is(pgr_qcache_get(c, FP(1), 1), -1);
+	pgr_qcache_put(c, FP(1), SQL_READ, 1);
+	is(pgr_qcache_get(c, FP(1), 1), SQL_READ);
+	is(pgr_qcache_get(c, FP(1), 0), -1);
+	is(c->qcache[0].entries, 1);
+
+	/* a full shard evicts its least recently used entry */
+	for (i = 2; i <= QCACHE_ENTRIES; i++) {
+		pgr_qcache_put(c, FP(i), SQL_READ, 1);
+	}
+	is(c->qcache[0].entries, QCACHE_ENTRIES);
+	is(pgr_qcache_get(c, FP(1), 1), SQL_READ); /* (now the newest) */
+	pgr_qcache_put(c, FP(QCACHE_ENTRIES + 1), SQL_WRITE, 1);
+	is(c->qcache[0].entries, QCACHE_ENTRIES);
+	is(pgr_qcache_get(c, FP(2), 1), -1);
+	is(pgr_qcache_get(c, FP(1), 1), SQL_READ);
+	is(pgr_qcache_get(c, FP(3), 1), SQL_READ);
+	is(pgr_qcache_get(c, FP(QCACHE_ENTRIES + 1), 1), SQL_WRITE);
+	pgr_qcache_put(c, FP(QCACHE_ENTRIES + 2), SQL_WRITE, 1);
+	is(pgr_qcache_get(c, FP(4), 1), -1);
+	is(pgr_qcache_get(c, FP(3), 1), SQL_READ);
+
+	/* other shards are left alone */
+	pgr_qcache_put(c, FP(1) + 1, SQL_WRITE, 1);
+	is(c->qcache[1].entries, 1);
+	is(c->qcache[0].entries, QCACHE_ENTRIES);
+
+	/* flushing forgets everything, but the counts */
+	pgr_qcache_flush(c);
+	pgr_qcache_stats(c, &hits, &misses, &entries);
+	is(entries, 0);
+	so("hits should survive a flush", hits > 0);
+	so("misses should survive a flush", misses > 0);
+	is(pgr_qcache_get(c, FP(1), 1), -1);
+	is(pgr_qcache_get(c, FP(1) + 1, 1), -1);
+	pgr_qcache_put(c, FP(1), SQL_WRITE, 1);
+	is(pgr_qcache_get(c, FP(1), 1), SQL_WRITE);
+
+	fprintf(stderr, "ALL TESTS PASSED\n");
+	return 0;
+}
+#endif
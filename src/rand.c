@@ -14,6 +14,8 @@
 
 #include "pgrouter.h"
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 #include <errno.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -65,6 +67,36 @@ int pgr_rand(int start, int end)
 	return (int)((rand_r(prng_seed()) * 1.0 / RAND_MAX) * (end - start) + start + 0.5);
 }
 
+/* Fill `buf` with `n` bytes straight from the kernel's
+   CSPRNG, for anything that has to be unguessable (unlike
+   pgr_rand, whose state is only 32 bits of rand_r seed). */
+void pgr_rand_bytes(void *buf, size_t n)
+{
+	ssize_t nread;
+	int fd;
+
+	fd = open(RAND_DEVICE, O_RDONLY);
+	if (fd < 0) {
+		pgr_logf(stderr, LOG_ERR, "[rand] unable to open %s for reading: %s (errno %d)",
+				RAND_DEVICE, strerror(errno), errno);
+		pgr_abort(ABORT_RANDFAIL);
+	}
+	while (n > 0) {
+		nread = read(fd, buf, n);
+		if (nread <= 0) {
+			if (nread < 0 && errno == EINTR) {
+				continue;
+			}
+			pgr_logf(stderr, LOG_ERR, "[rand] unable to read random bytes from %s: %s (errno %d)",
+					RAND_DEVICE, nread < 0 ? strerror(errno) : "end of file", nread < 0 ? errno : 0);
+			pgr_abort(ABORT_RANDFAIL);
+		}
+		buf = (char *)buf + nread;
+		n -= nread;
+	}
+	close(fd);
+}
+
 void pgr_srand(int x)
 {
 	prng_seed();
@@ -0,0 +1,1152 @@
+/*
+  Copyright (c) 2016 James Hunt
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+ */
+
+#include "pgrouter.h"
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+
+/*
+   Sending every query to a slave first, and only trying
+   the master once the slave says 25006, costs every write
+   an extra round-trip.  Instead, we take a (quick) look at
+   the text of each query, and send the ones that are sure
+   to write straight to the master.
+
+   This is not a parser.  A small lexer breaks the SQL up
+   into words, skipping over comments, string literals
+   (including E'' and dollar-quoted ones) and quoted names,
+   so that none of those can fool it, and the classifier
+   looks at the words it gets: the verb each statement
+   starts with, and (for SELECTs and CTEs) whatever inside
+   of it would make it write.  When in doubt, a statement
+   counts as a read; the 25006 fallback is still there to
+   catch anything we miss.
+ */
+
+#define TOKEN_END   0  /* end of the SQL           */
+#define TOKEN_WORD  1  /* keyword or (bare) name   */
+#define TOKEN_OPEN  2  /* (                        */
+#define TOKEN_CLOSE 3  /* )                        */
+#define TOKEN_SEMI  4  /* ;                        */
+#define TOKEN_VALUE 5  /* string or numeric literal */
+#define TOKEN_OTHER 6  /* anything else            */
+
+typedef struct {
+	const char *p;              /* where we are in the SQL      */
+	int type;                   /* a TOKEN_* constant           */
+	const char *word;           /* start of the token,          */
+	size_t len;                 /* and its length               */
+	int depth;                  /* how many parens deep we are  */
+} LEXER;
+
+static int isword(char c)
+{
+	return isalnum(c) || c == '_' || c == '$' || (c & 0x80);
+}
+
+/* Skip over whitespace and comments (which can nest). */
+static void space(LEXER *l)
+{
+	int nest;
+
+	for (;;) {
+		while (isspace(*l->p)) {
+			l->p++;
+		}
+		if (l->p[0] == '-' && l->p[1] == '-') {
+			while (*l->p && *l->p != '\n') {
+				l->p++;
+			}
+			continue;
+		}
+		if (l->p[0] == '/' && l->p[1] == '*') {
+			for (nest = 0; *l->p; l->p++) {
+				if (l->p[0] == '/' && l->p[1] == '*') {
+					nest++; l->p++;
+				} else if (l->p[0] == '*' && l->p[1] == '/') {
+					l->p++;
+					if (--nest == 0) {
+						l->p++;
+						break;
+					}
+				}
+			}
+			continue;
+		}
+		return;
+	}
+}
+
+/* Skip over a quoted string (or name), starting on the
+   opening quote.  A doubled quote is a literal quote; in
+   E'' strings, so is a backslashed one. */
+static void quoted(LEXER *l, char quote, int escapes)
+{
+	for (l->p++; *l->p; l->p++) {
+		if (escapes && l->p[0] == '\\' && l->p[1]) {
+			l->p++;
+		} else if (l->p[0] == quote) {
+			if (l->p[1] != quote) {
+				l->p++;
+				return;
+			}
+			l->p++;
+		}
+	}
+}
+
+/* Skip over a $tag$ ... $tag$ string, if there is one
+   starting here, and return non-zero.  Otherwise (i.e.
+   it's a $1 parameter), skip nothing, and return 0. */
+static int dollars(LEXER *l)
+{
+	const char *end, *tag;
+	size_t n;
+
+	for (end = l->p + 1; *end && *end != '$'; end++) {
+		if (!(isalpha(*end) || *end == '_' || (*end & 0x80) || (end > l->p + 1 && isdigit(*end)))) {
+			return 0;
+		}
+	}
+	if (*end != '$') {
+		return 0;
+	}
+
+	/* the string ends with the same $tag$ it started with */
+	tag = l->p;
+	n = end - tag + 1;
+	for (l->p += n; *l->p; l->p++) {
+		if (strncmp(l->p, tag, n) == 0) {
+			l->p += n;
+			break;
+		}
+	}
+	return 1;
+}
+
+static int lex(LEXER *l)
+{
+	switch (*l->p) {
+	case '\0':
+		return TOKEN_END;
+
+	case '(':
+		l->p++;
+		l->depth++;
+		return TOKEN_OPEN;
+
+	case ')':
+		l->p++;
+		if (l->depth > 0) {
+			l->depth--;
+		}
+		return TOKEN_CLOSE;
+
+	case ';':
+		l->p++;
+		return TOKEN_SEMI;
+
+	case '\'':
+		quoted(l, '\'', 0);
+		return TOKEN_VALUE;
+
+	case '"':
+		/* a quoted name is never a keyword */
+		quoted(l, '"', 0);
+		return TOKEN_OTHER;
+
+	case '$':
+		if (dollars(l)) {
+			return TOKEN_VALUE;
+		}
+		l->p++;
+		return TOKEN_OTHER;
+	}
+
+	if (isdigit(*l->p)) {
+		while (isalnum(*l->p) || *l->p == '.') {
+			l->p++;
+		}
+		return TOKEN_VALUE;
+	}
+
+	if (isword(*l->p)) {
+		while (isword(*l->p)) {
+			l->p++;
+		}
+		if (l->p - l->word == 1 && (*l->word == 'e' || *l->word == 'E') && *l->p == '\'') {
+			quoted(l, '\'', 1);
+			return TOKEN_VALUE;
+		}
+		return TOKEN_WORD;
+	}
+
+	l->p++;
+	return TOKEN_OTHER;
+}
+
+/* Move on to the next token, and return its type. */
+static int next(LEXER *l)
+{
+	space(l);
+	l->word = l->p;
+	l->type = lex(l);
+	l->len  = l->p - l->word;
+	return l->type;
+}
+
+/* Is the current token the given keyword? */
+static int is(LEXER *l, const char *kw)
+{
+	return l->type == TOKEN_WORD
+	    && strlen(kw) == l->len
+	    && strncasecmp(l->word, kw, l->len) == 0;
+}
+
+/* Is the current token one of the given keywords? */
+static int among(LEXER *l, const char **kws)
+{
+	for (; *kws; kws++) {
+		if (is(l, *kws)) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* Statements that always write (or at least, that a slave
+   would never run). */
+static const char *WRITES[] = {
+	"insert", "update", "delete", "merge", "truncate",
+	"create", "alter", "drop", "grant", "revoke", "comment",
+	"security", "reassign", "import", "refresh",
+	"vacuum", "analyze", "analyse", "cluster", "reindex",
+	"lock", "call", "do", "notify",
+	NULL,
+};
+
+/* Verbs that can be buried in a SELECT, by way of a CTE. */
+static const char *MODIFIES[] = {
+	"insert", "update", "delete", "merge",
+	NULL,
+};
+
+/* Functions that can't be called on a slave. */
+static const char *VOLATILE[] = {
+	"nextval", "setval", "txid_current", "pg_current_xact_id",
+	NULL,
+};
+
+/*
+   On top of the built-in functions we know about, the
+   WATCHER gives us the set of (user-defined) functions that
+   the master has marked volatile.  Those can write, so
+   a SELECT that calls one of them goes to the master.
+ */
+
+static uint64_t hash(const char *name, size_t len)
+{
+	uint64_t h = 0xcbf29ce484222325ULL;
+	size_t i;
+
+	for (i = 0; i < len && name[i]; i++) {
+		h = (h ^ (unsigned char)tolower(name[i])) * 0x100000001b3ULL;
+	}
+	return h;
+}
+
+/* Make a new (empty) set, with room for `n` names. */
+FUNCSET* pgr_funcset_new(unsigned int n)
+{
+	FUNCSET *set;
+
+	set = calloc(1, sizeof(FUNCSET));
+	if (!set) {
+		pgr_abort(ABORT_MEMFAIL);
+	}
+	/* keep it at most half full */
+	for (set->size = 16; set->size < n * 2; set->size *= 2)
+		;
+	set->slots = calloc(set->size, sizeof(char *));
+	if (!set->slots) {
+		pgr_abort(ABORT_MEMFAIL);
+	}
+	return set;
+}
+
+/* Add a name to a set (that isn't full yet). */
+void pgr_funcset_add(FUNCSET *set, const char *name)
+{
+	unsigned int i;
+
+	if (set->n * 2 >= set->size) {
+		return;
+	}
+	for (i = hash(name, strlen(name)) & (set->size - 1); set->slots[i]; i = (i + 1) & (set->size - 1)) {
+		if (strcasecmp(set->slots[i], name) == 0) {
+			return;
+		}
+	}
+	set->slots[i] = strdup(name);
+	if (!set->slots[i]) {
+		pgr_abort(ABORT_MEMFAIL);
+	}
+	set->n++;
+}
+
+/* Is the (`len` character long) name in the set? */
+int pgr_funcset_has(const FUNCSET *set, const char *name, size_t len)
+{
+	unsigned int i;
+
+	if (!set) {
+		return 0;
+	}
+	for (i = hash(name, len) & (set->size - 1); set->slots[i]; i = (i + 1) & (set->size - 1)) {
+		if (strlen(set->slots[i]) == len && strncasecmp(set->slots[i], name, len) == 0) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+void pgr_funcset_free(FUNCSET *set)
+{
+	unsigned int i;
+
+	if (!set) {
+		return;
+	}
+	for (i = 0; i < set->size; i++) {
+		free(set->slots[i]);
+	}
+	free(set->slots);
+	free(set);
+}
+
+/* Classify the rest of a SELECT (or WITH, VALUES, or
+   TABLE) statement, up to the next top-level semicolon. */
+static int query(LEXER *l, const FUNCSET *writers)
+{
+	int writes = 0;
+
+	while (next(l) != TOKEN_END && !(l->type == TOKEN_SEMI && l->depth == 0)) {
+		if (writes || l->type != TOKEN_WORD) {
+			continue;
+		}
+
+		if (among(l, MODIFIES) || is(l, "into")) {
+			/* WITH x AS (INSERT ...), or SELECT ... INTO */
+			writes = 1;
+
+		} else if (is(l, "for")) {
+			/* FOR UPDATE, FOR NO KEY UPDATE, FOR SHARE, FOR KEY SHARE */
+			next(l);
+			writes = is(l, "update") || is(l, "share") || is(l, "no") || is(l, "key");
+
+		} else if (among(l, VOLATILE) || pgr_funcset_has(writers, l->word, l->len)) {
+			next(l);
+			writes = l->type == TOKEN_OPEN;
+		}
+
+		if (l->type == TOKEN_END || (l->type == TOKEN_SEMI && l->depth == 0)) {
+			break; /* (we looked one token ahead, into the next statement) */
+		}
+	}
+	return writes ? SQL_WRITE : SQL_READ;
+}
+
+/* Skip to the end of the current statement. */
+static void rest(LEXER *l)
+{
+	while (l->type != TOKEN_END && !(l->type == TOKEN_SEMI && l->depth == 0)) {
+		next(l);
+	}
+}
+
+/* Classify the statement starting at the next token. */
+static int statement(LEXER *l, const FUNCSET *writers)
+{
+	int analyze;
+
+	do {
+		next(l);
+	} while (l->type == TOKEN_OPEN || l->type == TOKEN_SEMI);
+
+	if (l->type != TOKEN_WORD) {
+		rest(l);
+		return SQL_READ;
+	}
+
+	if (is(l, "explain")) {
+		/* only EXPLAIN ANALYZE runs the statement */
+		for (analyze = 0; next(l) != TOKEN_END; ) {
+			if (is(l, "analyze") || is(l, "analyse")) {
+				analyze = 1;
+			} else if (l->type == TOKEN_WORD && l->depth == 0
+			        && !is(l, "verbose")) {
+				break;
+			}
+		}
+		if (!analyze) {
+			rest(l);
+			return SQL_READ;
+		}
+	}
+
+	if (is(l, "select") || is(l, "with") || is(l, "values") || is(l, "table")) {
+		return query(l, writers);
+	}
+
+	if (is(l, "copy")) {
+		/* COPY ... FROM writes; COPY ... TO doesn't */
+		while (next(l) != TOKEN_END && !(l->type == TOKEN_SEMI && l->depth == 0)) {
+			if (is(l, "from") && l->depth == 0) {
+				rest(l);
+				return SQL_WRITE;
+			}
+		}
+		return SQL_READ;
+	}
+
+	if (among(l, WRITES)) {
+		rest(l);
+		return SQL_WRITE;
+	}
+
+	rest(l);
+	return SQL_READ;
+}
+
+/* Hash the given SQL into a fingerprint (64-bit FNV-1a)
+   of its shape: the same statement, give or take case,
+   whitespace, comments and literal values, always gets
+   the same fingerprint.  Never returns 0. */
+uint64_t pgr_sql_fingerprint(const char *sql)
+{
+	LEXER l;
+	uint64_t h;
+	size_t i;
+
+	memset(&l, 0, sizeof(l));
+	l.p = sql;
+
+	h = 0xcbf29ce484222325ULL;
+#define fnv(c) (h = (h ^ (unsigned char)(c)) * 0x100000001b3ULL)
+	while (next(&l) != TOKEN_END) {
+		switch (l.type) {
+		case TOKEN_VALUE:
+			fnv('?');
+			break;
+
+		case TOKEN_WORD:
+			for (i = 0; i < l.len; i++) {
+				fnv(tolower(l.word[i]));
+			}
+			break;
+
+		default:
+			for (i = 0; i < l.len; i++) {
+				fnv(l.word[i]);
+			}
+			break;
+		}
+		fnv(' ');
+	}
+#undef fnv
+	return h ? h : 1;
+}
+
+/* Classify the given SQL (which may have more than one
+   statement in it) as SQL_WRITE, if any of it writes, or
+   SQL_READ otherwise.  Calls to any of the functions in
+   `writers` (if not NULL) count as writes. */
+int pgr_sql_classify(const char *sql, const FUNCSET *writers)
+{
+	LEXER l;
+
+	memset(&l, 0, sizeof(l));
+	l.p = sql;
+
+	while (*l.p) {
+		if (statement(&l, writers) == SQL_WRITE) {
+			return SQL_WRITE;
+		}
+		l.depth = 0;
+	}
+	return SQL_READ;
+}
+
+/* Read the transaction modes (as in BEGIN or SET TRANSACTION)
+   from the rest of the current statement into `txn`.  Only
+   non-serializable READ ONLY transactions can run on a slave:
+   hot standbys refuse SERIALIZABLE. */
+static int modes(LEXER *l, int txn)
+{
+	int ro = txn == SQL_BEGIN_RO, read = 0;
+
+	while (next(l) != TOKEN_END && !(l->type == TOKEN_SEMI && l->depth == 0)) {
+		if (read && is(l, "only"))  ro = 1;
+		if (read && is(l, "write")) ro = 0;
+		if (is(l, "serializable")) {
+			rest(l);
+			return SQL_BEGIN;
+		}
+		read = is(l, "read"); /* (REPEATABLE READ, READ ONLY) */
+	}
+	return ro ? SQL_BEGIN_RO : SQL_BEGIN;
+}
+
+/* Does the given SQL open a transaction block?  Returns
+   SQL_BEGIN if one of its statements is a BEGIN or START
+   TRANSACTION, or SQL_BEGIN_RO if that transaction is read
+   only (per its own modes or a SET TRANSACTION that follows
+   it), and 0 otherwise.  `txn` carries over what an earlier
+   statement in the same batch opened (or 0), so that the
+   SET TRANSACTION can come in a message of its own.
+
+   Comments, case and whitespace don't matter; neither does
+   anything quoted, so the BEGIN of a DO body won't count. */
+int pgr_sql_begins(const char *sql, int txn)
+{
+	LEXER l;
+
+	memset(&l, 0, sizeof(l));
+	l.p = sql;
+
+	while (*l.p) {
+		do {
+			next(&l);
+		} while (l.type == TOKEN_SEMI);
+
+		if (is(&l, "begin")) {
+			txn = modes(&l, 0);
+
+		} else if (is(&l, "start")) {
+			next(&l);
+			if (is(&l, "transaction")) {
+				txn = modes(&l, 0);
+			}
+
+		} else if (is(&l, "set") && txn) {
+			next(&l);
+			if (is(&l, "transaction")) {
+				txn = modes(&l, txn);
+			}
+		}
+		rest(&l);
+		l.depth = 0;
+	}
+	return txn;
+}
+
+/* Functions that take locks held until the session ends. */
+static const char *LOCKS[] = {
+	"pg_advisory_lock", "pg_advisory_lock_shared",
+	"pg_try_advisory_lock", "pg_try_advisory_lock_shared",
+	NULL,
+};
+
+/* Does the set_config() call whose argument list starts at
+   the current token (the opening paren) set the parameter
+   for the rest of the session?  Only a literal `true` for
+   is_local keeps it to the transaction. */
+static int session_config(LEXER *l)
+{
+	int depth, arg;
+
+	for (depth = l->depth, arg = 1; next(l) != TOKEN_END && l->depth >= depth; ) {
+		if (l->depth != depth) {
+			continue;
+		}
+		if (l->type == TOKEN_OTHER && *l->word == ',') {
+			arg++;
+		} else if (arg == 3) {
+			return !is(l, "true");
+		}
+	}
+	return 1;
+}
+
+/* Does the statement starting at the current token leave
+   state behind in the backend session?  Looks as far as the
+   end of the statement, if it has to. */
+static int pinning(LEXER *l)
+{
+	LEXER peek;
+	int declare = 0;
+
+	if (is(l, "set")) {
+		/* SET LOCAL and SET TRANSACTION end with the transaction */
+		next(l);
+		if (!is(l, "local") && !is(l, "transaction") && !is(l, "constraints")) {
+			return 1;
+		}
+
+	} else if (is(l, "prepare")) {
+		/* (PREPARE TRANSACTION is 2PC) */
+		next(l);
+		if (!is(l, "transaction")) {
+			return 1;
+		}
+
+	} else if (is(l, "create")) {
+		next(l);
+		if (is(l, "global") || is(l, "local")) {
+			next(l);
+		}
+		if (is(l, "temp") || is(l, "temporary")) {
+			return 1;
+		}
+
+	} else if (is(l, "listen")) {
+		return 1;
+
+	} else if (is(l, "declare")) {
+		declare = 1;
+	}
+
+	while (l->type != TOKEN_END && !(l->type == TOKEN_SEMI && l->depth == 0)) {
+		if (declare && is(l, "with")) {
+			/* DECLARE ... CURSOR WITH HOLD */
+			next(l);
+			if (is(l, "hold")) {
+				return 1;
+			}
+			continue;
+
+		} else if (among(l, LOCKS)) {
+			next(l);
+			if (l->type == TOKEN_OPEN) {
+				return 1;
+			}
+			continue;
+
+		} else if (is(l, "set_config")) {
+			/* look ahead on a copy; the arguments could
+			   have set_config() calls of their own */
+			next(l);
+			peek = *l;
+			if (l->type == TOKEN_OPEN && session_config(&peek)) {
+				return 1;
+			}
+			continue;
+
+		} else if (is(l, "insert") || is(l, "merge")) {
+			/* INSERT INTO isn't SELECT ... INTO */
+			next(l);
+			if (!is(l, "into")) {
+				continue;
+			}
+
+		} else if (is(l, "into")) {
+			/* SELECT ... INTO [GLOBAL | LOCAL] TEMP */
+			next(l);
+			if (is(l, "global") || is(l, "local")) {
+				next(l);
+			}
+			if (is(l, "temp") || is(l, "temporary")) {
+				return 1;
+			}
+			continue;
+		}
+		next(l);
+	}
+	return 0;
+}
+
+/* Does the given SQL (any of its statements) pin the session
+   to its backend connection?  That is, does it leave state
+   behind in the backend session that later statements will
+   count on: temporary tables, session-level advisory locks,
+   plain (not LOCAL) SETs and set_config() calls, prepared
+   statements, cursors WITH HOLD, and LISTENs.  We'd rather
+   pin a client that didn't need it than not pin one that
+   did, so a call to an advisory lock function counts no
+   matter where it is. */
+int pgr_sql_pins(const char *sql)
+{
+	LEXER l;
+
+	memset(&l, 0, sizeof(l));
+	l.p = sql;
+
+	while (*l.p) {
+		do {
+			next(&l);
+		} while (l.type == TOKEN_OPEN || l.type == TOKEN_SEMI);
+
+		if (pinning(&l)) {
+			return 1;
+		}
+		l.depth = 0;
+	}
+	return 0;
+}
+
+/* Statements that control transactions, or leave state
+   behind in the backend session (on top of what pinning
+   looks for), or that take over the connection. */
+static const char *STATEFUL[] = {
+	"begin", "start", "commit", "end", "rollback", "abort",
+	"savepoint", "release", "prepare", "deallocate",
+	"set", "reset", "discard", "listen", "unlisten",
+	"declare", "lock", "copy",
+	NULL,
+};
+
+/* Can the given SQL run (in autocommit) on a connection
+   shared with other clients?  i.e. is it a single statement,
+   that neither controls transactions nor leaves session
+   state behind it? */
+int pgr_sql_autonomous(const char *sql)
+{
+	LEXER l;
+
+	memset(&l, 0, sizeof(l));
+	l.p = sql;
+
+	do {
+		next(&l);
+	} while (l.type == TOKEN_OPEN || l.type == TOKEN_SEMI);
+
+	if (l.type != TOKEN_WORD || among(&l, STATEFUL) || pinning(&l)) {
+		return 0;
+	}
+	rest(&l);
+
+	/* (and nothing after it, but for semicolons) */
+	while (l.type == TOKEN_SEMI) {
+		next(&l);
+	}
+	return l.type == TOKEN_END;
+}
+
+/* Copy the name at the current token into `name` (which
+   has room for `size` bytes, terminator and all) the way
+   postgres reads it: folded to lower case, unless it's
+   quoted, and cut short if it's too long. */
+static void ident(LEXER *l, char *name, size_t size)
+{
+	size_t i, n;
+
+	n = 0;
+	if (l->type == TOKEN_OTHER && *l->word == '"') {
+		for (i = 1; i + 1 < l->len && n + 1 < size; i++) {
+			name[n++] = l->word[i];
+			if (l->word[i] == '"') {
+				i++; /* ("" is a quote) */
+			}
+		}
+	} else {
+		for (i = 0; i < l->len && n + 1 < size; i++) {
+			name[n++] = tolower(l->word[i]);
+		}
+	}
+	name[n] = '\0';
+}
+
+/* Find the next statement in `*sql` that deallocates
+   prepared statements, and move `*sql` past it.  Returns
+   SQL_DEALLOCATE for a DEALLOCATE of one statement (whose
+   name goes in `buf`), SQL_DEALLOCATE_ALL for DEALLOCATE
+   ALL or DISCARD ALL, and 0 if there are no (more) such
+   statements.  Comments, case and whitespace don't matter,
+   and neither does anything quoted. */
+int pgr_sql_deallocates(const char **sql, char *buf, size_t size)
+{
+	LEXER l;
+	int rc;
+
+	memset(&l, 0, sizeof(l));
+	l.p = *sql;
+
+	while (*l.p) {
+		do {
+			next(&l);
+		} while (l.type == TOKEN_SEMI);
+
+		rc = 0;
+		if (is(&l, "deallocate")) {
+			next(&l);
+			if (is(&l, "prepare")) {
+				next(&l);
+			}
+			if (is(&l, "all")) {
+				rc = SQL_DEALLOCATE_ALL;
+			} else if (l.type == TOKEN_WORD || (l.type == TOKEN_OTHER && *l.word == '"')) {
+				ident(&l, buf, size);
+				rc = SQL_DEALLOCATE;
+			}
+
+		} else if (is(&l, "discard")) {
+			next(&l);
+			if (is(&l, "all")) {
+				rc = SQL_DEALLOCATE_ALL;
+			}
+		}
+		rest(&l);
+		l.depth = 0;
+
+		if (rc) {
+			*sql = l.p;
+			return rc;
+		}
+	}
+	*sql = l.p;
+	return 0;
+}
+
+/* Is the given SQL a lone LISTEN or UNLISTEN?  Returns
+   SQL_LISTEN or SQL_UNLISTEN, with the channel name (the
+   way postgres reads it; see ident) in `buf`, SQL_UNLISTEN_ALL
+   for an UNLISTEN *, and 0 for anything else, including a
+   LISTEN that shares its query string with other statements
+   (which postgres would run in one implicit transaction, so
+   that it can't be taken out and handled on its own). */
+int pgr_sql_listens(const char *sql, char *buf, size_t size)
+{
+	LEXER l;
+	int rc;
+
+	memset(&l, 0, sizeof(l));
+	l.p = sql;
+
+	do {
+		next(&l);
+	} while (l.type == TOKEN_SEMI);
+
+	if (is(&l, "listen")) {
+		rc = SQL_LISTEN;
+	} else if (is(&l, "unlisten")) {
+		rc = SQL_UNLISTEN;
+	} else {
+		return 0;
+	}
+
+	next(&l);
+	if (rc == SQL_UNLISTEN && l.type == TOKEN_OTHER && *l.word == '*') {
+		rc = SQL_UNLISTEN_ALL;
+		*buf = '\0';
+	} else if (l.type == TOKEN_WORD || (l.type == TOKEN_OTHER && *l.word == '"' && l.len > 2)) {
+		ident(&l, buf, size);
+	} else {
+		return 0;
+	}
+
+	/* (and nothing after it, but for semicolons) */
+	do {
+		next(&l);
+	} while (l.type == TOKEN_SEMI);
+	return l.type == TOKEN_END ? rc : 0;
+}
+
+#ifdef PTEST
+#include <stdio.h>
+#include <stdlib.h>
+
+#define reads(x)  so(x, pgr_sql_classify(x, set) == SQL_READ,  "read")
+#define writes(x) so(x, pgr_sql_classify(x, set) == SQL_WRITE, "write")
+#define so(sql,x,what) do {\
+	if (x) { \
+		fprintf(stderr, "`%s` is a %s ... OK\n", sql, what); \
+	} else { \
+		fprintf(stderr, "%s:%d: FAIL: `%s` should be a %s\n", __FILE__, __LINE__, sql, what); \
+		exit(1); \
+	} \
+} while (0)
+
+#define begins(x)   so(x, pgr_sql_begins(x, 0) == SQL_BEGIN,    "read-write transaction")
+#define readonly(x) so(x, pgr_sql_begins(x, 0) == SQL_BEGIN_RO, "read-only transaction")
+#define doesnt(x)   so(x, pgr_sql_begins(x, 0) == 0,            "non-transaction")
+#define pins(x)     so(x, pgr_sql_pins(x) != 0,                 "pinning statement")
+#define nopin(x)    so(x, pgr_sql_pins(x) == 0,                 "non-pinning statement")
+#define alone(x)      so(x, pgr_sql_autonomous(x) != 0,       "statement that can share")
+#define shared_not(x) so(x, pgr_sql_autonomous(x) == 0,       "statement that can't share")
+#define deallocates(x,n) do {\
+	const char *sql = x; char buf[64]; \
+	so(x, pgr_sql_deallocates(&sql, buf, sizeof(buf)) == SQL_DEALLOCATE && strcmp(buf, n) == 0, "deallocation of `" n "`"); \
+} while (0)
+#define deallocates_all(x) do {\
+	const char *sql = x; char buf[64]; \
+	so(x, pgr_sql_deallocates(&sql, buf, sizeof(buf)) == SQL_DEALLOCATE_ALL, "deallocation of everything"); \
+} while (0)
+#define doesnt_deallocate(x) do {\
+	const char *sql = x; char buf[64]; \
+	so(x, pgr_sql_deallocates(&sql, buf, sizeof(buf)) == 0, "non-deallocation"); \
+} while (0)
+#define listens(x,n) do {\
+	char buf[64]; \
+	so(x, pgr_sql_listens(x, buf, sizeof(buf)) == SQL_LISTEN && strcmp(buf, n) == 0, "LISTEN on `" n "`"); \
+} while (0)
+#define unlistens(x,n) do {\
+	char buf[64]; \
+	so(x, pgr_sql_listens(x, buf, sizeof(buf)) == SQL_UNLISTEN && strcmp(buf, n) == 0, "UNLISTEN on `" n "`"); \
+} while (0)
+#define unlistens_all(x) do {\
+	char buf[64]; \
+	so(x, pgr_sql_listens(x, buf, sizeof(buf)) == SQL_UNLISTEN_ALL, "UNLISTEN on everything"); \
+} while (0)
+#define doesnt_listen(x) do {\
+	char buf[64]; \
+	so(x, pgr_sql_listens(x, buf, sizeof(buf)) == 0, "statement the listener can't handle"); \
+} while (0)
+#define same(a,b)   so(a " ~ " b, pgr_sql_fingerprint(a) == pgr_sql_fingerprint(b), "match")
+#define differ(a,b) so(a " ~ " b, pgr_sql_fingerprint(a) != pgr_sql_fingerprint(b), "mismatch")
+
+int main(int argc, char **argv)
+{
+	FUNCSET *set = NULL;
+
+	reads("");
+	reads("SELECT 1");
+	reads("select * from users where id = 42");
+	reads("  \n\tselect 1;");
+	reads("(SELECT 1) UNION (SELECT 2)");
+	reads("VALUES (1), (2)");
+	reads("TABLE users");
+	reads("SHOW search_path");
+	reads("SET search_path TO app");
+	reads("BEGIN");
+	reads("EXPLAIN SELECT 1");
+	reads("EXPLAIN DELETE FROM users");
+	reads("EXPLAIN VERBOSE UPDATE users SET x = 1");
+	reads("copy users to stdout");
+	reads("COPY (SELECT * FROM users) TO STDOUT");
+	reads("select currval('users_id_seq')");
+	reads("select * from users for each"); /* nonsense, but not FOR UPDATE */
+
+	/* comments and literals can't fool us */
+	reads("select 'insert into users' as q");
+	reads("select E'it\\'s an update' as q");
+	reads("select $$ delete from users $$");
+	reads("select $body$ delete $$ from $body$");
+	reads("select \"update\" from users");
+	reads("-- insert into users\nselect 1");
+	reads("/* delete /* nested */ from users */ select 1");
+	reads("select 1 -- for update");
+	reads("select nextval from users");
+	reads("select $1::int");
+
+	writes("INSERT INTO users VALUES (1)");
+	writes("insert into users values ('select')");
+	writes("  update users set x = 1");
+	writes("DELETE FROM users");
+	writes("MERGE INTO t USING s ON t.id = s.id WHEN MATCHED THEN DELETE");
+	writes("TRUNCATE users");
+	writes("create table t (a int)");
+	writes("CREATE INDEX ON users (email)");
+	writes("alter table users add column x int");
+	writes("drop table users");
+	writes("GRANT SELECT ON users TO bob");
+	writes("vacuum users");
+	writes("NOTIFY jobs");
+	writes("copy users from stdin");
+	writes("/* hello */ insert into users values (1)");
+	writes("-- hello\ninsert into users values (1)");
+	writes("select 1; insert into users values (1)");
+	writes("select ';'; delete from users");
+	writes("EXPLAIN ANALYZE DELETE FROM users");
+	writes("explain (analyze, buffers) update users set x = 1");
+
+	writes("SELECT * FROM users FOR UPDATE");
+	writes("select * from users where id = 1 for no key update");
+	writes("SELECT * FROM users FOR SHARE SKIP LOCKED");
+	writes("select * from users for key share");
+	writes("select nextval('users_id_seq')");
+	writes("SELECT pg_catalog.setval('s', 42)");
+	writes("select txid_current()");
+	writes("select * into new_users from users");
+	writes("WITH gone AS (DELETE FROM users RETURNING *) SELECT count(*) FROM gone");
+	writes("with recursive x(n) as (select 1), y as (insert into t select n from x returning *) select * from y");
+	writes("(select * from users for update)");
+
+	/* volatile functions, from the master */
+	reads("select my_proc(1)");
+	set = pgr_funcset_new(3);
+	pgr_funcset_add(set, "my_proc");
+	pgr_funcset_add(set, "Audit_Log");
+	pgr_funcset_add(set, "my_proc");
+	so("{my_proc, Audit_Log, my_proc}", set->n == 2, "set of two names");
+	writes("select my_proc(1)");
+	writes("SELECT MY_PROC(1)");
+	writes("select app.my_proc(1)");
+	writes("select * from t where x = audit_log('hi')");
+	reads("select my_proc from t");
+	reads("select my_procs(1)");
+	reads("select \"my_proc\"(1)");
+	reads("select 'my_proc(1)'");
+	pgr_funcset_free(set);
+	set = NULL;
+
+	/* transaction blocks */
+	begins("BEGIN");
+	begins("begin isolation level serializable");
+	begins("  /* hi */ START TRANSACTION;");
+	begins("-- go\nstart transaction read write");
+	begins("select 1; begin");
+	doesnt("");
+	doesnt("COMMIT");
+	doesnt("rollback; end");
+	doesnt("select 'begin'");
+	doesnt("select begin from t");
+	doesnt("START_TIME");
+	doesnt("do $$ begin perform 1; end $$");
+
+	readonly("BEGIN READ ONLY");
+	readonly("start transaction isolation level repeatable read, read only");
+	readonly("begin; set transaction read only");
+	readonly("/* report */ BEGIN;\nSET TRANSACTION ISOLATION LEVEL REPEATABLE READ READ ONLY;\nSELECT 1");
+	begins("begin read only; set transaction read write");
+	begins("begin read only isolation level serializable");
+	begins("begin; set transaction isolation level serializable, read only");
+	begins("begin; set transaction_read_only = on");
+	doesnt("set transaction read only");
+	doesnt("select 'begin read only'");
+	so("SET TRANSACTION READ ONLY, after BEGIN",
+		pgr_sql_begins("set transaction read only", SQL_BEGIN) == SQL_BEGIN_RO, "read-only transaction");
+	so("SELECT 1, after BEGIN READ ONLY",
+		pgr_sql_begins("select 1", SQL_BEGIN_RO) == SQL_BEGIN_RO, "read-only transaction");
+
+	/* session state */
+	pins("SET search_path TO app");
+	pins("set statement_timeout = 0");
+	pins("SET SESSION AUTHORIZATION bob");
+	pins("/* app */ SET search_path TO app");
+	pins("-- hi\nset work_mem = '64MB'");
+	pins("select 1; set x.y = 1");
+	pins("PREPARE q AS SELECT 1");
+	pins("/* orm */ prepare q (int) as select $1");
+	pins("CREATE TEMP TABLE t (a int)");
+	pins("create global temporary table t (a int)");
+	pins("/**/create local temp table t as select 1");
+	pins("DECLARE c CURSOR WITH HOLD FOR SELECT 1");
+	pins("-- cursor\ndeclare c scroll cursor with hold for select 1");
+	pins("LISTEN jobs");
+	pins("select pg_advisory_lock(1)");
+	pins("SELECT pg_catalog.pg_try_advisory_lock_shared(42)");
+	pins("select set_config('search_path', 'app', false)");
+	pins("SELECT set_config('a.b', $1, $2)");
+	pins("select pg_catalog.set_config('x', (select 'y'), false)");
+	pins("select set_config('x', set_config('y', 'z', false), true)");
+	pins("SELECT * INTO TEMP t FROM users");
+	pins("select * into local temporary table t from users");
+	pins("with x as (select 1) select * into temp t from x");
+	nopin("");
+	nopin("SELECT 1");
+	nopin("SET LOCAL search_path TO app");
+	nopin("set transaction read only");
+	nopin("SET CONSTRAINTS ALL DEFERRED");
+	nopin("PREPARE TRANSACTION 'tx1'");
+	nopin("create table t (a int)");
+	nopin("DECLARE c CURSOR FOR SELECT 1");
+	nopin("declare c cursor without hold for with x as (select 1) select * from x");
+	nopin("select pg_advisory_xact_lock(1)");
+	nopin("select 'pg_advisory_lock(1)'");
+	nopin("select pg_advisory_lock from t");
+	nopin("select set_config('search_path', 'app', true)");
+	nopin("select set_config('x', set_config('y', 'z', true), true)");
+	nopin("select * into t from users");
+	nopin("insert into temp values (1)");
+	nopin("-- set x = 1\nselect 1");
+	nopin("select 'set x = 1'");
+	nopin("do $$ begin set search_path to app; end $$");
+
+	/* sharing a connection */
+	alone("SELECT 1");
+	alone("insert into t values (1);");
+	alone("/* app */ update t set x = 1");
+	alone("(select 1)");
+	shared_not("");
+	shared_not("BEGIN");
+	shared_not("/* app */ SET search_path TO app");
+	shared_not("-- hi\nreset all");
+	shared_not("/**/ deallocate q");
+	shared_not("select set_config('x', 'y', false)");
+	shared_not("select pg_advisory_lock(1)");
+	shared_not("select * into temp t from users");
+	shared_not("insert into t values (1); select 1");
+	shared_not("select 1; begin");
+	shared_not("copy t from stdin");
+
+	/* deallocation */
+	deallocates("DEALLOCATE q", "q");
+	deallocates("deallocate prepare S_1", "s_1");
+	deallocates("/* orm */ DEALLOCATE \"S_1\"", "S_1");
+	deallocates("-- bye\ndeallocate \"a\"\"b\"", "a\"b");
+	deallocates("select 1; deallocate q;", "q");
+	deallocates_all("DEALLOCATE ALL");
+	deallocates_all("/* pool */ deallocate prepare all");
+	deallocates_all("-- reset\nDISCARD ALL");
+	doesnt_deallocate("");
+	doesnt_deallocate("select 'deallocate q'");
+	doesnt_deallocate("-- deallocate q\nselect 1");
+	doesnt_deallocate("DISCARD PLANS");
+	doesnt_deallocate("discard temp");
+	doesnt_deallocate("do $$ begin deallocate q; end $$");
+
+	listens("LISTEN foo", "foo");
+	listens("  listen Foo;", "foo");
+	listens("/* x */ LISTEN foo", "foo");
+	listens("-- c\nLISTEN foo", "foo");
+	listens("listen /* in between */ foo ;;", "foo");
+	listens("LISTEN \"Foo Bar\"", "Foo Bar");
+	listens("LISTEN \"a\"\"b\"", "a\"b");
+	unlistens("UNLISTEN foo", "foo");
+	unlistens("-- done\nunlisten \"Foo\";", "Foo");
+	unlistens_all("UNLISTEN *");
+	unlistens_all("/* all */ unlisten * ;");
+	doesnt_listen("");
+	doesnt_listen("LISTEN");
+	doesnt_listen("LISTEN \"\"");
+	doesnt_listen("UNLISTEN");
+	doesnt_listen("LISTEN *");
+	doesnt_listen("LISTEN foo; SELECT 1");
+	doesnt_listen("SELECT 1; LISTEN foo");
+	doesnt_listen("LISTEN foo; LISTEN bar");
+	doesnt_listen("-- LISTEN foo\nSELECT 1");
+	doesnt_listen("SELECT 'LISTEN foo'");
+	doesnt_listen("listening");
+	{
+		const char *sql = "deallocate a; select 1; /* x */ deallocate b; discard all";
+		char buf[64];
+
+		so("deallocate a; ...", pgr_sql_deallocates(&sql, buf, sizeof(buf)) == SQL_DEALLOCATE && strcmp(buf, "a") == 0, "deallocation of `a`");
+		so("... deallocate b; ...", pgr_sql_deallocates(&sql, buf, sizeof(buf)) == SQL_DEALLOCATE && strcmp(buf, "b") == 0, "deallocation of `b`");
+		so("... discard all", pgr_sql_deallocates(&sql, buf, sizeof(buf)) == SQL_DEALLOCATE_ALL, "deallocation of everything");
+		so("(the end)", pgr_sql_deallocates(&sql, buf, sizeof(buf)) == 0, "non-deallocation");
+		sql = "deallocate a_very_long_name";
+		so("deallocate a_very_long_name, into 8 bytes", pgr_sql_deallocates(&sql, buf, 8) == SQL_DEALLOCATE && strcmp(buf, "a_very_") == 0, "truncated name");
+	}
+
+	/* fingerprints */
+	same("select * from users where id = 42",
+	     "SELECT *\n  FROM users -- by id\n WHERE id = 17");
+	same("select * from users where name = 'bob'",
+	     "select * from users where name = E'o\\'brien'");
+	same("select $$x$$, 1.5", "select 'y', 42");
+	same("/* hi */ insert into t values (1, 'a')", "insert into t values (2, 'b')");
+	differ("select * from users where id = 42", "select * from users where uid = 42");
+	differ("select * from users", "select * from \"USERS\"");
+	differ("select * from \"users\"", "select * from \"Users\"");
+	differ("select 1", "select 1; select 1");
+	differ("select a from b", "select ab");
+	so("fingerprint of empty string", pgr_sql_fingerprint("") != 0, "non-zero");
+
+	fprintf(stderr, "ALL TESTS PASSED\n");
+	return 0;
+}
+#endif
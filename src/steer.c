@@ -0,0 +1,147 @@
+/*
+  Copyright (c) 2016 James Hunt
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+ */
+
+#include "pgrouter.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/bpf.h>
+
+#ifndef SO_ATTACH_REUSEPORT_EBPF
+#define SO_ATTACH_REUSEPORT_EBPF 52
+#endif
+
+/*
+   When every WORKER has its own SO_REUSEPORT listening socket,
+   the kernel hashes inbound connections across them.  That's
+   fair, but blind: a worker that's already drowning in long-
+   lived sessions gets just as many new ones as an idle one.
+
+   To do better, we attach a tiny eBPF program to each reuseport
+   group.  It looks up the index of the least-loaded worker in a
+   single-element array map (which the workers keep up-to-date as
+   sessions come and go) and returns that as the socket to use.
+   If the lookup fails, it returns an out-of-range index, and the
+   kernel falls back to its usual hashing.
+
+   Since socket i in the group was the i-th to listen(), and main
+   binds them in worker order, socket index == worker id.
+ */
+
+static int bpf(int cmd, union bpf_attr *attr)
+{
+	return syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+#define INSN(c,d,s,o,i) ((struct bpf_insn){ .code = (c), .dst_reg = (d), .src_reg = (s), .off = (o), .imm = (i) })
+
+int pgr_steer_map(void)
+{
+	union bpf_attr attr;
+	int fd;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.map_type    = BPF_MAP_TYPE_ARRAY;
+	attr.key_size    = sizeof(uint32_t);
+	attr.value_size  = sizeof(uint32_t);
+	attr.max_entries = 1;
+
+	fd = bpf(BPF_MAP_CREATE, &attr);
+	if (fd < 0) {
+		pgr_logf(stderr, LOG_ERR, "[steer] failed to create BPF map: %s (errno %d)",
+				strerror(errno), errno);
+		return -1;
+	}
+	return fd;
+}
+
+int pgr_steer(int map, int fd)
+{
+	union bpf_attr attr;
+	int prog, rc;
+	char log[512];
+
+	struct bpf_insn insns[] = {
+		/* key = 0 */
+		INSN(BPF_ST  | BPF_MEM | BPF_W,     BPF_REG_10, 0, -4, 0),
+		INSN(BPF_ALU64 | BPF_MOV | BPF_X,   BPF_REG_2, BPF_REG_10, 0, 0),
+		INSN(BPF_ALU64 | BPF_ADD | BPF_K,   BPF_REG_2, 0, 0, -4),
+
+		/* r0 = bpf_map_lookup_elem(map, &key) */
+		INSN(BPF_LD  | BPF_DW  | BPF_IMM,   BPF_REG_1, BPF_PSEUDO_MAP_FD, 0, map),
+		INSN(0, 0, 0, 0, 0),
+		INSN(BPF_JMP | BPF_CALL,            0, 0, 0, BPF_FUNC_map_lookup_elem),
+
+		/* if (r0) return *r0 */
+		INSN(BPF_JMP | BPF_JEQ | BPF_K,     BPF_REG_0, 0, 2, 0),
+		INSN(BPF_LDX | BPF_MEM | BPF_W,     BPF_REG_0, BPF_REG_0, 0, 0),
+		INSN(BPF_JMP | BPF_EXIT,            0, 0, 0, 0),
+
+		/* else return ~0 (let the kernel hash) */
+		INSN(BPF_ALU | BPF_MOV | BPF_K,     BPF_REG_0, 0, 0, -1),
+		INSN(BPF_JMP | BPF_EXIT,            0, 0, 0, 0),
+	};
+
+	memset(log, 0, sizeof(log));
+	memset(&attr, 0, sizeof(attr));
+	attr.prog_type = BPF_PROG_TYPE_SOCKET_FILTER;
+	attr.insns     = (uint64_t)(uintptr_t)insns;
+	attr.insn_cnt  = sizeof(insns) / sizeof(insns[0]);
+	attr.license   = (uint64_t)(uintptr_t)"GPL";
+	attr.log_buf   = (uint64_t)(uintptr_t)log;
+	attr.log_size  = sizeof(log);
+	attr.log_level = 1;
+
+	prog = bpf(BPF_PROG_LOAD, &attr);
+	if (prog < 0) {
+		pgr_logf(stderr, LOG_ERR, "[steer] failed to load BPF steering program: %s (errno %d)",
+				strerror(errno), errno);
+		if (log[0]) {
+			pgr_debugf("verifier said: %s", log);
+		}
+		return -1;
+	}
+
+	rc = setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_EBPF, &prog, sizeof(prog));
+	if (rc != 0) {
+		pgr_logf(stderr, LOG_ERR, "[steer] failed to attach BPF steering program to fd %d: %s (errno %d)",
+				fd, strerror(errno), errno);
+	}
+
+	/* the socket holds its own reference to the program */
+	close(prog);
+	return rc;
+}
+
+int pgr_steer_to(int map, int worker)
+{
+	union bpf_attr attr;
+	uint32_t key = 0, value = worker;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.map_fd = map;
+	attr.key    = (uint64_t)(uintptr_t)&key;
+	attr.value  = (uint64_t)(uintptr_t)&value;
+	attr.flags  = BPF_ANY;
+
+	if (bpf(BPF_MAP_UPDATE_ELEM, &attr) != 0) {
+		pgr_debugf("failed to steer connections to worker %d: %s (errno %d)",
+				worker, strerror(errno), errno);
+		return -1;
+	}
+	return 0;
+}
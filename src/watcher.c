@@ -28,7 +28,8 @@ typedef struct {
 
 	int ok;             /* is the backend is accepting connections?    */
 	int role;           /* is the backend the write master or a slave? */
-	lag_t pos;          /* xlog position for this backend (absolute)   */
+	lag_t pos;          /* xlog position (replayed, if a slave)        */
+	int version;        /* server_version_num, as libpq reports it     */
 
 	char endpoint[256]; /* "<host>:<port>" string, for diagnostics     */
 	char userdb[256];   /* "<user>@<database>" string, for diagnostics */
@@ -38,45 +39,142 @@ typedef struct {
 static int NUM_BACKENDS; /* how many backends are there?               */
 static HEALTH *BACKENDS; /* health information, cached for speed       */
 
-static int xlog(const char *s, lag_t *lag)
+/* Parse an xlog position (as in "16/B374D848") from `s`,
+   into `pos`, as a single 64-bit offset.  Returns non-zero
+   (having logged why) if it isn't one. */
+int pgr_xlog(const char *s, lag_t *pos)
 {
 	const char *p;
-	lag_t hi = 0, lo = 0;
+	lag_t hi = 0, lo = 0, *x;
 
 	pgr_debugf("parsing xlog value '%s'", s);
-	for (p = s; *p && *p != '/'; p++) {
-		if (*p >= '0' || *p <= '9') {
-			hi = hi * 0xf + (*p - '0');
-		} else if (*p >= 'a' || *p <= 'f') {
-			hi = hi * 0xf + (*p - 'a');
-		} else if (*p >= 'A' || *p <= 'F') {
-			hi = hi * 0xf + (*p - 'A');
+	for (x = &hi, p = s; *p; p++) {
+		if (*p == '/' && x == &hi && p != s) {
+			x = &lo;
+		} else if (*p >= '0' && *p <= '9') {
+			*x = *x * 16 + (*p - '0');
+		} else if (*p >= 'a' && *p <= 'f') {
+			*x = *x * 16 + (*p - 'a' + 10);
+		} else if (*p >= 'A' && *p <= 'F') {
+			*x = *x * 16 + (*p - 'A' + 10);
 		} else {
 			pgr_logf(stderr, LOG_ERR, "[watcher] invalid character '%c' found in xlog value %s", *p, s);
 			return 1;
 		}
 	}
 
-	if (*p != '/') {
+	if (x != &lo || p[-1] == '/') {
 		pgr_logf(stderr, LOG_ERR, "[watcher] malformed xlog value %s", s);
 		return 1;
 	}
 
-	for (p++; *p; p++) {
-		if (*p >= '0' || *p <= '9') {
-			lo = lo * 0xf + (*p - '0');
-		} else if (*p >= 'a' || *p <= 'f') {
-			lo = lo * 0xf + (*p - 'a');
-		} else if (*p >= 'A' || *p <= 'F') {
-			lo = lo * 0xf + (*p - 'A');
-		} else {
-			pgr_logf(stderr, LOG_ERR, "[watcher] invalid character '%c' found in xlog value %s", *p, s);
-			return 1;
+	*pos = (hi << 32) | lo;
+	return 0;
+}
+
+/* The query that asks a backend where its xlog is at: how
+   far it has written, if it's the master, or how far it
+   has replayed, if it's a slave.  Version 10 renamed the
+   functions (xlog to wal, location to lsn); `version` is
+   the backend's server_version_num, or 0 if we don't know
+   it yet, in which case we go with the new names (and say
+   so, the first time). */
+const char* pgr_xlog_query(int version, int role)
+{
+	static int warned = 0;
+
+	if (version <= 0) {
+		if (!warned) {
+			warned = 1;
+			pgr_logf(stderr, LOG_WARNING, "[watcher] unable to determine the server version of a backend; "
+					"assuming PostgreSQL 10 or later, for xlog positions");
 		}
+		version = 100000;
 	}
 
-	*lag = (hi << 32) | lo;
-	return 0;
+	if (role == BACKEND_ROLE_MASTER) {
+		return version >= 100000 ? "SELECT pg_current_wal_lsn()"
+		                         : "SELECT pg_current_xlog_location()";
+	}
+	return version >= 100000 ? "SELECT pg_last_wal_replay_lsn()"
+	                         : "SELECT pg_last_xlog_replay_location()";
+}
+
+/* How often (in seconds) we reload the master's list of
+   volatile functions, for the query classifier. */
+#define FUNCTIONS_INTERVAL 60
+
+/* Load the names of all the user-defined functions that the
+   master says are volatile (i.e. that might write), and if
+   they have changed, swap them in for the workers to use
+   (see pgr_sql_classify).  Anything the query cache decided
+   with the old list in hand gets forgotten; a worker still
+   classifying with it will be caching a verdict from an
+   older generation, which pgr_qcache_get then ignores. */
+static void load_functions(CONTEXT *c, PGconn *conn, const char *endpoint)
+{
+	PGresult *result;
+	FUNCSET *set, *old;
+	uint64_t sum;
+	const char *name;
+	int i, n;
+
+	const char *sql = "SELECT DISTINCT p.proname FROM pg_proc p"
+	                  " JOIN pg_namespace n ON n.oid = p.pronamespace"
+	                  " WHERE p.provolatile = 'v'"
+	                  " AND n.nspname NOT IN ('pg_catalog', 'information_schema')"
+	                  " ORDER BY 1";
+
+	result = PQexec(conn, sql);
+	if (!result) {
+		pgr_logf(stderr, LOG_ERR, "[watcher] failed to allocate memory for result of `%s` query", sql);
+		pgr_abort(ABORT_MEMFAIL);
+	}
+	if (PQresultStatus(result) != PGRES_TUPLES_OK || PQnfields(result) != 1) {
+		pgr_logf(stderr, LOG_ERR, "[watcher] got an unexpected %s from %s backend, in response to `%s` query",
+				PQresStatus(PQresultStatus(result)), endpoint, sql);
+		PQclear(result);
+		return;
+	}
+
+	/* (64-bit FNV-1a, over all of the names, in order) */
+	sum = 0xcbf29ce484222325ULL;
+	n = PQntuples(result);
+	for (i = 0; i < n; i++) {
+		for (name = PQgetvalue(result, i, 0); ; name++) {
+			sum = (sum ^ (unsigned char)*name) * 0x100000001b3ULL;
+			if (!*name) {
+				break;
+			}
+		}
+	}
+
+	rdlock(&c->functions.lock, "functions", 0);
+	if (c->functions.writers && c->functions.checksum == sum) {
+		unlock(&c->functions.lock, "functions", 0);
+		pgr_debugf("volatile functions on %s backend have not changed", endpoint);
+		PQclear(result);
+		return;
+	}
+	unlock(&c->functions.lock, "functions", 0);
+
+	set = pgr_funcset_new(n);
+	for (i = 0; i < n; i++) {
+		pgr_funcset_add(set, PQgetvalue(result, i, 0));
+	}
+	PQclear(result);
+
+	wrlock(&c->functions.lock, "functions", 0);
+	old = c->functions.writers;
+	c->functions.writers  = set;
+	c->functions.checksum = sum;
+	c->functions.generation++;
+	unlock(&c->functions.lock, "functions", 0);
+
+	pgr_funcset_free(old);
+	pgr_qcache_flush(c);
+	pgr_logf(stderr, LOG_INFO, "[watcher] loaded %d volatile function names from %s backend",
+			set->n, endpoint);
 }
 
 static void* do_watcher(void *_c)
@@ -175,7 +273,7 @@ static void* do_watcher(void *_c)
 		unlock(&c->lock, "context", 0);
 
 		/* now, loop over the backends and gather our health data */
-		int master_pos;
+		lag_t master_pos = 0;
 		for (i = 0; i < NUM_BACKENDS; i++) {
 			BACKENDS[i].ok   = BACKEND_IS_FAILED;
 			BACKENDS[i].pos  = 0;
@@ -200,6 +298,7 @@ static void* do_watcher(void *_c)
 			case CONNECTION_OK:
 				pgr_logf(stderr, LOG_INFO, "[watcher] connected to %s backend",
 					BACKENDS[i].endpoint);
+				BACKENDS[i].version = PQserverVersion(conn);
 
 				/* determine if master or slave `SELECT pg_is_in_recovery()` */
 				PGresult *result;
@@ -242,11 +341,7 @@ static void* do_watcher(void *_c)
 				PQclear(result);
 
 				/* determine xlog position */
-				if (BACKENDS[i].role == BACKEND_ROLE_MASTER) {
-					sql = "SELECT pg_current_xlog_location()";
-				} else {
-					sql = "SELECT pg_last_xlog_receive_location()";
-				}
+				sql = pgr_xlog_query(BACKENDS[i].version, BACKENDS[i].role);
 				result = PQexec(conn, sql);
 				if (!result) {
 					pgr_logf(stderr, LOG_ERR, "[watcher] failed to allocate memory for result of `%s` query", sql);
@@ -281,7 +376,7 @@ static void* do_watcher(void *_c)
 				val = PQgetvalue(result, 0, 0);
 				pgr_logf(stderr, LOG_INFO, "backend %s returned '%s' for `%s`",
 						BACKENDS[i].endpoint, val, sql);
-				rc = xlog(val, &BACKENDS[i].pos);
+				rc = pgr_xlog(val, &BACKENDS[i].pos);
 				if (rc != 0) {
 					PQclear(result);
 					break;
@@ -290,6 +385,11 @@ static void* do_watcher(void *_c)
 				/* keep track of our master position for lag calculations */
 				if (BACKENDS[i].role == BACKEND_ROLE_MASTER) {
 					master_pos = BACKENDS[i].pos;
+
+					if (time(NULL) - c->functions.loaded >= FUNCTIONS_INTERVAL) {
+						load_functions(c, conn, BACKENDS[i].endpoint);
+						c->functions.loaded = time(NULL);
+					}
 				}
 
 				BACKENDS[i].ok = BACKEND_IS_OK;
@@ -346,8 +446,11 @@ static void* do_watcher(void *_c)
 			}
 			c->backends[i].status = BACKENDS[i].ok;
 			c->backends[i].role = BACKENDS[i].role;
-			c->backends[i].health.lag = master_pos - BACKENDS[i].pos;
-			pgr_logf(stderr, LOG_INFO, "[watcher] updated %s (%d) backend/%d with status %d (%s) and lag %d (%d/%d)",
+			c->backends[i].health.pos = BACKENDS[i].pos;
+			c->backends[i].health.version = BACKENDS[i].version;
+			/* (a slave checked after the master may be ahead of it) */
+			c->backends[i].health.lag = master_pos > BACKENDS[i].pos ? master_pos - BACKENDS[i].pos : 0;
+			pgr_logf(stderr, LOG_INFO, "[watcher] updated %s (%d) backend/%d with status %d (%s) and lag %llu (%llu/%llu)",
 					pgr_backend_role(c->backends[i].role), c->backends[i].role,
 					i, c->backends[i].status, pgr_backend_status(c->backends[i].status),
 					c->backends[i].health.lag, BACKENDS[i].pos, master_pos);
@@ -369,6 +472,25 @@ static void* do_watcher(void *_c)
 	return NULL;
 }
 
+/* The housekeeper looks after the backend connection pools,
+   getting rid of old, idle and broken connections before
+   a client can trip over them.  See pgr_pool_sweep(). */
+#define HOUSEKEEPING_INTERVAL 5
+
+static void* do_housekeeper(void *_c)
+{
+	CONTEXT *c = (CONTEXT*)_c;
+
+	for (;;) {
+		sleep(HOUSEKEEPING_INTERVAL);
+
+		pgr_debugf("sweeping backend connection pools");
+		pgr_pool_sweep(c);
+	}
+
+	return NULL;
+}
+
 int pgr_watcher(CONTEXT *c, pthread_t *tid)
 {
 	int rc = pthread_create(tid, NULL, do_watcher, c);
@@ -381,3 +503,16 @@ int pgr_watcher(CONTEXT *c, pthread_t *tid)
 	pgr_logf(stderr, LOG_INFO, "[watcher] spinning up [tid=%i]", *tid);
 	return 0;
 }
+
+int pgr_housekeeper(CONTEXT *c, pthread_t *tid)
+{
+	int rc = pthread_create(tid, NULL, do_housekeeper, c);
+	if (rc != 0) {
+		pgr_logf(stderr, LOG_ERR, "[watcher] failed to spin up housekeeper: %s (errno %d)",
+				strerror(errno), errno);
+		return 1;
+	}
+
+	pgr_logf(stderr, LOG_INFO, "[watcher] spinning up housekeeper [tid=%i]", *tid);
+	return 0;
+}
@@ -16,14 +16,156 @@
 #include <assert.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
 #include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
 #include <netinet/in.h>
+#include <arpa/inet.h>
 #include <pthread.h>
 
 #define SUBSYS "worker"
 #include "locks.inc.c"
 
-#define max(a,b) ((a) > (b) ? (a) : (b))
+#define MAX_EVENTS 256
+#define QUEUE_POLL_MS 10  /* how often to retry waiting sessions */
+
+/* States of a client session */
+#define SESSION_STARTUP  0  /* authenticating the frontend         */
+#define SESSION_CONNECT  1  /* waiting for backends to be ready    */
+#define SESSION_FRONTEND 2  /* forwarding frontend messages        */
+#define SESSION_BACKEND  3  /* relaying backend replies            */
+#define SESSION_COPYIN   4  /* relaying COPY data to the backend   */
+#define SESSION_DRAIN    5  /* discarding a misrouted reply        */
+#define SESSION_RESEND   6  /* (re)playing the batch to a backend  */
+#define SESSION_CLOSED   7  /* done; waiting to be freed           */
+#define SESSION_PIPED    8  /* batch handed off to a pipeline      */
+#define SESSION_PIPE     9  /* (not a client; a pipeline, see pump) */
+#define SESSION_LISTENING 10 /* waiting on the master to LISTEN    */
+#define SESSION_LISTENER 11 /* (not a client; a listener, see hear) */
+#define SESSION_PREPARE  12 /* re-preparing statements (see reprepare) */
+#define SESSION_LSN      13 /* asking where the master is (see locate) */
+#define SESSION_CANCEL   14 /* forwarding a CancelRequest (see pgr_cancel) */
+
+typedef struct __session SESSION;
+typedef struct __piped PIPED;
+typedef struct __channel CHANNEL;
+typedef struct __sub SUB;
+typedef struct __ack ACK;
+typedef struct __stmt STMT;
+
+/* A batch in line on a pipeline (see pump). */
+struct __piped {
+	SESSION *session;           /* whose it is (NULL if gone)   */
+	int sent;                   /* has it all been written?     */
+	PIPED *next;
+};
+
+/* A channel that a listener is LISTENing on (see hear). */
+struct __channel {
+	char *name;                 /* channel name, as postgres has it */
+	int live;                   /* has the master said LISTEN?  */
+	SUB *subs;                  /* who wants to know about it   */
+	CHANNEL *next;
+};
+
+struct __sub {
+	SESSION *session;
+	SUB *next;
+};
+
+/* A (UN)LISTEN that a listener is waiting to hear back on. */
+struct __ack {
+	SESSION *session;           /* who's waiting (if anyone)    */
+	CHANNEL *channel;           /* what it's for (if a LISTEN)  */
+	int failed;                 /* did we get an error?         */
+	ACK *next;
+};
+
+/* A prepared statement, as a client sees it, or (in a
+   batch's list) what the batch does with one. */
+struct __stmt {
+	char *name;
+	char *parse;                /* body of its Parse message    */
+	unsigned int len;           /* (octets of the above)        */
+	uint64_t hash;              /* see digest                   */
+	char op;                    /* (batch) a STMT_* constant    */
+	STMT *next;
+};
+
+struct __session {
+	int state;                  /* a SESSION_* constant         */
+	char type;                  /* type of message in flight    */
+	int in_txn;                 /* in a transaction (per Z)?    */
+	int pooling;                /* a POOL_* constant            */
+	CONNECTION *backend;        /* backend we're talking to     */
+	double started;             /* when the client connected    */
+
+	CONNECTION frontend;        /* the client                   */
+	CONNECTION reader;          /* the read slave               */
+	CONNECTION writer;          /* the write master             */
+
+	MBUF *fe;                   /* frontend -> backend          */
+	MBUF *be;                   /* backend -> frontend          */
+
+	struct {
+		CONNECTION *conn;       /* where cancels go now, and    */
+		uint32_t pid;           /* which connection that was    */
+	} aim;
+
+	int batch;                  /* messages since the last 'Z'  */
+	int pipeable;               /* could the batch be piped?    */
+	int pinned;                 /* keep our backend connections? */
+	int holding;                /* keeping the batch, for now?  */
+	int streaming;              /* sending it as it comes in?   */
+	int queries;                /* classified in the batch      */
+	int opens;                  /* SQL_BEGIN*, if the batch does */
+	int writes;                 /* might the batch write?       */
+	int rw;                     /* in a read-write transaction? */
+	lag_t lsn;                  /* master's, as of our last write */
+	int wrote;                  /* and since then? (see SESSION_LSN) */
+	uint64_t fingerprint;       /* of the batch's query, if any */
+	unsigned int generation;    /* (of functions, when seen)    */
+	STMT *statements;           /* prepared, per the client     */
+	STMT *touched;              /* by the batch, in order       */
+	MBUF *prep;                 /* our own messages (see reprepare) */
+	int prepped;                /* has the batch been seen to?  */
+	int deallocs;               /* does it DEALLOCATE any?      */
+	struct {
+		SESSION *pipe;          /* (client) pipeline we're on   */
+		PIPED *entry;           /* (client) our place in line   */
+		char *key;              /* (pipe) pool key of the conn. */
+		PIPED *queue;           /* (pipe) batches, oldest first */
+		SESSION *next;          /* (pipe) for the worker's list */
+	} pipeline;
+
+	struct {
+		SESSION *on;            /* (client) our listener        */
+		CHANNEL *channels;      /* (listener) what it hears     */
+		ACK *acks;              /* (listener) replies owed      */
+	} listener;
+	MBUF *notes;                /* notifications, to be sent    */
+
+	double deadline;            /* for backends starting up     */
+	int queued;                 /* to be stepped on the tick?   */
+	SESSION *qnext;             /* for the list of the waiting  */
+	SESSION *next;              /* for the list of the dead     */
+};
+
+typedef struct {
+	CONTEXT *context;           /* the global context           */
+	int id;                     /* which worker are we?         */
+	int epfd;                   /* epoll instance of the worker */
+	int listen[2];              /* frontend sockets (v4 / v6)   */
+	int sessions;               /* how many sessions we drive   */
+	SESSION *queued;            /* sessions waiting on limits   */
+	SESSION *pipes;             /* pipelines to the writer(s)   */
+	SESSION *listeners;         /* LISTENers on the writer(s)   */
+	SESSION *dead;              /* closed sessions, to be freed */
+} WORKER;
 
 static double time_ms()
 {
@@ -52,6 +194,9 @@ static struct {
 #define TIMER(m) for (WATCH.start = time_ms(), WATCH.x = 0; WATCH.x != 1; WATCH.end = time_ms(), WATCH.x = 1, dump_timer((m), WATCH.start, WATCH.end))
 
 
+/* Pick a reader (at random, weighted, from the healthy
+   slaves) and the writer (the master).  If writer is NULL,
+   only a new reader is picked. */
 static int determine_backends(CONTEXT *c, CONNECTION *reader, CONNECTION *writer)
 {
 	int rc, i;
@@ -70,6 +215,11 @@ static int determine_backends(CONTEXT *c, CONNECTION *reader, CONNECTION *writer
 		rdlock(&c->backends[i].lock, "backend", i);
 
 		if (c->backends[i].role == BACKEND_ROLE_MASTER) {
+			if (!writer) {
+				unlock(&c->backends[i].lock, "backend", i);
+				continue;
+			}
+			free(writer->hostname);
 			writer->serial   = c->backends[i].serial;
 			writer->index    = i;
 			writer->hostname = strdup(c->backends[i].hostname);
@@ -99,14 +249,20 @@ static int determine_backends(CONTEXT *c, CONNECTION *reader, CONNECTION *writer
 		if (r <= weights[i]) {
 			rdlock(&c->backends[i].lock, "backend", i);
 
+			free(reader->hostname);
 			reader->serial   = c->backends[i].serial;
 			reader->index    = i;
 			reader->hostname = strdup(c->backends[i].hostname);
 			reader->port     = c->backends[i].port;
 			reader->timeout  = c->health.timeout * 1000;
 
-			pgr_logf(stderr, LOG_INFO, "[worker] using backend %d, %s:%d (serial %d)",
-					reader->index, reader->hostname, reader->port, reader->serial);
+			if (writer) {
+				pgr_logf(stderr, LOG_INFO, "[worker] using backend %d, %s:%d (serial %d)",
+						reader->index, reader->hostname, reader->port, reader->serial);
+			} else {
+				pgr_debugf("using backend %d, %s:%d (serial %d)",
+						reader->index, reader->hostname, reader->port, reader->serial);
+			}
 
 			unlock(&c->backends[i].lock, "backend", i);
 			unlock(&c->lock, "context", 0);
@@ -120,234 +276,2383 @@ static int determine_backends(CONTEXT *c, CONNECTION *reader, CONNECTION *writer
 	return -1;
 }
 
-static void handle_client(CONTEXT *c, int fd)
+static int nonblocking(int fd)
 {
-	CONNECTION frontend, reader, writer;
-	int rc, befd, in_txn, len;
-	char type;
-	MBUF *fe, *be;
+	int flags = fcntl(fd, F_GETFL);
+	if (flags < 0) {
+		return -1;
+	}
+	return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
 
-	fe = pgr_mbuf_new(16384);
-	be = pgr_mbuf_new(4096);
+/* Register a descriptor with the epoll instance of the
+   worker.  Session descriptors are edge-triggered, for
+   both reads and writes; we only ever wait on one after
+   it has told us (via EAGAIN) that it isn't ready. */
+static int watch(WORKER *w, int fd, SESSION *s)
+{
+	struct epoll_event ev;
 
-	pgr_conn_init(c, &frontend);
-	pgr_conn_init(c, &reader);
-	pgr_conn_init(c, &writer);
+	memset(&ev, 0, sizeof(ev));
+	if (s) {
+		ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+		ev.data.ptr = s;
+	} else {
+		/* only wake one of the workers sharing a listener */
+		ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+		ev.data.ptr = w;
+	}
 
-	pgr_conn_frontend(&frontend, fd);
+	if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+		pgr_logf(stderr, LOG_ERR, "[worker] failed to watch fd %d: %s (errno %d)",
+				fd, strerror(errno), errno);
+		return -1;
+	}
+	return 0;
+}
 
-	if (pgr_conn_accept(&frontend)              != 0 ||
-	    determine_backends(c, &reader, &writer) != 0 ||
-	    pgr_conn_copy(&reader, &frontend)       != 0 ||
-	    pgr_conn_copy(&writer, &frontend)       != 0 ||
-	    pgr_conn_connect(&reader)               != 0 ||
-	    pgr_conn_connect(&writer)               != 0) {
-		goto shutdown;
+static void unwatch(WORKER *w, int fd)
+{
+	if (epoll_ctl(w->epfd, EPOLL_CTL_DEL, fd, NULL) != 0) {
+		pgr_logf(stderr, LOG_ERR, "[worker] failed to unwatch fd %d: %s (errno %d)",
+				fd, strerror(errno), errno);
 	}
+}
 
-	pgr_mbuf_setfd(fe, fd, MBUF_NO_FD);
-	pgr_mbuf_setfd(be, MBUF_NO_FD, fd);
+/* Keep track of how many client sessions each worker is
+   driving, and (if BPF steering is enabled) point new
+   connections at whoever is the least busy. */
+static void account(WORKER *w, int delta)
+{
+	CONTEXT *c = w->context;
+	int i, least;
 
-	in_txn = 0;
-	for (;;) {
-		if (!in_txn) {
-			befd = reader.fd;
-		}
+	w->sessions += delta;
 
-		pgr_mbuf_setfd(fe, MBUF_SAME_FD, befd);
-		pgr_mbuf_setfd(be, befd, MBUF_SAME_FD);
+	wrlock(&c->lock, "context", 0);
+	c->fe_conns += delta;
+	if (delta > 0) {
+		c->pool.arrivals += delta;
+	}
+
+	if (c->steering.map >= 0 && w->id < c->steering.n) {
+		c->steering.load[w->id] = w->sessions;
 
-		do {
-			pgr_debugf("reading message from frontend");
-			rc = pgr_mbuf_recv(fe);
-			if (rc < 0) {
-				goto shutdown;
+		least = c->steering.target;
+		for (i = 0; i < c->steering.n; i++) {
+			if (c->steering.load[i] < c->steering.load[least]) {
+				least = i;
 			}
+		}
+		if (least != c->steering.target && pgr_steer_to(c->steering.map, least) == 0) {
+			c->steering.target = least;
+		}
+	}
+	unlock(&c->lock, "context", 0);
+}
 
-			type = pgr_mbuf_msgtype(fe);
-			len  = pgr_mbuf_msglength(fe);
+static SESSION* new_session(WORKER *w, int fd)
+{
+	SESSION *s = calloc(1, sizeof(SESSION));
+	if (!s) {
+		pgr_abort(ABORT_MEMFAIL);
+	}
 
-			if (type == 'Q') {
-				char *query;
-				query = pgr_mbuf_data(fe, 0, 5);
-				if (query && strncasecmp(query, "begin", 5) == 0) {
-					in_txn = 1;
-					befd = writer.fd; /* force transactions to writer */
-					pgr_mbuf_setfd(fe, MBUF_SAME_FD, writer.fd);
-				}
+	s->state   = SESSION_STARTUP;
+	s->started = time_ms();
 
-				query = pgr_mbuf_data(fe, 0, 6);
-				if (query && strncasecmp(query, "commit", 6) == 0) {
-					in_txn = 0;
-				}
-			}
+	s->fe = pgr_mbuf_new(16384);
+	s->be = pgr_mbuf_new(4096);
 
-			pgr_debugf("sending message to %s (fd %d)",
-					befd == reader.fd ? "reader" : "writer", befd);
-			rc = pgr_mbuf_send(fe);
-			if (rc != 0) {
-				goto shutdown;
-			}
+	/* stage our writes, so that a whole batch of messages
+	   (i.e. a result set) goes out in one system call. */
+	pgr_mbuf_cork(s->fe, 4096);
+	pgr_mbuf_cork(s->be, 8192);
 
-			if (type == 'X') {
-				pgr_sendn(reader.fd, "X\0\0\0\x4", 5);
-				pgr_sendn(writer.fd, "X\0\0\0\x4", 5);
-				goto shutdown;
-			}
-		} while (type != 'Q' && type != 'S');
+	pgr_conn_init(w->context, &s->frontend);
+	pgr_conn_init(w->context, &s->reader);
+	pgr_conn_init(w->context, &s->writer);
 
-		do {
-again:
-			pgr_debugf("reading message from %s (fd %d)",
-					befd == reader.fd ? "reader" : "writer", befd);
-			rc = pgr_mbuf_recv(be);
-			if (rc < 0) {
-				goto shutdown;
-			}
+	pgr_conn_frontend(&s->frontend, fd);
+	pgr_cancel_register(w->context, &s->frontend.greeting.pid, &s->frontend.greeting.key);
+	pgr_mbuf_setfd(s->fe, fd, MBUF_NO_FD);
+	pgr_mbuf_setfd(s->be, MBUF_NO_FD, fd);
 
-			type = pgr_mbuf_msgtype(be);
+	rdlock(&w->context->lock, "context", 0);
+	s->pooling = w->context->pool.mode;
+	unlock(&w->context->lock, "context", 0);
 
-			if (pgr_mbuf_iserror(be, "25006") == 0 && befd == reader.fd) {
-				pgr_debugf("E25006 bad routing - ignoring remaining backend messages...");
-				pgr_mbuf_drain(be, 'Z');
+	account(w, 1);
+	return s;
+}
 
-				befd = writer.fd;
-				pgr_mbuf_setfd(fe, MBUF_SAME_FD, befd);
-				pgr_mbuf_setfd(be, befd, MBUF_SAME_FD);
-				pgr_debugf("resending saved messages to writer (fd %d)", befd);
-				pgr_mbuf_resend(fe);
-				pgr_mbuf_reset(fe);
-				goto again;
-			}
+static void unpipe(WORKER *w, SESSION *s);
+static void unlisten(WORKER *w, SESSION *s);
+static void stmts_free(STMT *st);
 
-			/* handle CopyInResponse by switching to sub-protocol */
-			if (type == 'G') {
-				pgr_debugf("relaying message to frontend (fd %d)", frontend.fd);
-				rc = pgr_mbuf_relay(be);
-				if (rc != 0) {
-					goto shutdown;
-				}
+static void end_session(WORKER *w, SESSION *s)
+{
+	pgr_logf(stderr, LOG_INFO, "Client connection (fd %d) completed in %lfs",
+			s->frontend.fd, time_ms() - s->started);
 
-				pgr_debugf("switching to COPY DATA sub-protocol");
-				do {
-					pgr_debugf("reading message from frontend (fd %d)", frontend.fd);
-					rc = pgr_mbuf_recv(fe);
-					if (rc < 0) {
-						goto shutdown;
-					}
+	pgr_cancel_forget(w->context, s->frontend.greeting.pid);
+	unpipe(w, s);
+	unlisten(w, s);
 
-					type = pgr_mbuf_msgtype(fe);
+	pgr_debugf("closing all frontend and backend connections");
+	pgr_conn_deinit(&s->reader); free(s->reader.hostname);
+	pgr_conn_deinit(&s->writer); free(s->writer.hostname);
+	pgr_conn_deinit(&s->frontend);
 
-					pgr_debugf("relaying message to %s (fd %d)",
-							befd == reader.fd ? "reader" : "writer", befd);
-					rc = pgr_mbuf_relay(fe);
-					if (rc != 0) {
-						goto shutdown;
-					}
-				} while (type != 'c' && type != 'F');
-				pgr_debugf("returning to NORMAL protocol");
-				continue;
+	pgr_mbuf_free(s->fe);
+	pgr_mbuf_free(s->be);
+	pgr_mbuf_free(s->notes);
+	pgr_mbuf_free(s->prep);
+	stmts_free(s->statements);
+	stmts_free(s->touched);
+
+	s->state = SESSION_CLOSED;
+	s->next = w->dead;
+	w->dead = s;
+
+	account(w, -1);
+}
+
+/* Are backend connections borrowed per-transaction (or
+   per-statement), rather than held for the session? */
+static int multiplexed(SESSION *s)
+{
+	return s->pooling == POOL_TRANSACTION || s->pooling == POOL_STATEMENT;
+}
+
+static const char* role(SESSION *s)
+{
+	return s->backend == &s->reader ? "reader" : "writer";
+}
+
+/* Have do_worker step the session again soon, even though
+   none of its descriptors may have anything to say. */
+static void later(WORKER *w, SESSION *s)
+{
+	if (!s->queued) {
+		s->queued = 1;
+		s->qnext = w->queued;
+		w->queued = s;
+	}
+}
+
+/* Tell the client of a session whose backend never came up
+   (or, for a pipeline or a listener, the clients waiting on
+   it) why it's about to be hung up on. */
+static void overdue(SESSION *s)
+{
+	PIPED *e;
+	ACK *a;
+
+	switch (s->state) {
+	case SESSION_PIPE:
+		for (e = s->pipeline.queue; e; e = e->next) {
+			if (e->session) {
+				overdue(e->session);
 			}
+		}
+		return;
 
-			pgr_debugf("relaying message to frontend (fd %d)", frontend.fd);
-			rc = pgr_mbuf_relay(be);
-			if (rc != 0) {
-				goto shutdown;
+	case SESSION_LISTENER:
+		for (a = s->listener.acks; a; a = a->next) {
+			if (a->session) {
+				overdue(a->session);
 			}
+		}
+		return;
+	}
 
-		} while (type != 'Z');
+	if (s->be->left == 0) {
+		pgr_conn_fatal(s->be, "08006", "timed out connecting to the backend");
 	}
-shutdown:
-	pgr_debugf("closing all frontend and backend connections");
-	pgr_conn_deinit(&reader); free(reader.hostname);
-	pgr_conn_deinit(&writer); free(writer.hostname);
-	pgr_conn_deinit(&frontend);
-	return;
 }
 
-static void* do_worker(void *_c)
+/* Carry on with the startup conversation of a backend
+   connection, if it's still in the middle of one.
+
+   A backend that never answers (or a SYN that goes nowhere)
+   would otherwise leave the session waiting as long as the
+   kernel cares to, so the session stays in line to be
+   stepped on every tick until the backend is ready, or its
+   deadline (see acquire) passes.  Then the client is told
+   why it's being hung up on. */
+static int handshake(WORKER *w, SESSION *s, CONNECTION *be)
 {
-	CONTEXT *c = (CONTEXT*)_c;
-	int rc, connfd, i, nfds;
-	int watch[2] = { c->frontend4, c->frontend6 };
-	fd_set rfds;
+	int rc;
 
-	for (;;) {
-		FD_ZERO(&rfds);
-		nfds = 0;
+	if (!be->startup.buf) {
+		return 0;
+	}
+
+	rc = pgr_conn_handshake(be);
+	if (rc == MBUF_AGAIN) {
+		if (!s->deadline || time_ms() < s->deadline) {
+			later(w, s);
+			return rc;
+		}
+		pgr_logf(stderr, LOG_ERR, "[worker] timed out after %dms connecting to backend %s:%d",
+				be->timeout, be->hostname, be->port);
+		overdue(s);
+		return -1;
+	}
+	if (rc != 0) {
+		pgr_logf(stderr, LOG_ERR, "[worker] failed to connect to backend %s:%d",
+				be->hostname, be->port);
+		return -1;
+	}
+	return rc;
+}
+
+/* Make sure we hold a connection to the given backend,
+   borrowing one from the pool (or, failing that, making
+   a new one) if we don't.  In transaction pooling mode,
+   this happens every time a client starts a transaction.
 
-		for (i = 0; i < sizeof(watch)/sizeof(watch[0]); i++) {
-			if (watch[i] >= 0) {
-				FD_SET(watch[i], &rfds);
-				nfds = max(watch[i], nfds);
+   New connections are set up without blocking; until the
+   backend is ready for queries, this returns MBUF_AGAIN.
+   The reader and the writer can both be in the middle of
+   starting up, and each session can have its own going,
+   so backend round-trips overlap instead of adding up.
+   If the backend is at one of its connection limits, we
+   get in line, and also return MBUF_AGAIN.
+
+   A new connection has the backend's timeout to become
+   ready, counting from when it (or the session's other
+   connection, if that one's still starting up too) was
+   started; see handshake. */
+static int acquire(WORKER *w, SESSION *s, CONNECTION *be)
+{
+	int rc;
+
+	if (be->fd < 0) {
+		if (pgr_pool_checkout(be) != 0) {
+			rc = pgr_pool_admit(be, 1);
+			if (rc == MBUF_AGAIN) {
+				later(w, s);
+				return rc;
+			}
+			if (!s->reader.startup.buf && !s->writer.startup.buf) {
+				s->deadline = be->timeout > 0 ? time_ms() + be->timeout / 1000.0 : 0;
+			}
+			if (rc != 0 || pgr_conn_start(be) != 0) {
+				return -1;
 			}
 		}
+		if (nonblocking(be->fd) != 0 || watch(w, be->fd, s) != 0) {
+			return -1;
+		}
+	}
+	return handshake(w, s, be);
+}
 
-		rc = select(nfds+1, &rfds, NULL, NULL, NULL);
-		if (rc == -1) {
-			if (errno == EINTR) {
+/* Point any cancels from the client at the given backend
+   connection, which is about to run its query (or, if it
+   is NULL, at nothing). */
+static void aim(WORKER *w, SESSION *s, CONNECTION *be)
+{
+	uint32_t pid = be ? be->greeting.pid : 0;
+
+	if (s->aim.conn == be && s->aim.pid == pid) {
+		return;
+	}
+	s->aim.conn = be;
+	s->aim.pid  = pid;
+	pgr_cancel_target(w->context, s->frontend.greeting.pid, be);
+}
+
+/* Give up our connection to the given backend.  If it's
+   idle, it goes back to the pool (if pooling is enabled)
+   for the next session to use, after a reset if `reset`
+   is set; otherwise, it gets a Terminate message and is
+   closed. */
+static void release(WORKER *w, SESSION *s, CONNECTION *be, int reset)
+{
+	if (be->fd < 0) {
+		return;
+	}
+
+	if (s->aim.conn == be) {
+		/* it'll be someone else's, soon enough */
+		aim(w, s, NULL);
+	}
+
+	unwatch(w, be->fd);
+	if (pgr_pool_checkin(be, reset) != 0) {
+		pgr_sendn(be->fd, "X\0\0\0\x4", 5);
+		pgr_conn_close(be);
+	}
+}
+
+/*
+   Some statements leave state behind in the backend session
+   that later statements will count on: temporary tables,
+   session-level advisory locks, plain (not LOCAL) SETs,
+   prepared statements, cursors WITH HOLD, and LISTENs that
+   the listener didn't get to handle.  Clients that issue
+   them get to keep their backend connections (i.e. they are
+   pinned to them) as if they were in session pooling, for
+   as long as they stay connected.  Everyone else shares.
+ */
+
+/* Does the SQL of the Query or Parse at the front of `m`
+   pin the session?  (Named prepared statements don't; see
+   reprepare.) */
+static int pins(MBUF *m)
+{
+	char *data;
+
+	data = pgr_mbuf_data(m, 0, pgr_mbuf_msglength(m));
+	if (!data) {
+		return 0;
+	}
+
+	switch (pgr_mbuf_msgtype(m)) {
+	case 'Q': return pgr_sql_pins(data);
+	case 'P': return pgr_sql_pins(data + strlen(data) + 1);
+	default:  return 0;
+	}
+}
+
+/* The SQL of a simple Query or a Parse message, if the
+   message at the front of `m` is one. */
+static char* statement(MBUF *m)
+{
+	char *data;
+
+	data = pgr_mbuf_data(m, 0, pgr_mbuf_msglength(m));
+	if (!data) {
+		return NULL;
+	}
+
+	switch (pgr_mbuf_msgtype(m)) {
+	case 'Q': return data;
+	case 'P': return data + strlen(data) + 1; /* past the name */
+	default:  return NULL;
+	}
+}
+
+/* Send a batch that opens a transaction block to the
+   writer, or if the transaction is read only, to a reader.
+   Whether we're *in* a transaction is up to the backend,
+   not us: the status in each ReadyForQuery says (see
+   SESSION_BACKEND), and that catches ROLLBACK, END, COMMIT
+   AND CHAIN, errors and all the rest for free.
+
+   A SET TRANSACTION READ ONLY only counts in the batch with
+   the BEGIN; by the next, the transaction has already been
+   started on the writer, and has to stay there. */
+static void transaction(SESSION *s, const char *sql)
+{
+	if (s->in_txn || s->streaming) {
+		return;
+	}
+	s->opens = pgr_sql_begins(sql, s->opens);
+	if (s->opens == SQL_BEGIN) {
+		s->backend = &s->writer; /* force transactions to writer */
+
+	} else if (s->opens == SQL_BEGIN_RO && s->backend == &s->writer) {
+		pgr_debugf("transaction is read only; sending %s to the reader",
+				s->type == 'Q' ? "it" : "the batch");
+		s->backend = &s->reader;
+	}
+}
+
+/*
+   Named prepared statements only exist in the backend
+   session that parsed them, but under pooling (or with
+   reads and writes split) a client's Bind can easily go to
+   some other connection than its Parse did.  So we keep
+   the Parse of every statement a client prepares, and keep
+   track of the statements each backend connection has (see
+   pgr_conn_prepare).  Before a batch goes out, whatever
+   statements it uses that its connection doesn't have are
+   parsed there first, in a batch of our own.  A connection
+   that already has an identical statement (from this client
+   or any other) gets to keep it, plan cache and all.
+ */
+
+#define STMT_PARSE 'P'   /* the batch parses it          */
+#define STMT_USE   'U'   /* the batch binds / describes it */
+#define STMT_CLOSE 'C'   /* the batch closes it          */
+
+/* Digest the body of a Parse message (past the statement
+   name), so that identical statements can be told apart
+   from statements that only share a name.  Never 0. */
+static uint64_t digest(const char *parse, unsigned int len)
+{
+	uint64_t h = 14695981039346656037ULL; /* FNV-1a */
+	unsigned int i;
+
+	for (i = strlen(parse) + 1; i < len; i++) {
+		h = (h ^ (unsigned char)parse[i]) * 1099511628211ULL;
+	}
+	return h ? h : 1;
+}
+
+static STMT* stmt_new(const char *name, char op)
+{
+	STMT *st;
+
+	st = calloc(1, sizeof(STMT));
+	if (!st) {
+		pgr_abort(ABORT_MEMFAIL);
+	}
+	st->name = strdup(name);
+	if (!st->name) {
+		pgr_abort(ABORT_MEMFAIL);
+	}
+	st->op = op;
+	return st;
+}
+
+static void stmt_parse(STMT *st, const char *parse, unsigned int len, uint64_t hash)
+{
+	st->parse = malloc(len);
+	if (!st->parse) {
+		pgr_abort(ABORT_MEMFAIL);
+	}
+	memcpy(st->parse, parse, len);
+	st->len  = len;
+	st->hash = hash;
+}
+
+static void stmts_free(STMT *st)
+{
+	STMT *tmp;
+	while (st) {
+		tmp = st->next;
+		free(st->name);
+		free(st->parse);
+		free(st);
+		st = tmp;
+	}
+}
+
+/* Take the named statement out of a list (if it's there). */
+static void stmt_forget(STMT **list, const char *name)
+{
+	STMT *st;
+
+	for (; (st = *list) != NULL; list = &st->next) {
+		if (strcmp(st->name, name) == 0) {
+			*list = st->next;
+			st->next = NULL;
+			stmts_free(st);
+			return;
+		}
+	}
+}
+
+static STMT* stmt_find(STMT *list, const char *name)
+{
+	for (; list; list = list->next) {
+		if (strcmp(list->name, name) == 0) {
+			return list;
+		}
+	}
+	return NULL;
+}
+
+/* Is this the first thing the batch does with the named
+   statement? */
+static int fresh(SESSION *s, STMT *st)
+{
+	STMT *t;
+
+	for (t = s->touched; t != st; t = t->next) {
+		if (strcmp(t->name, st->name) == 0) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/* Keep up with what the message at the front of `m` does
+   to the client's prepared statements, and (if it is part
+   of an extended query batch) with what the batch needs.
+   Returns what the batch does with the statement, if any. */
+static STMT* track(SESSION *s, MBUF *m)
+{
+	STMT *st, *known, **tail;
+	unsigned int len, n;
+	char *data, *name, op;
+
+	len  = pgr_mbuf_msglength(m);
+	n    = len < 128 ? len : 128; /* room for two names */
+	data = pgr_mbuf_data(m, 0, n);
+	if (!data) {
+		return NULL;
+	}
+
+	switch (pgr_mbuf_msgtype(m)) {
+	case 'Q':
+		/* a simple Query does away with the unnamed statement */
+		stmt_forget(&s->statements, "");
+		return NULL;
+
+	case 'P': op = STMT_PARSE; name = data;     break;
+	case 'B': op = STMT_USE;   name = memchr(data, '\0', n); break;
+	case 'D': op = STMT_USE;   name = data[0] == 'S' ? data : NULL; break;
+	case 'C': op = STMT_CLOSE; name = data[0] == 'S' ? data : NULL; break;
+	default:  return NULL;
+	}
+	if (name && op != STMT_PARSE) {
+		name++; /* past the portal name, or the 'S' */
+	}
+	if (!name || name >= data + n || !memchr(name, '\0', data + n - name)) {
+		return NULL;
+	}
+
+	st = NULL;
+	known = stmt_find(s->statements, name);
+	switch (op) {
+	case STMT_PARSE:
+		stmt_forget(&s->statements, name);
+		st = stmt_new(name, op);
+		data = pgr_mbuf_data(m, 0, len);
+		if (data) {
+			stmt_parse(st, data, len, digest(data, len));
+
+			/* the client's idea of it, from now on */
+			known = stmt_new(name, 0);
+			stmt_parse(known, st->parse, st->len, st->hash);
+			known->next = s->statements;
+			s->statements = known;
+		}
+		break;
+
+	case STMT_USE:
+		if (known) {
+			st = stmt_new(name, op);
+			stmt_parse(st, known->parse, known->len, known->hash);
+		}
+		break;
+
+	case STMT_CLOSE:
+		st = stmt_new(name, op);
+		stmt_forget(&s->statements, name);
+		break;
+	}
+
+	if (st) {
+		for (tail = &s->touched; *tail; tail = &(*tail)->next)
+			;
+		*tail = st;
+	}
+	return st;
+}
+
+/* The SQL of the prepared statement that a Bind (per what
+   track made of it) binds, unless it was parsed earlier on
+   in the batch, and routed by then. */
+static const char* bound(SESSION *s, MBUF *m, STMT *st)
+{
+	if (!st || st->op != STMT_USE || pgr_mbuf_msgtype(m) != 'B' || !fresh(s, st)) {
+		return NULL;
+	}
+	return st->parse + strlen(st->parse) + 1;
+}
+
+static void put(MBUF *m, char type, const void *a, size_t alen, const void *b, size_t blen)
+{
+	uint32_t len = htonl(4 + alen + blen);
+
+	pgr_mbuf_cat(m, &type, 1);
+	pgr_mbuf_cat(m, &len, 4);
+	if (alen) pgr_mbuf_cat(m, a, alen);
+	if (blen) pgr_mbuf_cat(m, b, blen);
+}
+
+/* Work out what has to happen on backend connection `be`
+   before the batch can go out there: statements it uses
+   that aren't there (or aren't the same) have to be parsed,
+   and statements it parses must not already be there.  The
+   Close / Parse messages that see to it (and a Sync) are
+   put in a new MBUF, for SESSION_PREPARE to send; returns
+   NULL if there is nothing to do. */
+static MBUF* reprepare(SESSION *s, CONNECTION *be)
+{
+	STMT *st;
+	PREPARED *p;
+	MBUF *m;
+	size_t n;
+	int pass;
+
+	m = NULL;
+	for (pass = 0; pass < 2; pass++) {
+		n = 0;
+		for (st = s->touched; st; st = st->next) {
+			if (!fresh(s, st)) {
 				continue;
 			}
-			pgr_logf(stderr, LOG_ERR, "[worker] select received system error: %s (errno %d)",
-					strerror(errno), errno);
-			pgr_abort(ABORT_SYSCALL);
+			p = st->name[0] ? pgr_conn_prepared(be, st->name) : NULL;
+
+			if (st->op == STMT_USE && (!p || p->hash != st->hash)) {
+				if (p) {
+					n += 5 + 1 + strlen(st->name) + 1;
+					if (m) put(m, 'C', "S", 1, st->name, strlen(st->name) + 1);
+				}
+				n += 5 + st->len;
+				if (m) put(m, 'P', st->parse, st->len, NULL, 0);
+				if (m && st->name[0]) pgr_conn_prepare(be, st->name, st->hash);
+
+			} else if (st->op == STMT_PARSE && p) {
+				n += 5 + 1 + strlen(st->name) + 1;
+				if (m) put(m, 'C', "S", 1, st->name, strlen(st->name) + 1);
+				if (m) pgr_conn_unprepare(be, st->name);
+			}
+		}
+		if (n == 0) {
+			return NULL;
 		}
+		if (!m) {
+			m = pgr_mbuf_new(n + 5 < 16 ? 16 : n + 5);
+		}
+	}
+	put(m, 'S', NULL, 0, NULL, 0);
+	return m;
+}
 
-		for (i = 0; i < sizeof(watch)/sizeof(watch[0]); i++) {
-			if (watch[i] >= 0 && FD_ISSET(watch[i], &rfds)) {
-				double t;
-				char remote_addr[INET6_ADDRSTRLEN+1];
-				struct sockaddr_storage peer;
-				int peer_len = sizeof(peer);
-
-				connfd = accept(watch[i], (struct sockaddr*)&peer, &peer_len);
-				wrlock(&c->lock, "context", 0);
-				c->fe_conns++;
-				unlock(&c->lock, "context", 0);
-
-				switch (peer.ss_family) {
-				case AF_INET:
-					memset(remote_addr, 0, sizeof(remote_addr));
-					inet_ntop(AF_INET, &((struct sockaddr_in*)&peer)->sin_addr,
-						remote_addr, sizeof(remote_addr)),
-					pgr_logf(stderr, LOG_INFO, "[worker] inbound connection from %s:%d",
-							remote_addr, ((struct sockaddr_in*)&peer)->sin_port);
-					break;
+/* Note what the batch (just sent) did to the statements of
+   backend connection `be`. */
+static void prepared(SESSION *s, CONNECTION *be)
+{
+	STMT *st;
 
-				case AF_INET6:
-					memset(remote_addr, 0, sizeof(remote_addr));
-					inet_ntop(AF_INET6, &((struct sockaddr_in6*)&peer)->sin6_addr,
-						remote_addr, sizeof(remote_addr)),
-					pgr_logf(stderr, LOG_INFO, "[worker] inbound connection from %s:%d",
-							remote_addr, ((struct sockaddr_in6*)&peer)->sin6_port);
-					break;
-				}
+	for (st = s->touched; st; st = st->next) {
+		if (!st->name[0]) {
+			continue; /* (the unnamed statement never lasts) */
+		}
+		if (st->op == STMT_PARSE) {
+			pgr_conn_prepare(be, st->name, st->parse ? st->hash : 0);
+		} else if (st->op == STMT_CLOSE) {
+			pgr_conn_unprepare(be, st->name);
+		}
+	}
+}
 
-				pgr_msgf(stderr, "Handling new inbound client connection (fd %d)", connfd);
-				t = time_ms();
-				handle_client(c, connfd);
-				t = time_ms() - t;
-				pgr_logf(stderr, LOG_INFO, "Client connection (fd %d) completed in %lfs",
-						connfd, t);
+/* The batch failed, somewhere; we no longer know which of
+   the statements it touched are there on `be`. */
+static void doubt(SESSION *s, CONNECTION *be)
+{
+	STMT *st;
 
-				wrlock(&c->lock, "context", 0);
-				c->fe_conns--;
-				unlock(&c->lock, "context", 0);
+	for (st = s->touched; st; st = st->next) {
+		if (st->name[0]) {
+			pgr_conn_prepare(be, st->name, 0);
+		}
+	}
+}
 
-				close(connfd);
-			}
+/* Keep up with the prepared statements that this (simple
+   Query or Parse) SQL deallocates behind our backs: the
+   client's are gone, and whichever backend the batch goes
+   to may or may not still have them, depending on how the
+   batch goes.  Returns non-zero if there were any. */
+static int deallocated(SESSION *s, const char *sql)
+{
+	char name[64]; /* (postgres' NAMEDATALEN) */
+	int rc, any;
+
+	for (any = 0; (rc = pgr_sql_deallocates(&sql, name, sizeof(name))) != 0; any = 1) {
+		if (rc == SQL_DEALLOCATE_ALL) {
+			stmts_free(s->statements);
+			s->statements = NULL;
+		} else {
+			stmt_forget(&s->statements, name);
 		}
 	}
+	return any;
+}
 
-	close(c->frontend4);
-	close(c->frontend6);
-	return NULL;
+/*
+   A client that writes something and then reads it back
+   expects to see it, but its read could go to a slave that
+   hasn't replayed the write yet.  So, once a write of ours
+   is committed, the first read that comes after it waits
+   while we ask the master where its xlog is at (any of its
+   connections will do; it can only be further along), and
+   until the watcher sees that our reader has replayed that
+   far, the session's reads go to the writer instead.  Writes
+   themselves never wait on the question, and a client that
+   only ever writes never gets asked it.
+ */
+
+/* Build the query that asks the master (on `be`) where its
+   xlog is at, for SESSION_LSN to send.  What the function
+   is called depends on the master's version, which the
+   watcher keeps track of. */
+static MBUF* locate(WORKER *w, CONNECTION *be)
+{
+	CONTEXT *c = w->context;
+	const char *sql;
+	int i = be->index, version = 0;
+	MBUF *m;
+
+	rdlock(&c->lock, "context", 0);
+	if (i >= 0 && i < c->num_backends) {
+		rdlock(&c->backends[i].lock, "backend", i);
+		version = c->backends[i].health.version;
+		unlock(&c->backends[i].lock, "backend", i);
+	}
+	unlock(&c->lock, "context", 0);
+
+	sql = pgr_xlog_query(version, BACKEND_ROLE_MASTER);
+	m = pgr_mbuf_new(64);
+	put(m, 'Q', sql, strlen(sql) + 1, NULL, 0);
+	pgr_mbuf_setfd(m, MBUF_NO_FD, be->fd);
+	return m;
 }
 
-int pgr_worker(CONTEXT *c, pthread_t *tid)
+/* Note the xlog position in the DataRow (in `m`) that
+   answers our locate() query, as the one our reads must wait
+   for the reader to replay. */
+static void located(SESSION *s, MBUF *m)
 {
-	int rc = pthread_create(tid, NULL, do_worker, c);
+	char buf[64], *data;
+	long int n;
+	lag_t pos;
+
+	n = pgr_mbuf_u32(m, 2);
+	if (n <= 0 || n >= sizeof(buf) || !(data = pgr_mbuf_data(m, 6, n))) {
+		return;
+	}
+	memcpy(buf, data, n);
+	buf[n] = '\0';
+	if (pgr_xlog(buf, &pos) == 0 && pos > s->lsn) {
+		pgr_debugf("client (fd %d) wrote as far as xlog position %s", s->frontend.fd, buf);
+		s->lsn = pos;
+	}
+}
+
+/* Has our reader replayed our last write (as far as the
+   watcher knows)? */
+static int caught_up(WORKER *w, SESSION *s)
+{
+	CONTEXT *c = w->context;
+	int i = s->reader.index, ok = 0;
+
+	rdlock(&c->lock, "context", 0);
+	if (i >= 0 && i < c->num_backends) {
+		rdlock(&c->backends[i].lock, "backend", i);
+		ok = c->backends[i].serial == s->reader.serial
+		  && c->backends[i].health.pos >= s->lsn;
+		unlock(&c->backends[i].lock, "backend", i);
+	}
+	unlock(&c->lock, "context", 0);
+	return ok;
+}
+
+/* Did the backend just COMMIT a read-write transaction?
+   If so, the batch wrote, as far as reading our own writes
+   goes; a ROLLBACK (or a COMMIT of a failed transaction,
+   which says ROLLBACK) doesn't count, and neither does a
+   read-only transaction, which never got to the writer. */
+static void committed(SESSION *s)
+{
+	char *tag;
+
+	if ((s->rw || s->opens == SQL_BEGIN) && pgr_mbuf_msgtype(s->be) == 'C'
+	 && pgr_mbuf_msglength(s->be) == sizeof("COMMIT")
+	 && (tag = pgr_mbuf_data(s->be, 0, sizeof("COMMIT"))) != NULL
+	 && memcmp(tag, "COMMIT", sizeof("COMMIT")) == 0) {
+		s->writes = 1;
+	}
+}
+
+/* Pass along whatever the backend has to say about a batch
+   that is going out as it comes in (see SESSION_RESEND),
+   without waiting for the rest of it: after a Flush, the
+   client wants its replies before it sends the Sync. */
+static int early(SESSION *s)
+{
+	int rc;
+
+	for (;;) {
+		if (s->be->left == 0) {
+			rc = pgr_mbuf_recv(s->be);
+			if (rc == MBUF_AGAIN) {
+				return 0;
+			}
+			if (rc <= 0) {
+				return -1;
+			}
+			if (pgr_mbuf_msgtype(s->be) == 'E' && s->touched) {
+				doubt(s, s->backend);
+			}
+			committed(s);
+		}
+
+		rc = pgr_mbuf_relay(s->be);
+		if (rc != 0) {
+			return rc;
+		}
+	}
+}
+
+/* Wrap up a batch, once the client has all of its replies
+   (up to and including the ReadyForQuery). */
+static void finish(WORKER *w, SESSION *s)
+{
+	pgr_mbuf_forget(s->fe);
+	s->batch = 0;
+	s->streaming = 0;
+	stmts_free(s->touched);
+	s->touched = NULL;
+	s->prepped = 0;
+	if (!s->in_txn) {
+		s->backend = &s->reader;
+	}
+	if (multiplexed(s) && !s->pinned) {
+		/* between transactions, let someone else have them */
+		if (s->reader.txn == 'I') release(w, s, &s->reader, 0);
+		if (s->writer.txn == 'I') release(w, s, &s->writer, 0);
+	}
+	s->state = SESSION_FRONTEND;
+}
+
+/*
+   Under transaction (or statement) pooling, each autocommit
+   write would otherwise tie up a master connection of its
+   own for a full round-trip.  Instead, the worker keeps a
+   pipeline per writer (and pool key): a session of its own,
+   with one connection to the master, down which the batches
+   of any number of clients are written back-to-back, without
+   waiting on each other's replies.  The replies come back in
+   the same order, each batch's ending in a ReadyForQuery, so
+   they go to whoever's batch is at the head of the line.
+
+   Only batches that can't affect anyone else's are piped
+   (see pipeable).  If one leaves the connection in a
+   transaction anyway, the batches behind it can't be
+   trusted, and the whole pipeline is hung up on.
+ */
+
+/* Can the message at the front of `m` be part of a batch
+   sent down a pipeline?  Only lone statements qualify: a
+   simple Query, or Parse / Bind / Describe / Execute / Sync
+   of the unnamed statement and portal. */
+static int pipeable(MBUF *m, int first)
+{
+	char *data;
+
+	data = pgr_mbuf_data(m, 0, pgr_mbuf_msglength(m));
+	if (!data) {
+		return 0;
+	}
+
+	switch (pgr_mbuf_msgtype(m)) {
+	case 'Q': return first && pgr_sql_autonomous(data);
+	case 'P': return first && data[0] == '\0' && pgr_sql_autonomous(data + 1);
+	case 'B': return !first && data[0] == '\0' && data[1] == '\0';
+	case 'D': return !first && data[1] == '\0';
+	case 'E': return data[0] == '\0';
+	case 'S': return 1;
+	case 'H': return 1;
+	default:  return 0;
+	}
+}
+
+/* Join (or start) the pipeline for the writer of a session,
+   putting its batch at the end of the line. */
+static void pipe_up(WORKER *w, SESSION *s)
+{
+	SESSION *p;
+	PIPED *e, **ee;
+	char *key;
+
+	key = pgr_pool_key(&s->writer);
+	for (p = w->pipes; p; p = p->pipeline.next) {
+		if (p->writer.index  == s->writer.index
+		 && p->writer.serial == s->writer.serial
+		 && strcmp(p->pipeline.key, key) == 0) {
+			break;
+		}
+	}
+
+	if (!p) {
+		p = calloc(1, sizeof(SESSION));
+		if (!p) {
+			pgr_abort(ABORT_MEMFAIL);
+		}
+		p->state   = SESSION_PIPE;
+		p->pooling = s->pooling;
+		p->started = time_ms();
+
+		p->be = pgr_mbuf_new(4096);
+		pgr_mbuf_cork(p->be, 8192);
+
+		pgr_conn_init(w->context, &p->writer);
+		p->writer.index    = s->writer.index;
+		p->writer.serial   = s->writer.serial;
+		p->writer.hostname = strdup(s->writer.hostname);
+		p->writer.port     = s->writer.port;
+		p->writer.timeout  = s->writer.timeout;
+		if (!p->writer.hostname) {
+			pgr_abort(ABORT_MEMFAIL);
+		}
+		pgr_conn_copy(&p->writer, &s->writer);
+		p->backend = &p->writer;
+
+		p->pipeline.key = key;
+		key = NULL;
+		p->pipeline.next = w->pipes;
+		w->pipes = p;
+		pgr_debugf("starting a new pipeline to writer %s:%d", p->writer.hostname, p->writer.port);
+	}
+	free(key);
+
+	e = calloc(1, sizeof(PIPED));
+	if (!e) {
+		pgr_abort(ABORT_MEMFAIL);
+	}
+	e->session = s;
+	for (ee = &p->pipeline.queue; *ee; ee = &(*ee)->next)
+		;
+	*ee = e;
+
+	s->pipeline.pipe  = p;
+	s->pipeline.entry = e;
+}
+
+/* Shut a pipeline down.  If it's `broken`, its connection
+   is closed, and its clients are hung up on; otherwise (it
+   has nothing left to do), its connection goes back to the
+   pool. */
+static void close_pipe(WORKER *w, SESSION *p, int broken)
+{
+	SESSION **pp, *s;
+	PIPED *e;
+
+	for (pp = &w->pipes; *pp; pp = &(*pp)->pipeline.next) {
+		if (*pp == p) {
+			*pp = p->pipeline.next;
+			break;
+		}
+	}
+
+	while ((e = p->pipeline.queue) != NULL) {
+		p->pipeline.queue = e->next;
+		if ((s = e->session) != NULL) {
+			s->pipeline.pipe  = NULL;
+			s->pipeline.entry = NULL;
+			end_session(w, s);
+		}
+		free(e);
+	}
+
+	if (!broken) {
+		release(w, p, &p->writer, 0);
+	} else if (p->writer.fd >= 0) {
+		unwatch(w, p->writer.fd);
+	}
+	pgr_conn_deinit(&p->writer);
+	free(p->writer.hostname);
+	pgr_mbuf_free(p->be);
+	free(p->pipeline.key);
+
+	p->state = SESSION_CLOSED;
+	p->next = w->dead;
+	w->dead = p;
+}
+
+/* Take a session (that's going away) out of the line for
+   its pipeline.  If its batch was already sent, we still
+   have to read its replies (to get to everyone else's),
+   but they go nowhere. */
+static void unpipe(WORKER *w, SESSION *s)
+{
+	SESSION *p;
+	PIPED *e, **ee;
+
+	if (!(p = s->pipeline.pipe)) {
+		return;
+	}
+	e = s->pipeline.entry;
+	e->session = NULL;
+	s->pipeline.pipe  = NULL;
+	s->pipeline.entry = NULL;
+
+	if (p->be->outfd == s->frontend.fd) {
+		/* whoever gets its fd next doesn't want this */
+		p->be->olen = 0;
+		pgr_mbuf_setfd(p->be, MBUF_SAME_FD, MBUF_NO_FD);
+	}
+
+	if (!e->sent) {
+		if (s->fe->redo > 0) {
+			pgr_logf(stderr, LOG_ERR, "[worker] client went away halfway through sending its batch "
+					"down a pipeline; hanging up on the pipeline");
+			close_pipe(w, p, 1);
+			return;
+		}
+		for (ee = &p->pipeline.queue; *ee; ee = &(*ee)->next) {
+			if (*ee == e) {
+				*ee = e->next;
+				break;
+			}
+		}
+		free(e);
+	}
+}
+
+/* Write out as much of a pipeline's waiting batches as we
+   can.  Returns non-zero if the pipeline broke. */
+static int feed(SESSION *p)
+{
+	PIPED *e;
+	int rc;
+
+	for (e = p->pipeline.queue; e; e = e->next) {
+		if (e->sent) {
+			continue;
+		}
+		pgr_mbuf_setfd(e->session->fe, MBUF_SAME_FD, p->writer.fd);
+		rc = pgr_mbuf_resend(e->session->fe);
+		if (rc == MBUF_AGAIN) {
+			break; /* the rest have to wait their turn */
+		}
+		if (rc != 0) {
+			return -1;
+		}
+		e->sent = 1;
+	}
+	return 0;
+}
+
+/* Move a pipeline along: write out as much of the waiting
+   batches as we can, and relay whatever replies we have to
+   their clients.  Returns non-zero if the pipeline broke. */
+static int pump(WORKER *w, SESSION *p)
+{
+	SESSION *s;
+	PIPED *e;
+	int rc;
+
+	rc = acquire(w, p, &p->writer);
+	if (rc != 0) {
+		return rc == MBUF_AGAIN ? 0 : -1;
+	}
+	if (p->be->infd != p->writer.fd) {
+		pgr_mbuf_setfd(p->be, p->writer.fd, MBUF_SAME_FD);
+	}
+
+	if (feed(p) != 0) {
+		return -1;
+	}
+
+	while ((e = p->pipeline.queue) != NULL && e->sent) {
+		if (e->sent == 1) {
+			if (p->be->left == 0) {
+				rc = pgr_mbuf_recv(p->be);
+				if (rc == MBUF_AGAIN) {
+					return 0;
+				}
+				if (rc <= 0) {
+					return -1;
+				}
+				p->type = pgr_mbuf_msgtype(p->be);
+				if (p->type == 'Z') {
+					p->writer.txn = *(char *)pgr_mbuf_data(p->be, 0, 1);
+				}
+			}
+
+			if (!e->session) {
+				rc = pgr_mbuf_discard(p->be);
+
+			} else {
+				if (p->be->outfd != e->session->frontend.fd) {
+					rc = pgr_mbuf_push(p->be);
+					if (rc != 0) {
+						return rc == MBUF_AGAIN ? 0 : -1;
+					}
+					pgr_mbuf_setfd(p->be, MBUF_SAME_FD, e->session->frontend.fd);
+				}
+				rc = pgr_mbuf_relay(p->be);
+				if (rc != 0 && rc != MBUF_AGAIN) {
+					/* (probably) the client's fault; if it was
+					   the backend's, we'll find out soon enough */
+					end_session(w, e->session);
+					continue;
+				}
+			}
+			if (rc != 0) {
+				return rc == MBUF_AGAIN ? 0 : -1;
+			}
+
+			if (p->type == 'Z') {
+				if (p->writer.txn != 'I') {
+					pgr_logf(stderr, LOG_ERR, "[worker] piped batch left the writer connection "
+							"in a transaction (status '%c')", p->writer.txn);
+					return -1;
+				}
+				e->sent = 2; /* all of the replies are in */
+			}
+			continue;
+		}
+
+		if ((s = e->session) != NULL) {
+			rc = pgr_mbuf_push(p->be);
+			if (rc != 0) {
+				return rc == MBUF_AGAIN ? 0 : -1;
+			}
+			s->wrote = s->wrote || s->writes;
+			s->pipeline.pipe  = NULL;
+			s->pipeline.entry = NULL;
+			finish(w, s);
+			later(w, s);
+		}
+		p->pipeline.queue = e->next;
+		free(e);
+	}
+
+	return 0;
+}
+
+/* Pump a pipeline, and shut it down if it broke, or if
+   it has nothing left to do. */
+static void drive(WORKER *w, SESSION *p)
+{
+	if (pump(w, p) != 0) {
+		pgr_logf(stderr, LOG_ERR, "[worker] pipeline to writer %s:%d failed; hanging up on its clients",
+				p->writer.hostname, p->writer.port);
+		close_pipe(w, p, 1);
+
+	} else if (!p->pipeline.queue) {
+		close_pipe(w, p, 0);
+	}
+}
+
+/*
+   Clients that LISTEN would each need a connection to the
+   master of their own, held for as long as they care to
+   hear about notifications (which is usually forever), and
+   in transaction pooling, there is no such thing.  So the
+   worker handles LISTEN / UNLISTEN itself, keeping one
+   connection to the master (per pool key) that listens on
+   behalf of all of its clients, and fanning the notifications
+   that come in out to whoever subscribed to each channel.
+   They are delivered while the client is idle, as postgres
+   would do.
+ */
+
+#define LISTEN_ON      SQL_LISTEN        /* LISTEN channel     */
+#define LISTEN_OFF     SQL_UNLISTEN      /* UNLISTEN channel   */
+#define LISTEN_OFF_ALL SQL_UNLISTEN_ALL  /* UNLISTEN *         */
+
+/* Is the Query message at the front of `m` a (lone) LISTEN
+   or UNLISTEN (see pgr_sql_listens)?  If so, returns a
+   LISTEN_* constant, and sets `channel` to the channel name
+   (NULL for UNLISTEN *), which the caller must free. */
+static int listening(MBUF *m, char **channel)
+{
+	char name[64]; /* (postgres' NAMEDATALEN) */
+	const char *sql;
+	int what;
+
+	sql = statement(m);
+	if (!sql || !(what = pgr_sql_listens(sql, name, sizeof(name)))) {
+		return 0;
+	}
+
+	*channel = NULL;
+	if (what != LISTEN_OFF_ALL && !(*channel = strdup(name))) {
+		pgr_abort(ABORT_MEMFAIL);
+	}
+	return what;
+}
+
+/* Queue up a (UN)LISTEN for the listener to send to the
+   master, and get in line for the reply.  Returns non-zero
+   if there are already too many in flight. */
+static int ask(SESSION *l, SESSION *s, CHANNEL *ch, const char *verb)
+{
+	ACK *a, **aa;
+	char *sql;
+	const char *p;
+	uint32_t len;
+	int n;
+
+	sql = calloc(strlen(verb) + 2 * strlen(ch->name) + 4, sizeof(char));
+	if (!sql) {
+		pgr_abort(ABORT_MEMFAIL);
+	}
+	n = sprintf(sql, "%s \"", verb);
+	for (p = ch->name; *p; p++) {
+		if (*p == '"') {
+			sql[n++] = '"';
+		}
+		sql[n++] = *p;
+	}
+	sql[n++] = '"';
+
+	len = htonl(4 + n + 1);
+	if (pgr_mbuf_cat(l->fe, "Q", 1) != 0
+	 || pgr_mbuf_cat(l->fe, &len, 4) != 0
+	 || pgr_mbuf_cat(l->fe, sql, n + 1) != 0) {
+		pgr_logf(stderr, LOG_ERR, "[worker] too many LISTENs in flight; dropping `%s`", sql);
+		free(sql);
+		return 1;
+	}
+	free(sql);
+
+	a = calloc(1, sizeof(ACK));
+	if (!a) {
+		pgr_abort(ABORT_MEMFAIL);
+	}
+	a->session = s;
+	a->channel = strcmp(verb, "LISTEN") == 0 ? ch : NULL;
+	for (aa = &l->listener.acks; *aa; aa = &(*aa)->next)
+		;
+	*aa = a;
+	return 0;
+}
+
+/* Tell the client its (UN)LISTEN is done. */
+static int listened(SESSION *s, int what)
+{
+	if (what == LISTEN_ON) {
+		pgr_mbuf_cat(s->be, "C\0\0\0\x0bLISTEN\0", 12);
+	} else {
+		pgr_mbuf_cat(s->be, "C\0\0\0\x0dUNLISTEN\0", 14);
+	}
+	return pgr_mbuf_cat(s->be, "Z\0\0\0\x05I", 6);
+}
+
+/* Find the listener for the writer of a session, starting
+   one up if need be. */
+static SESSION* listener(WORKER *w, SESSION *s)
+{
+	SESSION *l;
+	char *key;
+
+	if (s->listener.on) {
+		return s->listener.on;
+	}
+
+	key = pgr_pool_key(&s->writer);
+	for (l = w->listeners; l; l = l->pipeline.next) {
+		if (l->writer.index  == s->writer.index
+		 && l->writer.serial == s->writer.serial
+		 && strcmp(l->pipeline.key, key) == 0) {
+			free(key);
+			return l;
+		}
+	}
+
+	l = calloc(1, sizeof(SESSION));
+	if (!l) {
+		pgr_abort(ABORT_MEMFAIL);
+	}
+	l->state   = SESSION_LISTENER;
+	l->pooling = s->pooling;
+	l->started = time_ms();
+
+	l->fe = pgr_mbuf_new(4096);
+	l->be = pgr_mbuf_new(16384);
+
+	pgr_conn_init(w->context, &l->writer);
+	l->writer.index    = s->writer.index;
+	l->writer.serial   = s->writer.serial;
+	l->writer.hostname = strdup(s->writer.hostname);
+	l->writer.port     = s->writer.port;
+	l->writer.timeout  = s->writer.timeout;
+	if (!l->writer.hostname) {
+		pgr_abort(ABORT_MEMFAIL);
+	}
+	pgr_conn_copy(&l->writer, &s->writer);
+	l->backend = &l->writer;
+
+	l->pipeline.key = key;
+	l->pipeline.next = w->listeners;
+	w->listeners = l;
+	pgr_debugf("starting a new listener on writer %s:%d", l->writer.hostname, l->writer.port);
+	return l;
+}
+
+/* Take a session off of a channel's list of subscribers.
+   The last one out asks the master to stop listening. */
+static void unsubscribe(SESSION *l, CHANNEL **cc, SESSION *s)
+{
+	CHANNEL *ch = *cc;
+	SUB *sub, **ss;
+	ACK *a;
+
+	for (ss = &ch->subs; (sub = *ss) != NULL; ss = &sub->next) {
+		if (sub->session == s) {
+			*ss = sub->next;
+			free(sub);
+			break;
+		}
+	}
+
+	if (!ch->subs) {
+		for (a = l->listener.acks; a; a = a->next) {
+			if (a->channel == ch) {
+				a->channel = NULL;
+			}
+		}
+		ask(l, NULL, ch, "UNLISTEN");
+		*cc = ch->next;
+		free(ch->name);
+		free(ch);
+	}
+}
+
+/* Take a session off of the named channel (or, if
+   `channel` is NULL, off of all of them). */
+static void drop(SESSION *l, SESSION *s, const char *channel)
+{
+	CHANNEL *ch, **cc;
+
+	for (cc = &l->listener.channels; (ch = *cc) != NULL; ) {
+		if (channel && strcmp(ch->name, channel) == 0) {
+			unsubscribe(l, cc, s);
+			return; /* (`channel` may be gone with it) */
+		}
+		if (!channel) {
+			unsubscribe(l, cc, s);
+			if (*cc != ch) {
+				continue; /* it's gone */
+			}
+		}
+		cc = &ch->next;
+	}
+}
+
+/* Handle a LISTEN / UNLISTEN from a client, per `what`.
+   Returns non-zero if the client should be hung up on. */
+static int subscribe(WORKER *w, SESSION *s, int what, const char *channel)
+{
+	SESSION *l;
+	CHANNEL *ch;
+	SUB *sub;
+
+	l = s->listener.on = listener(w, s);
+	if (what != LISTEN_ON) {
+		/* we stop passing them along right now */
+		drop(l, s, channel);
+		later(w, l);
+		return listened(s, what);
+	}
+
+	for (ch = l->listener.channels; ch; ch = ch->next) {
+		if (strcmp(ch->name, channel) == 0) {
+			break;
+		}
+	}
+	if (!ch) {
+		ch = calloc(1, sizeof(CHANNEL));
+		if (!ch || !(ch->name = strdup(channel))) {
+			pgr_abort(ABORT_MEMFAIL);
+		}
+		ch->next = l->listener.channels;
+		l->listener.channels = ch;
+	}
+	for (sub = ch->subs; sub && sub->session != s; sub = sub->next)
+		;
+	if (!sub) {
+		sub = calloc(1, sizeof(SUB));
+		if (!sub) {
+			pgr_abort(ABORT_MEMFAIL);
+		}
+		sub->session = s;
+		sub->next = ch->subs;
+		ch->subs = sub;
+	}
+	if (!s->notes) {
+		s->notes = pgr_mbuf_new(16384);
+		pgr_mbuf_setfd(s->notes, MBUF_NO_FD, s->frontend.fd);
+	}
+
+	if (ch->live) {
+		return listened(s, what);
+	}
+
+	/* it's not a LISTEN until the master says it is */
+	if (ask(l, s, ch, "LISTEN") != 0) {
+		drop(l, s, channel);
+		return -1;
+	}
+	s->state = SESSION_LISTENING;
+	later(w, l);
+	return 0;
+}
+
+/* Stop listening on behalf of a session that's going away. */
+static void unlisten(WORKER *w, SESSION *s)
+{
+	SESSION *l;
+	ACK *a;
+
+	if (!(l = s->listener.on)) {
+		return;
+	}
+	s->listener.on = NULL;
+
+	for (a = l->listener.acks; a; a = a->next) {
+		if (a->session == s) {
+			a->session = NULL;
+		}
+	}
+	drop(l, s, NULL);
+	later(w, l);
+}
+
+/* Shut a listener down.  If it's `broken`, its subscribers
+   are hung up on (they'd never hear another notification);
+   otherwise (no one's listening) its connection goes back
+   to the pool, after a reset. */
+static void close_listener(WORKER *w, SESSION *l, int broken)
+{
+	SESSION **ll, *s;
+	CHANNEL *ch;
+	SUB *sub;
+	ACK *a;
+
+	for (ll = &w->listeners; *ll; ll = &(*ll)->pipeline.next) {
+		if (*ll == l) {
+			*ll = l->pipeline.next;
+			break;
+		}
+	}
+
+	while ((ch = l->listener.channels) != NULL) {
+		l->listener.channels = ch->next;
+		while ((sub = ch->subs) != NULL) {
+			ch->subs = sub->next;
+			s = sub->session;
+			free(sub);
+			if (s->state != SESSION_CLOSED) {
+				s->listener.on = NULL;
+				end_session(w, s);
+			}
+		}
+		free(ch->name);
+		free(ch);
+	}
+	while ((a = l->listener.acks) != NULL) {
+		l->listener.acks = a->next;
+		if (a->session && a->session->state != SESSION_CLOSED) {
+			a->session->listener.on = NULL;
+			end_session(w, a->session);
+		}
+		free(a);
+	}
+
+	if (!broken) {
+		release(w, l, &l->writer, 1);
+	} else if (l->writer.fd >= 0) {
+		unwatch(w, l->writer.fd);
+	}
+	pgr_conn_deinit(&l->writer);
+	free(l->writer.hostname);
+	pgr_mbuf_free(l->fe);
+	pgr_mbuf_free(l->be);
+	free(l->pipeline.key);
+
+	l->state = SESSION_CLOSED;
+	l->next = w->dead;
+	w->dead = l;
+}
+
+/* Pass a NotificationResponse along to everyone who is
+   subscribed to its channel. */
+static void notify(WORKER *w, SESSION *l, MBUF *m)
+{
+	CHANNEL *ch;
+	SUB *sub;
+	uint32_t len;
+	char *data;
+
+	len  = pgr_mbuf_msglength(m);
+	data = pgr_mbuf_data(m, 0, len);
+	if (!data || len < 5 || data[len - 1] != '\0') {
+		return;
+	}
+
+	for (ch = l->listener.channels; ch; ch = ch->next) {
+		if (strcmp(ch->name, data + 4) == 0) {
+			break;
+		}
+	}
+	if (!ch) {
+		return;
+	}
+
+	len = htonl(len + 4);
+	for (sub = ch->subs; sub; sub = sub->next) {
+		if (pgr_mbuf_cat(sub->session->notes, "A", 1) != 0
+		 || pgr_mbuf_cat(sub->session->notes, &len, 4) != 0
+		 || pgr_mbuf_cat(sub->session->notes, data, ntohl(len) - 4) != 0) {
+			pgr_logf(stderr, LOG_ERR, "[worker] client (fd %d) isn't keeping up with its notifications; "
+					"dropping one on channel '%s'", sub->session->frontend.fd, ch->name);
+			continue;
+		}
+		later(w, sub->session);
+	}
+}
+
+/* Move a listener along: send the master whatever LISTEN /
+   UNLISTEN commands we have for it, and see what it has to
+   say.  Returns non-zero if the listener broke. */
+static int hear(WORKER *w, SESSION *l)
+{
+	SESSION *s;
+	ACK *a;
+	uint32_t len;
+	int rc;
+
+	rc = acquire(w, l, &l->writer);
+	if (rc != 0) {
+		return rc == MBUF_AGAIN ? 0 : -1;
+	}
+	if (l->be->infd != l->writer.fd) {
+		pgr_mbuf_setfd(l->fe, MBUF_NO_FD, l->writer.fd);
+		pgr_mbuf_setfd(l->be, l->writer.fd, MBUF_NO_FD);
+	}
+
+	rc = pgr_mbuf_flush(l->fe);
+	if (rc != 0 && rc != MBUF_AGAIN) {
+		return -1;
+	}
+
+	for (;;) {
+		rc = pgr_mbuf_recv(l->be);
+		if (rc == MBUF_AGAIN) {
+			return 0;
+		}
+		if (rc <= 0) {
+			return -1;
+		}
+
+		a = l->listener.acks;
+		switch (pgr_mbuf_msgtype(l->be)) {
+		case 'A': /* NotificationResponse */
+			notify(w, l, l->be);
+			break;
+
+		case 'E': /* ErrorResponse */
+			if (a) {
+				a->failed = 1;
+				if (a->session) {
+					/* the client gets to see what went wrong */
+					len = htonl(pgr_mbuf_msglength(l->be) + 4);
+					pgr_mbuf_cat(a->session->be, "E", 1);
+					pgr_mbuf_cat(a->session->be, &len, 4);
+					pgr_mbuf_cat(a->session->be, pgr_mbuf_data(l->be, 0, 0), ntohl(len) - 4);
+				}
+			}
+			break;
+
+		case 'Z': /* ReadyForQuery */
+			if (!a) {
+				return -1; /* we never asked for that */
+			}
+			l->listener.acks = a->next;
+			if (a->channel && !a->failed) {
+				a->channel->live = 1;
+			}
+			if ((s = a->session) != NULL) {
+				if (a->failed) {
+					if (a->channel) {
+						drop(l, s, a->channel->name);
+					}
+					pgr_mbuf_cat(s->be, "Z\0\0\0\x05I", 6);
+				} else {
+					listened(s, LISTEN_ON);
+				}
+				s->state = SESSION_FRONTEND;
+				later(w, s);
+			}
+			free(a);
+			break;
+		}
+		pgr_mbuf_discard(l->be);
+	}
+}
+
+/* Hear out a listener, and shut it down if it broke, or
+   if no one is listening any more. */
+static void eavesdrop(WORKER *w, SESSION *l)
+{
+	if (hear(w, l) != 0) {
+		pgr_logf(stderr, LOG_ERR, "[worker] listener on writer %s:%d failed; hanging up on its subscribers",
+				l->writer.hostname, l->writer.port);
+		close_listener(w, l, 1);
+
+	} else if (!l->listener.channels && !l->listener.acks) {
+		close_listener(w, l, 0);
+	}
+}
+
+/* Where should this (simple Query or Parse) SQL go?  Asks
+   the query cache first, and only runs the classifier on
+   the query shapes it hasn't seen before.
+
+   A 25006 can only be blamed on the batch's query if it
+   had just the one, so only then is its fingerprint kept. */
+static int classify(WORKER *w, SESSION *s, const char *sql)
+{
+	uint64_t fp;
+	unsigned int gen;
+	int verdict, hit;
+
+	fp = pgr_sql_fingerprint(sql);
+	s->fingerprint = s->queries++ == 0 ? fp : 0;
+
+	/* (the verdict is only as good as the functions it was
+	    reached with, so it's cached under their generation) */
+	rdlock(&w->context->functions.lock, "functions", 0);
+	s->generation = gen = w->context->functions.generation;
+	verdict = pgr_qcache_get(w->context, fp, gen);
+	hit = verdict >= 0;
+	if (!hit) {
+		verdict = pgr_sql_classify(sql, w->context->functions.writers);
+	}
+	unlock(&w->context->functions.lock, "functions", 0);
+
+	if (!hit) {
+		pgr_qcache_put(w->context, fp, verdict, gen);
+	}
+	return verdict;
+}
+
+static int connect_backends(WORKER *w, SESSION *s)
+{
+	int rc;
+
+	if (determine_backends(w->context, &s->reader, &s->writer) != 0 ||
+	    pgr_conn_copy(&s->reader, &s->frontend)                != 0 ||
+	    pgr_conn_copy(&s->writer, &s->frontend)                != 0) {
+		return -1;
+	}
+
+	s->backend = &s->reader;
+	if (multiplexed(s)) {
+		/* borrowed as each transaction starts */
+		return 0;
+	}
+
+	/* the writer is connected on demand, by the first BEGIN
+	   (or write, or 25006 fallback) that needs it; most
+	   sessions never do, and the master has better things
+	   to do than fork backends for them.  The reader gets
+	   started now, while the client authenticates. */
+	rc = acquire(w, s, &s->reader);
+	return rc == MBUF_AGAIN ? 0 : rc;
+}
+
+/* Drive the session state machine as far as it will go,
+   until it has to wait for one of its descriptors.  Each
+   state reads from (or writes to) exactly one of them, so
+   an MBUF_AGAIN always leaves us waiting on an fd that we
+   know is not ready.  Returns 0 if the session should be
+   kept around, and non-zero if it's time to hang up. */
+static int step(WORKER *w, SESSION *s)
+{
+	const char *query;
+	char *channel;
+	STMT *st;
+	int rc;
+
+	if (s->state == SESSION_PIPE) {
+		drive(w, s);
+		return 0;
+	}
+	if (s->state == SESSION_LISTENER) {
+		eavesdrop(w, s);
+		return 0;
+	}
+
+	/* keep any backend startups moving along, whether or
+	   not the current state is waiting on them. */
+	rc = handshake(w, s, &s->reader);
+	if (rc != 0 && rc != MBUF_AGAIN) {
+		return -1;
+	}
+	rc = handshake(w, s, &s->writer);
+	if (rc != 0 && rc != MBUF_AGAIN) {
+		return -1;
+	}
+
+	for (;;) {
+		switch (s->state) {
+		case SESSION_STARTUP:
+			rc = pgr_mbuf_flush(s->be);
+			if (rc != 0) {
+				return rc == MBUF_AGAIN ? 0 : -1;
+			}
+
+			rc = pgr_conn_accept(&s->frontend, s->fe, s->be);
+			if (rc != 0 && rc != MBUF_AGAIN) {
+				pgr_mbuf_flush(s->be);
+				if (s->frontend.cancel.fd >= 0 && watch(w, s->frontend.cancel.fd, s) == 0) {
+					s->state = SESSION_CANCEL;
+					break;
+				}
+				return -1;
+			}
+
+			/* as soon as we know who the client claims to be,
+			   get the backend connections going, so that they
+			   start up while the password goes back and forth. */
+			if (!s->backend && s->frontend.pwhash) {
+				if (connect_backends(w, s) != 0) {
+					return -1;
+				}
+			}
+
+			if (rc == MBUF_AGAIN) {
+				if (s->be->fill > s->be->start) {
+					continue; /* flush our replies */
+				}
+				return 0;
+			}
+			s->state = SESSION_CONNECT;
+			break;
+
+		case SESSION_CANCEL:
+			/* a cancel's connection to the backend came up
+			   (or failed to); either way, the client's own
+			   connection is done with once it's been tried. */
+			rc = pgr_cancel_send(&s->frontend);
+			return rc == 1 ? 0 : -1;
+
+		case SESSION_CONNECT:
+			rc = pgr_mbuf_flush(s->be);
+			if (rc != 0) {
+				return rc == MBUF_AGAIN ? 0 : -1;
+			}
+
+			/* hold off on ReadyForQuery until the reader is;
+			   the client gets its ParameterStatus messages
+			   (saved when it first started up, even if that
+			   was for some other client) along with it. */
+			rc = acquire(w, s, &s->reader);
+			if (rc != 0) {
+				return rc == MBUF_AGAIN ? 0 : -1;
+			}
+
+			if (pgr_conn_ready(&s->frontend, &s->reader, s->be) != 0) {
+				return -1;
+			}
+			if (multiplexed(s)) {
+				release(w, s, &s->reader, 0);
+			}
+			s->state = SESSION_FRONTEND;
+			break;
+
+		case SESSION_FRONTEND:
+			if (s->streaming) {
+				rc = early(s);
+				if (rc != 0) {
+					return rc == MBUF_AGAIN ? 0 : -1;
+				}
+			}
+			rc = pgr_mbuf_flush(s->be);
+			if (rc != 0) {
+				return rc == MBUF_AGAIN ? 0 : -1;
+			}
+			if (s->notes && s->batch == 0) {
+				/* we're idle; pass along any notifications */
+				rc = pgr_mbuf_flush(s->notes);
+				if (rc != 0) {
+					return rc == MBUF_AGAIN ? 0 : -1;
+				}
+			}
+
+			if (s->fe->left == 0) {
+				pgr_debugf("reading message from frontend");
+				rc = pgr_mbuf_recv(s->fe);
+				if (rc == MBUF_AGAIN) {
+					return 0;
+				}
+				if (rc <= 0) {
+					return -1;
+				}
+
+				s->type = pgr_mbuf_msgtype(s->fe);
+				if (s->batch == 0) {
+					s->fingerprint = 0;
+					s->queries = 0;
+					s->opens = 0;
+					s->writes = 0;
+					s->deallocs = 0;
+
+					/* extended query batches are held back until
+					   their Sync (or Flush), so that we know (from
+					   their Parses) where the batch should go, and
+					   what statements it needs (see reprepare) */
+					s->holding = strchr("PBDECHS", s->type) != NULL;
+				}
+
+				/* could this batch share a writer connection? */
+				s->pipeable = (s->batch == 0 || s->pipeable) && pipeable(s->fe, s->batch == 0);
+				s->batch++;
+
+				if (s->type == 'X') {
+					release(w, s, &s->reader, 1);
+					release(w, s, &s->writer, 1);
+					return -1;
+				}
+
+				if (s->type == 'Q' && s->batch == 1 && !s->in_txn &&
+				    (rc = listening(s->fe, &channel)) != 0) {
+					/* the listener has it covered */
+					pgr_mbuf_discard(s->fe);
+					s->batch = 0;
+					rc = subscribe(w, s, rc, channel);
+					free(channel);
+					if (rc != 0) {
+						return -1;
+					}
+					break;
+				}
+
+				if (multiplexed(s) && !s->pinned && pins(s->fe)) {
+					pgr_logf(stderr, LOG_INFO, "[worker] client (fd %d) left state behind in its backend session; "
+							"pinning it to its backend connections", s->frontend.fd);
+					s->pinned = 1;
+				}
+				st = track(s, s->fe);
+
+				if ((query = statement(s->fe)) != NULL && deallocated(s, query)) {
+					s->deallocs = 1;
+				}
+				if ((query = statement(s->fe)) != NULL || (query = bound(s, s->fe, st)) != NULL) {
+					transaction(s, query);
+
+					/* don't make writes bounce off of a slave first;
+					   (whatever gets past us still gets a 25006) */
+					if (!s->in_txn && !s->streaming && s->opens != SQL_BEGIN_RO && s->backend == &s->reader
+					 && classify(w, s, query) == SQL_WRITE) {
+						pgr_debugf("query writes; sending %s to the writer",
+								s->type == 'Q' ? "it" : "the batch");
+						s->backend = &s->writer;
+						s->writes = 1;
+
+						if (s->type == 'Q' && multiplexed(s) && !s->pinned && s->pipeable && s->writer.fd < 0) {
+							/* it can share (see pump) */
+							if (pgr_mbuf_keep(s->fe) != 0) {
+								return -1;
+							}
+							s->state = SESSION_RESEND;
+							break;
+						}
+					}
+				}
+				if (s->pooling == POOL_STATEMENT && (s->type == 'Q' || s->type == 'S') && !s->in_txn &&
+				    s->backend == &s->reader && s->reader.fd < 0) {
+					/* autocommit read; any slave will do */
+					if (determine_backends(w->context, &s->reader, NULL) != 0) {
+						return -1;
+					}
+				}
+			}
+			if ((s->type == 'Q' || s->type == 'S') && !s->in_txn && !s->streaming &&
+			    s->backend == &s->reader) {
+				if (s->wrote) {
+					/* the first read since we wrote; the batch
+					   waits (in full) until we know where our
+					   write left the master */
+					rc = pgr_mbuf_keep(s->fe);
+					if (rc != 0) {
+						return rc == MBUF_AGAIN ? 0 : -1;
+					}
+					s->holding = 0;
+					s->state = SESSION_LSN;
+					break;
+				}
+				if (s->lsn && !caught_up(w, s)) {
+					pgr_debugf("reader has yet to replay our last write; sending %s to the writer",
+							s->type == 'Q' ? "it" : "the batch");
+					s->backend = &s->writer;
+				}
+			}
+
+			if (s->holding) {
+				/* not yet; the whole batch goes at once.  After
+				   a Flush, the client is waiting on its replies,
+				   and inside a transaction, there's nowhere else
+				   for the batch to go; either way, what we have
+				   goes now, and the rest follows as it comes. */
+				rc = pgr_mbuf_keep(s->fe);
+				if (rc != 0) {
+					return rc == MBUF_AGAIN ? 0 : -1;
+				}
+				if (s->type == 'S' || s->type == 'H' || s->in_txn) {
+					s->holding = 0;
+					s->streaming = s->type != 'S';
+					s->pipeable = s->pipeable && !s->streaming;
+					s->state = SESSION_RESEND;
+				}
+				break;
+			}
+
+			rc = acquire(w, s, s->backend);
+			if (rc != 0) {
+				return rc == MBUF_AGAIN ? 0 : -1;
+			}
+			if (s->fe->outfd != s->backend->fd) {
+				/* staged messages go where they were headed */
+				rc = pgr_mbuf_push(s->fe);
+				if (rc != 0) {
+					return rc == MBUF_AGAIN ? 0 : -1;
+				}
+				pgr_mbuf_setfd(s->fe, MBUF_SAME_FD, s->backend->fd);
+			}
+			aim(w, s, s->backend);
+
+			pgr_debugf("sending message to %s (fd %d)", role(s), s->backend->fd);
+			rc = pgr_mbuf_send(s->fe);
+			if (rc != 0) {
+				return rc == MBUF_AGAIN ? 0 : -1;
+			}
+
+			if (s->type == 'Q' || s->type == 'S') {
+				if (s->streaming) {
+					prepared(s, s->backend);
+				}
+				if (s->deallocs) {
+					pgr_conn_doubt(s->backend);
+				}
+				pgr_mbuf_setfd(s->be, s->backend->fd, MBUF_SAME_FD);
+				s->state = SESSION_BACKEND;
+			}
+			break;
+
+		case SESSION_BACKEND:
+			/* make sure the backend has the whole batch */
+			rc = pgr_mbuf_push(s->fe);
+			if (rc != 0) {
+				return rc == MBUF_AGAIN ? 0 : -1;
+			}
+
+			if (s->be->left == 0) {
+				pgr_debugf("reading message from %s (fd %d)", role(s), s->backend->fd);
+				rc = pgr_mbuf_recv(s->be);
+				if (rc == MBUF_AGAIN) {
+					return 0;
+				}
+				if (rc <= 0) {
+					return -1;
+				}
+
+				s->type = pgr_mbuf_msgtype(s->be);
+				if (s->type == 'Z') {
+					/* remember the transaction status, for pooling;
+					   while it's anything but idle, the session
+					   stays on this backend (see finish) */
+					s->backend->txn = *(char *)pgr_mbuf_data(s->be, 0, 1);
+					s->writes = s->writes && s->backend == &s->writer && s->backend->txn == 'I';
+					s->in_txn = s->backend->txn != 'I';
+					s->rw = s->in_txn && (s->rw || s->opens == SQL_BEGIN);
+				}
+				committed(s);
+
+				if (s->type == 'E' && s->touched) {
+					doubt(s, s->backend);
+				}
+
+				/* (a transaction already open on the reader can't
+				    be moved, and neither can a batch the client
+				    has had replies to; it gets the error instead) */
+				if (pgr_mbuf_iserror(s->be, "25006") == 0 && s->backend == &s->reader && !s->in_txn
+				 && !s->streaming) {
+					pgr_debugf("E25006 bad routing - ignoring remaining backend messages...");
+					if (s->fingerprint) {
+						/* next time, we'll know better */
+						pgr_qcache_put(w->context, s->fingerprint, SQL_WRITE, s->generation);
+					}
+					s->state = SESSION_DRAIN;
+					break;
+				}
+			}
+
+			pgr_debugf("relaying message to frontend (fd %d)", s->frontend.fd);
+			rc = pgr_mbuf_relay(s->be);
+			if (rc != 0) {
+				return rc == MBUF_AGAIN ? 0 : -1;
+			}
+
+			/* handle CopyInResponse by switching to sub-protocol */
+			if (s->type == 'G') {
+				pgr_debugf("switching to COPY DATA sub-protocol");
+				s->state = SESSION_COPYIN;
+
+			} else if (s->type == 'Z') {
+				s->wrote = s->wrote || s->writes;
+				finish(w, s);
+			}
+			break;
+
+		case SESSION_COPYIN:
+			/* make sure the client has the CopyInResponse */
+			rc = pgr_mbuf_push(s->be);
+			if (rc != 0) {
+				return rc == MBUF_AGAIN ? 0 : -1;
+			}
+
+			if (s->fe->left == 0) {
+				pgr_debugf("reading message from frontend (fd %d)", s->frontend.fd);
+				rc = pgr_mbuf_recv(s->fe);
+				if (rc == MBUF_AGAIN) {
+					return 0;
+				}
+				if (rc <= 0) {
+					return -1;
+				}
+
+				s->type = pgr_mbuf_msgtype(s->fe);
+			}
+
+			pgr_debugf("relaying message to %s (fd %d)", role(s), s->backend->fd);
+			rc = pgr_mbuf_relay(s->fe);
+			if (rc != 0) {
+				return rc == MBUF_AGAIN ? 0 : -1;
+			}
+
+			if (s->type == 'c' || s->type == 'f') {
+				pgr_debugf("returning to NORMAL protocol");
+				s->state = SESSION_BACKEND;
+			}
+			break;
+
+		case SESSION_DRAIN:
+			rc = pgr_mbuf_drain(s->be, 'Z');
+			if (rc != 0) {
+				return rc == MBUF_AGAIN ? 0 : -1;
+			}
+
+			s->backend = &s->writer;
+			s->writes = 1;
+			s->prepped = 0;
+			s->state = SESSION_RESEND;
+			break;
+
+		case SESSION_RESEND:
+			if (s->backend == &s->writer && multiplexed(s) && !s->in_txn && !s->pinned &&
+			    s->pipeable && s->writer.fd < 0) {
+				/* an autocommit write; it can share */
+				pgr_debugf("sending batch down the pipeline to the writer");
+				aim(w, s, NULL);
+				pipe_up(w, s);
+				s->state = SESSION_PIPED;
+				break;
+			}
+
+			rc = acquire(w, s, s->backend);
+			if (rc != 0) {
+				return rc == MBUF_AGAIN ? 0 : -1;
+			}
+			if (s->fe->outfd != s->backend->fd) {
+				pgr_mbuf_setfd(s->fe, MBUF_SAME_FD, s->backend->fd);
+				pgr_debugf("sending saved messages to %s (fd %d)", role(s), s->backend->fd);
+			}
+			pgr_mbuf_setfd(s->be, s->backend->fd, MBUF_SAME_FD);
+			aim(w, s, s->backend);
+
+			if (!s->prepped) {
+				s->prepped = 1;
+				s->prep = reprepare(s, s->backend);
+				if (s->prep) {
+					pgr_debugf("re-preparing statements on %s (fd %d)", role(s), s->backend->fd);
+					pgr_mbuf_setfd(s->prep, MBUF_NO_FD, s->backend->fd);
+					s->state = SESSION_PREPARE;
+					break;
+				}
+			}
+
+			rc = pgr_mbuf_resend(s->fe);
+			if (rc != 0) {
+				return rc == MBUF_AGAIN ? 0 : -1;
+			}
+			prepared(s, s->backend);
+			if (s->deallocs) {
+				pgr_conn_doubt(s->backend);
+			}
+			s->state = s->streaming ? SESSION_FRONTEND : SESSION_BACKEND;
+			break;
+
+		case SESSION_PREPARE:
+			/* our batch goes first, and its replies go nowhere */
+			rc = pgr_mbuf_flush(s->prep);
+			if (rc != 0) {
+				return rc == MBUF_AGAIN ? 0 : -1;
+			}
+
+			if (s->be->left == 0) {
+				rc = pgr_mbuf_recv(s->be);
+				if (rc == MBUF_AGAIN) {
+					return 0;
+				}
+				if (rc <= 0) {
+					return -1;
+				}
+
+				s->type = pgr_mbuf_msgtype(s->be);
+				if (s->type == 'Z') {
+					s->backend->txn = *(char *)pgr_mbuf_data(s->be, 0, 1);
+				}
+				if (s->type == 'E') {
+					pgr_logf(stderr, LOG_ERR, "[worker] failed to re-prepare statements for client (fd %d) "
+							"on %s (fd %d)", s->frontend.fd, role(s), s->backend->fd);
+					doubt(s, s->backend);
+				}
+			}
+
+			rc = pgr_mbuf_discard(s->be);
+			if (rc != 0) {
+				return rc == MBUF_AGAIN ? 0 : -1;
+			}
+			if (s->type == 'Z') {
+				pgr_mbuf_free(s->prep);
+				s->prep = NULL;
+				s->state = SESSION_RESEND;
+			}
+			break;
+
+		case SESSION_LSN:
+			/* ask the master where its xlog is at (see locate)
+			   before the batch goes anywhere; the replies to
+			   our query go nowhere */
+			rc = acquire(w, s, &s->writer);
+			if (rc != 0) {
+				return rc == MBUF_AGAIN ? 0 : -1;
+			}
+			if (!s->prep) {
+				s->prep = locate(w, &s->writer);
+				pgr_mbuf_setfd(s->be, s->writer.fd, MBUF_SAME_FD);
+			}
+			rc = pgr_mbuf_flush(s->prep);
+			if (rc != 0) {
+				return rc == MBUF_AGAIN ? 0 : -1;
+			}
+
+			if (s->be->left == 0) {
+				rc = pgr_mbuf_recv(s->be);
+				if (rc == MBUF_AGAIN) {
+					return 0;
+				}
+				if (rc <= 0) {
+					return -1;
+				}
+
+				s->type = pgr_mbuf_msgtype(s->be);
+				if (s->type == 'Z') {
+					s->writer.txn = *(char *)pgr_mbuf_data(s->be, 0, 1);
+				}
+				if (s->type == 'D') {
+					located(s, s->be);
+				}
+			}
+
+			rc = pgr_mbuf_discard(s->be);
+			if (rc != 0) {
+				return rc == MBUF_AGAIN ? 0 : -1;
+			}
+			if (s->type == 'Z') {
+				pgr_mbuf_free(s->prep);
+				s->prep = NULL;
+				s->wrote = 0;
+				if (!caught_up(w, s)) {
+					pgr_debugf("reader has yet to replay our last write; sending the batch to the writer");
+					s->backend = &s->writer;
+				} else if (multiplexed(s) && !s->pinned && s->writer.txn == 'I') {
+					release(w, s, &s->writer, 0);
+				}
+				s->state = SESSION_RESEND;
+			}
+			break;
+
+		case SESSION_LISTENING:
+			/* the listener will get back to us (see hear) */
+			return 0;
+
+		case SESSION_PIPED:
+			/* the pipeline does all the work (see pump) */
+			drive(w, s->pipeline.pipe);
+			if (s->state == SESSION_PIPED || s->state == SESSION_CLOSED) {
+				return 0;
+			}
+			break;
+
+		default:
+			return -1;
+		}
+	}
+}
+
+static void accept_clients(WORKER *w)
+{
+	int i, connfd;
+	SESSION *s;
+
+	for (i = 0; i < sizeof(w->listen)/sizeof(w->listen[0]); i++) {
+		if (w->listen[i] < 0) {
+			continue;
+		}
+
+		for (;;) {
+			char remote_addr[INET6_ADDRSTRLEN+1];
+			struct sockaddr_storage peer;
+			socklen_t peer_len = sizeof(peer);
+
+			connfd = accept(w->listen[i], (struct sockaddr*)&peer, &peer_len);
+			if (connfd < 0) {
+				if (errno == EINTR || errno == ECONNABORTED) {
+					continue;
+				}
+				if (errno != EAGAIN && errno != EWOULDBLOCK) {
+					pgr_logf(stderr, LOG_ERR, "[worker] accept received system error: %s (errno %d)",
+							strerror(errno), errno);
+				}
+				break;
+			}
+			if (nonblocking(connfd) != 0) {
+				pgr_logf(stderr, LOG_ERR, "[worker] unable to make client socket (fd %d) non-blocking: %s (errno %d)",
+						connfd, strerror(errno), errno);
+				close(connfd);
+				continue;
+			}
+
+			switch (peer.ss_family) {
+			case AF_INET:
+				memset(remote_addr, 0, sizeof(remote_addr));
+				inet_ntop(AF_INET, &((struct sockaddr_in*)&peer)->sin_addr,
+					remote_addr, sizeof(remote_addr)),
+				pgr_logf(stderr, LOG_INFO, "[worker] inbound connection from %s:%d",
+						remote_addr, ((struct sockaddr_in*)&peer)->sin_port);
+				break;
+
+			case AF_INET6:
+				memset(remote_addr, 0, sizeof(remote_addr));
+				inet_ntop(AF_INET6, &((struct sockaddr_in6*)&peer)->sin6_addr,
+					remote_addr, sizeof(remote_addr)),
+				pgr_logf(stderr, LOG_INFO, "[worker] inbound connection from %s:%d",
+						remote_addr, ((struct sockaddr_in6*)&peer)->sin6_port);
+				break;
+			}
+
+			pgr_msgf(stderr, "Handling new inbound client connection (fd %d)", connfd);
+			s = new_session(w, connfd);
+			if (watch(w, connfd, s) != 0) {
+				end_session(w, s);
+			}
+		}
+	}
+}
+
+static void* do_worker(void *_w)
+{
+	WORKER *w = (WORKER*)_w;
+	CONTEXT *c = w->context;
+	struct epoll_event events[MAX_EVENTS];
+	int i, n;
+	SESSION *s, *waiting, **ss;
+
+	if (c->frontends4 || c->frontends6) {
+		/* SO_REUSEPORT: we have listeners all to ourselves */
+		w->listen[0] = c->frontends4[w->id];
+		w->listen[1] = c->frontends6[w->id];
+	} else {
+		w->listen[0] = c->frontend4;
+		w->listen[1] = c->frontend6;
+	}
+
+	w->epfd = epoll_create1(0);
+	if (w->epfd < 0) {
+		pgr_logf(stderr, LOG_ERR, "[worker] failed to create epoll instance: %s (errno %d)",
+				strerror(errno), errno);
+		pgr_abort(ABORT_SYSCALL);
+	}
+
+	/* the frontend sockets may be shared with other workers,
+	   so we must never block in accept() if one of them beats
+	   us to an inbound connection. */
+	for (i = 0; i < sizeof(w->listen)/sizeof(w->listen[0]); i++) {
+		if (w->listen[i] >= 0 && (nonblocking(w->listen[i]) != 0 || watch(w, w->listen[i], NULL) != 0)) {
+			pgr_abort(ABORT_NET);
+		}
+	}
+
+	for (;;) {
+		n = epoll_wait(w->epfd, events, MAX_EVENTS, w->queued ? QUEUE_POLL_MS : -1);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			pgr_logf(stderr, LOG_ERR, "[worker] epoll_wait received system error: %s (errno %d)",
+					strerror(errno), errno);
+			pgr_abort(ABORT_SYSCALL);
+		}
+
+		for (i = 0; i < n; i++) {
+			if (events[i].data.ptr == w) {
+				accept_clients(w);
+				continue;
+			}
+
+			s = (SESSION*)events[i].data.ptr;
+			if (s->state != SESSION_CLOSED && step(w, s) != 0) {
+				end_session(w, s);
+			}
+		}
+
+		/* sessions waiting in line for a backend connection
+		   have no descriptor to wake them up, so we check
+		   back on them every so often. */
+		waiting = w->queued;
+		w->queued = NULL;
+		while (waiting) {
+			s = waiting;
+			waiting = s->qnext;
+			s->queued = 0;
+			if (s->state != SESSION_CLOSED && step(w, s) != 0) {
+				end_session(w, s);
+			}
+		}
+
+		/* sessions can show up more than once in the events
+		   array, so we wait until we're through with it to
+		   free the ones that hung up (and that may have been
+		   put back in line since we last went through it). */
+		for (ss = &w->queued; *ss; ) {
+			if ((*ss)->state == SESSION_CLOSED) {
+				*ss = (*ss)->qnext;
+			} else {
+				ss = &(*ss)->qnext;
+			}
+		}
+		while (w->dead) {
+			s = w->dead;
+			w->dead = s->next;
+			free(s);
+		}
+	}
+
+	close(w->epfd);
+	return NULL;
+}
+
+int pgr_worker(CONTEXT *c, int id, pthread_t *tid)
+{
+	WORKER *w = calloc(1, sizeof(WORKER));
+	if (!w) {
+		pgr_abort(ABORT_MEMFAIL);
+	}
+	w->context = c;
+	w->id = id;
+
+	int rc = pthread_create(tid, NULL, do_worker, w);
 	if (rc != 0) {
+		free(w);
 		pgr_logf(stderr, LOG_ERR, "[worker] failed to spin up: %s (errno %d)",
 				strerror(errno), errno);
 		return 1;